@@ -0,0 +1,546 @@
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <iomanip>
+#include "patches.hpp"
+
+using namespace patches2d;
+
+
+
+
+// ============================================================================
+static volatile double sink = 0.0;
+
+static Database::Array make_patch(int ni, int nj, int nf)
+{
+    auto A = Database::Array(ni, nj, nf);
+
+    for (int i = 0; i < ni; ++i)
+        for (int j = 0; j < nj; ++j)
+            for (int k = 0; k < nf; ++k)
+                A(i, j, k) = i + 1e-3 * j + 1e-6 * k;
+
+    return A;
+}
+
+static Database::Array zero_boundary(Database::Index, PatchBoundary edge, int depth, const Database::Array& patch)
+{
+    switch (edge)
+    {
+        case PatchBoundary::il:
+        case PatchBoundary::ir: return Database::Array(depth, patch.shape(1), patch.shape(2));
+        case PatchBoundary::jl:
+        case PatchBoundary::jr: return Database::Array(patch.shape(0), depth, patch.shape(2));
+        default: return Database::Array(depth, depth, patch.shape(2));
+    }
+}
+
+
+
+
+/**
+ * Build a 4x4 level-0 mesh, with the block at (1, 1) replaced by four level-1
+ * patches, so that the patches around it have coarse/fine boundaries.
+ */
+static Database make_refined_database(int ni, int nj, int nf)
+{
+    auto header = Database::Header{{Field::conserved, FieldDescriptor(nf, MeshLocation::cell)}};
+    auto database = Database(ni, nj, header);
+
+    for (int i = 0; i < 4; ++i)
+    {
+        for (int j = 0; j < 4; ++j)
+        {
+            if (i != 1 || j != 1)
+            {
+                database.insert(std::make_tuple(i, j, 0, Field::conserved), make_patch(ni, nj, nf));
+            }
+        }
+    }
+    for (int i = 2; i < 4; ++i)
+    {
+        for (int j = 2; j < 4; ++j)
+        {
+            database.insert(std::make_tuple(i, j, 1, Field::conserved), make_patch(ni, nj, nf));
+        }
+    }
+    database.set_boundary_value(zero_boundary);
+    return database;
+}
+
+
+/**
+ * The synthetic meshes of the benchmark suite. Each starts from a uniform
+ * 4x4 level-0 mesh: quadrant refines the lower-left 2x2 blocks once, and
+ * nested refines the lower-left block again at each level, down to level
+ * 4. Regrid keeps the nested mesh balanced.
+ */
+enum class Hierarchy { uniform, quadrant, nested };
+
+static std::string to_string(Hierarchy hierarchy)
+{
+    switch (hierarchy)
+    {
+        case Hierarchy::uniform: return "uniform";
+        case Hierarchy::quadrant: return "quadrant";
+        case Hierarchy::nested: return "nested";
+    }
+    return "";
+}
+
+static Database make_hierarchy(Hierarchy hierarchy, int block_size, int num_fields)
+{
+    auto header = Database::Header{{Field::conserved, FieldDescriptor(num_fields, MeshLocation::cell)}};
+    auto database = Database(block_size, block_size, header);
+
+    for (int i = 0; i < 4; ++i)
+    {
+        for (int j = 0; j < 4; ++j)
+        {
+            database.insert(std::make_tuple(i, j, 0, Field::conserved), make_patch(block_size, block_size, num_fields));
+        }
+    }
+    database.set_boundary_value(zero_boundary);
+
+    switch (hierarchy)
+    {
+        case Hierarchy::uniform:
+            break;
+        case Hierarchy::quadrant:
+            database.regrid(Field::conserved, [] (Database::Index index, const Database::Array&)
+            {
+                return std::get<0>(index) < 2 && std::get<1>(index) < 2;
+            }, 1);
+            break;
+        case Hierarchy::nested:
+            for (int level = 0; level < 4; ++level)
+            {
+                database.regrid(Field::conserved, [level] (Database::Index index, const Database::Array&)
+                {
+                    return std::get<0>(index) == 0 && std::get<1>(index) == 0 && std::get<2>(index) == level;
+                }, 4);
+            }
+            break;
+    }
+    return database;
+}
+
+
+
+
+// ============================================================================
+template<typename Function>
+static double time_per_call(Function f, int repetitions)
+{
+    auto start = std::chrono::high_resolution_clock::now();
+
+    for (int n = 0; n < repetitions; ++n)
+    {
+        f();
+    }
+    auto stop = std::chrono::high_resolution_clock::now();
+    return std::chrono::duration<double>(stop - start).count() / repetitions;
+}
+
+/**
+ * The whole-patch path which fetch used before it read guard strips: each
+ * neighbor of the target is first built in full by
+ * Database::reference_patch, and only then is the strip needed copied out
+ * of it. Cell data only; neighbors outside the mesh are zero, as in
+ * zero_boundary.
+ */
+static Database::Array whole_patch_fetch(const Database& database, Database::Index index, int guard)
+{
+    auto _ = nd::axis::all();
+    const auto& target = database.at(index);
+    auto ni = target.shape(0);
+    auto nj = target.shape(1);
+    auto nf = target.shape(2);
+    auto res = Database::Array(ni + 2 * guard, nj + 2 * guard, nf);
+
+    for (int di = -1; di <= 1; ++di)
+    {
+        for (int dj = -1; dj <= 1; ++dj)
+        {
+            auto i0 = di < 0 ? ni - guard : 0, i1 = di > 0 ? guard : ni;
+            auto j0 = dj < 0 ? nj - guard : 0, j1 = dj > 0 ? guard : nj;
+            auto p0 = di < 0 ? 0 : (di > 0 ? guard + ni : guard);
+            auto q0 = dj < 0 ? 0 : (dj > 0 ? guard + nj : guard);
+            auto p1 = p0 + (i1 - i0);
+            auto q1 = q0 + (j1 - j0);
+            auto A = database.reference_patch(std::make_tuple(std::get<0>(index) + di, std::get<1>(index) + dj, std::get<2>(index), std::get<3>(index)));
+
+            if (A.size() == 0)
+            {
+                A.become(Database::Array(ni, nj, nf));
+            }
+            res.select(_|p0|p1, _|q0|q1, _) = A.select(_|i0|i1, _|j0|j1, _);
+        }
+    }
+    return res;
+}
+
+static void benchmark_coarse_fine_fetch(int block_size, int num_fields, int guard, std::string label="")
+{
+    auto database = make_refined_database(block_size, block_size, num_fields);
+    auto coarse = std::vector<Database::Index>{
+        std::make_tuple(0, 1, 0, Field::conserved),
+        std::make_tuple(2, 1, 0, Field::conserved),
+        std::make_tuple(1, 0, 0, Field::conserved),
+        std::make_tuple(1, 2, 0, Field::conserved),
+    };
+    auto fine = std::vector<Database::Index>{
+        std::make_tuple(2, 2, 1, Field::conserved),
+        std::make_tuple(2, 3, 1, Field::conserved),
+        std::make_tuple(3, 2, 1, Field::conserved),
+        std::make_tuple(3, 3, 1, Field::conserved),
+    };
+    auto repetitions = std::max(1, (1 << 22) / (block_size * block_size * num_fields));
+
+    for (const auto& targets : {coarse, fine})
+    {
+        for (auto index : targets)
+        {
+            auto a = database.fetch(index, guard);
+            auto b = whole_patch_fetch(database, index, guard);
+
+            if (std::memcmp(&a(0, 0, 0), &b(0, 0, 0), a.size() * sizeof(double)))
+            {
+                throw std::logic_error("the whole-patch fetch of " + to_string(index) + " disagrees with fetch");
+            }
+        }
+    }
+    auto t_restrict = time_per_call([&] { for (auto index : coarse) database.fetch(index, guard); }, repetitions) / coarse.size();
+    auto t_prolong  = time_per_call([&] { for (auto index : fine)   database.fetch(index, guard); }, repetitions) / fine.size();
+    auto r_restrict = time_per_call([&] { for (auto index : coarse) whole_patch_fetch(database, index, guard); }, repetitions) / coarse.size();
+    auto r_prolong  = time_per_call([&] { for (auto index : fine)   whole_patch_fetch(database, index, guard); }, repetitions) / fine.size();
+
+    std::cout
+    << std::setw(8) << label
+    << std::setw(6) << block_size
+    << std::setw(6) << num_fields
+    << std::setw(6) << guard
+    << std::setw(12) << std::fixed << std::setprecision(2) << t_restrict * 1e6
+    << std::setw(12) << std::fixed << std::setprecision(2) << r_restrict * 1e6
+    << std::setw(12) << std::fixed << std::setprecision(2) << t_prolong * 1e6
+    << std::setw(12) << std::fixed << std::setprecision(2) << r_prolong * 1e6
+    << std::endl;
+}
+
+
+/**
+ * Compare patch lookups in the database against lookups in a std::map of
+ * the same patches, which was the database's storage originally.
+ */
+static void benchmark_lookup(int num_blocks)
+{
+    auto header = Database::Header{{Field::conserved, FieldDescriptor(1, MeshLocation::cell)}};
+    auto database = Database(4, 4, header);
+    auto reference = std::map<Database::Index, Database::Array>();
+    auto queries = std::vector<Database::Index>();
+
+    for (int i = 0; i < num_blocks; ++i)
+    {
+        for (int j = 0; j < num_blocks; ++j)
+        {
+            auto index = std::make_tuple(i, j, 0, Field::conserved);
+            auto patch = make_patch(4, 4, 1);
+            database.insert(index, patch);
+            reference[index] = patch.copy();
+            queries.push_back(std::make_tuple((i * 7919 + j) % num_blocks, (j * 104729 + i) % num_blocks, 0, Field::conserved));
+        }
+    }
+    auto sum = 0.0;
+    auto t_map = time_per_call([&] { for (auto index : queries) sum += reference.at(index)(0, 0, 0); }, 10) / queries.size();
+    auto t_db  = time_per_call([&] { for (auto index : queries) sum += database.at(index)(0, 0, 0); }, 10) / queries.size();
+
+    std::cout
+    << std::setw(10) << queries.size()
+    << std::setw(16) << std::fixed << std::setprecision(1) << t_map * 1e9
+    << std::setw(16) << std::fixed << std::setprecision(1) << t_db * 1e9
+    << std::endl;
+    sink = sum;
+}
+
+
+
+
+// ============================================================================
+/**
+ * Enough repetitions of an operation touching the given number of bytes
+ * that each measurement moves about 128 MB.
+ */
+static int repetitions_for(std::size_t bytes)
+{
+    return int(std::max(std::size_t(1), std::min(std::size_t(1000), (std::size_t(1) << 27) / std::max(bytes, std::size_t(1)))));
+}
+
+static void print_suite_header()
+{
+    std::cout
+    << std::setw(10) << "operation"
+    << std::setw(10) << "mesh"
+    << std::setw(6) << "ni"
+    << std::setw(6) << "nf"
+    << std::setw(6) << "ng"
+    << std::setw(9) << "patches"
+    << std::setw(14) << "us per call"
+    << std::setw(14) << "patches/s"
+    << std::setw(10) << "GB/s"
+    << std::endl;
+}
+
+/**
+ * Print one row of the suite: the operation processed the given number of
+ * patches and bytes in the given time per call. Operations which only copy
+ * references to the data pass zero bytes, and no bandwidth is printed.
+ */
+static void print_suite_row(std::string operation, Hierarchy hierarchy, int block_size, int num_fields, int guard, std::size_t patches, std::size_t bytes, double seconds)
+{
+    std::cout
+    << std::setw(10) << operation
+    << std::setw(10) << to_string(hierarchy)
+    << std::setw(6) << block_size
+    << std::setw(6) << num_fields
+    << std::setw(6) << guard
+    << std::setw(9) << patches
+    << std::setw(14) << std::fixed << std::setprecision(2) << seconds * 1e6
+    << std::setw(14) << std::fixed << std::setprecision(0) << patches / seconds;
+
+    if (bytes)
+    {
+        std::cout << std::setw(10) << std::fixed << std::setprecision(3) << bytes / seconds * 1e-9;
+    }
+    else
+    {
+        std::cout << std::setw(10) << "-";
+    }
+    std::cout << std::endl;
+}
+
+/**
+ * Time the main database operations on one synthetic mesh. Byte counts are
+ * the data each operation writes: the padded patches of a fetch, the
+ * committed, assembled, or serialized patches, and the new patches made by
+ * a regrid. For regrid, the level-0 block at (3, 3) is refined and then
+ * coarsened again, and the time is per regrid call.
+ */
+static void benchmark_suite(Hierarchy hierarchy, int block_size, int num_fields)
+{
+    auto database = make_hierarchy(hierarchy, block_size, num_fields);
+    auto keys = std::vector<Database::Index>();
+    auto patch_bytes = std::size_t(block_size) * block_size * num_fields * sizeof(double);
+
+    for (const auto& patch : database)
+    {
+        keys.push_back(patch.first);
+    }
+
+    for (int guard : {1, 2, 4})
+    {
+        auto padded = std::size_t(block_size + 2 * guard) * (block_size + 2 * guard) * num_fields * sizeof(double) * keys.size();
+        auto t = time_per_call([&] { for (auto index : keys) database.fetch(index, guard); }, repetitions_for(padded));
+        print_suite_row("fetch", hierarchy, block_size, num_fields, guard, keys.size(), padded, t);
+    }
+
+    {
+        auto data = database.all(Field::conserved);
+
+        for (auto& patch : data)
+        {
+            patch.second = patch.second.copy();
+        }
+        auto bytes = patch_bytes * keys.size();
+        auto t = time_per_call([&] { for (const auto& patch : data) database.commit(patch.first, patch.second, 0.5); }, repetitions_for(bytes));
+        print_suite_row("commit", hierarchy, block_size, num_fields, 0, keys.size(), bytes, t);
+    }
+
+    {
+        // --------------------------------------------------------------------
+        // The level-0 row at i = 3 is not refined in any of the meshes.
+        // --------------------------------------------------------------------
+        auto bytes = patch_bytes * 4;
+        auto t = time_per_call([&] { sink = database.assemble(3, 4, 0, 4, 0, Field::conserved)(0, 0, 0); }, repetitions_for(bytes));
+        print_suite_row("assemble", hierarchy, block_size, num_fields, 0, 4, bytes, t);
+    }
+
+    {
+        auto t = time_per_call([&] { sink = double(database.all(Field::conserved).size()); }, 1000);
+        print_suite_row("all", hierarchy, block_size, num_fields, 0, keys.size(), 0, t);
+    }
+
+    {
+        // --------------------------------------------------------------------
+        // Reductions and a quick-look image of the whole level-0 domain,
+        // reduced by 4, first from the patch data and then from the kept
+        // summaries (the /s rows), which are all current after the first
+        // call.
+        // --------------------------------------------------------------------
+        auto bytes = patch_bytes * keys.size();
+        auto image = std::size_t(block_size) * block_size * num_fields * sizeof(double);
+        auto t_reduce = time_per_call([&] { sink = database.reduce(Field::conserved).sum[0]; }, repetitions_for(bytes));
+        auto t_image = time_per_call([&] { sink = database.assemble(0, 4, 0, 4, 0, Field::conserved, 4)(0, 0, 0); }, repetitions_for(bytes));
+        database.set_summaries(Field::conserved, true);
+        auto t_reduce_cached = time_per_call([&] { sink = database.reduce(Field::conserved).sum[0]; }, repetitions_for(bytes));
+        auto t_image_cached = time_per_call([&] { sink = database.assemble(0, 4, 0, 4, 0, Field::conserved, 4)(0, 0, 0); }, repetitions_for(image));
+        database.set_summaries(Field::conserved, false);
+        print_suite_row("reduce", hierarchy, block_size, num_fields, 0, keys.size(), 0, t_reduce);
+        print_suite_row("reduce/s", hierarchy, block_size, num_fields, 0, keys.size(), 0, t_reduce_cached);
+        print_suite_row("image", hierarchy, block_size, num_fields, 0, keys.size(), image, t_image);
+        print_suite_row("image/s", hierarchy, block_size, num_fields, 0, keys.size(), image, t_image_cached);
+    }
+
+    {
+        auto filename = std::string("benchmarks.bin");
+        auto bytes = patch_bytes * keys.size();
+        auto repetitions = std::min(10, repetitions_for(bytes));
+
+        auto t_dump = time_per_call([&]
+        {
+            database.dump(BinarySerializer(filename, BinarySerializer::Mode::write));
+        }, repetitions);
+
+        auto t_load = time_per_call([&]
+        {
+            auto loaded = Database::load(BinarySerializer(filename, BinarySerializer::Mode::read));
+            sink = double(loaded.size());
+        }, repetitions);
+
+        print_suite_row("dump", hierarchy, block_size, num_fields, 0, keys.size(), bytes, t_dump);
+        print_suite_row("load", hierarchy, block_size, num_fields, 0, keys.size(), bytes, t_load);
+        std::remove(filename.c_str());
+    }
+
+    {
+        auto refine = [] (Database::Index index, const Database::Array&)
+        {
+            return std::get<2>(index) == 0 && std::get<0>(index) == 3 && std::get<1>(index) == 3 ? 1 : 0;
+        };
+        auto restore = [] (Database::Index index, const Database::Array&)
+        {
+            return std::get<2>(index) == 1 && std::get<0>(index) >= 6 && std::get<1>(index) >= 6 ? -1 : 0;
+        };
+        auto bytes = patch_bytes * 5;
+        auto repetitions = std::min(100, repetitions_for(bytes));
+        auto changed = std::size_t(0);
+
+        auto t = time_per_call([&]
+        {
+            changed += database.regrid(Field::conserved, refine);
+            changed += database.regrid(Field::conserved, restore);
+        }, repetitions) / 2;
+
+        if (changed != std::size_t(2 * repetitions))
+        {
+            throw std::logic_error("regrid benchmark did not refine and coarsen the block");
+        }
+        print_suite_row("regrid", hierarchy, block_size, num_fields, 0, 5, bytes, t);
+    }
+}
+
+
+
+
+// ============================================================================
+int main(int argc, const char* argv[])
+{
+    // ------------------------------------------------------------------------
+    // With no arguments every section is run; otherwise only the sections
+    // named: suite, kernels, or lookup. The suite is the baseline for
+    // performance changes to the database.
+    // ------------------------------------------------------------------------
+    auto run = [argc, argv] (const char* section)
+    {
+        if (argc < 2)
+        {
+            return true;
+        }
+        for (int n = 1; n < argc; ++n)
+        {
+            if (std::strcmp(argv[n], section) == 0)
+            {
+                return true;
+            }
+        }
+        return false;
+    };
+
+    if (run("suite"))
+    {
+        std::cout << "database operations on synthetic meshes\n\n";
+        print_suite_header();
+
+        for (auto hierarchy : {Hierarchy::uniform, Hierarchy::quadrant, Hierarchy::nested})
+        {
+            for (int block_size : {16, 32, 64, 128, 256})
+            {
+                for (int num_fields : {1, 4, 8})
+                {
+                    benchmark_suite(hierarchy, block_size, num_fields);
+                }
+            }
+        }
+        std::cout << "\n";
+    }
+
+    if (run("kernels"))
+    {
+        std::cout << "fetch at coarse/fine boundaries, by strips and by whole neighbor patches (microseconds per fetch)\n\n";
+        std::cout
+        << std::setw(8) << "kernels"
+        << std::setw(6) << "ni"
+        << std::setw(6) << "nf"
+        << std::setw(6) << "ng"
+        << std::setw(12) << "coarse"
+        << std::setw(12) << "(whole)"
+        << std::setw(12) << "fine"
+        << std::setw(12) << "(whole)"
+        << std::endl;
+
+        for (int block_size : {32, 64, 128, 256})
+        {
+            for (int guard : {1, 2, 4})
+            {
+                benchmark_coarse_fine_fetch(block_size, 4, guard, to_string(kernel_isa()));
+            }
+        }
+        std::cout << "\n";
+
+        auto best = kernel_isa();
+
+        for (auto isa : {KernelIsa::scalar, KernelIsa::avx2, KernelIsa::avx512, KernelIsa::neon})
+        {
+            try
+            {
+                set_kernel_isa(isa);
+            }
+            catch (const std::invalid_argument&)
+            {
+                continue;
+            }
+            for (int num_fields : {1, 2, 4, 5, 8})
+            {
+                benchmark_coarse_fine_fetch(128, num_fields, 2, to_string(isa));
+            }
+        }
+        set_kernel_isa(best);
+    }
+
+    if (run("lookup"))
+    {
+        std::cout << "\npatch lookup (nanoseconds per lookup)\n\n";
+        std::cout
+        << std::setw(10) << "patches"
+        << std::setw(16) << "std::map"
+        << std::setw(16) << "database"
+        << std::endl;
+
+        for (int num_blocks : {32, 100, 200})
+        {
+            benchmark_lookup(num_blocks);
+        }
+    }
+    return 0;
+}
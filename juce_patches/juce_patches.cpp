@@ -4,4 +4,5 @@
 
 #include "juce_patches.h"
 #include "src/patches.cpp"
+#include "src/patches3d.cpp"
 #include "src/serializer.cpp"
@@ -18,4 +18,5 @@ END_JUCE_MODULE_DECLARATION
 #define JUCE_PATCHES_INCLUDED
 #include <juce_ndarray/juce_ndarray.h>
 #include <juce_patches/src/patches.hpp>
+#include <juce_patches/src/patches3d.hpp>
 #include <juce_patches/src/serializer.hpp>
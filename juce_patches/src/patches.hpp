@@ -1,7 +1,21 @@
 #pragma once
+#include <algorithm>
 #include <array>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <limits>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <set>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 
 
@@ -10,8 +24,14 @@
 namespace patches2d {
 
 
+    class ArrayPool;
+    class BinarySerializer;
     class Database;
+    class LevelScheduler;
+    class PatchKey;
     class Serializer;
+    class ThreadPool;
+    class Transport;
 
 
     // ========================================================================
@@ -26,6 +46,8 @@ namespace patches2d {
         face_velocity_j,
         conserved,
         primitive,
+        flux_i,
+        flux_j,
     };
 
 
@@ -40,18 +62,177 @@ namespace patches2d {
 
 
     // ========================================================================
+    /**
+     * Memory layouts of the arrays of a field: interleaved (array of
+     * structs), with shape [ni, nj, num_fields], or planar (struct of
+     * arrays), with shape [num_fields, ni, nj], so that each component is a
+     * contiguous 2D array. The database stores every field interleaved.
+     * The arrays passed to insert, commit, and the boundary value,
+     * prolongation, restriction, and refinement callbacks, and those
+     * returned by fetch and its variants, assemble, all, and view, are in
+     * the field's layout; they are transposed as part of the copy which is
+     * made anyway. Serializers write each field in its layout. The stored
+     * arrays themselves (at, iteration, assemble_view, serve, and guard
+     * programs) and fetch_interleaved are always interleaved.
+     */
+    enum class Layout
+    {
+        aos, soa,
+    };
+
+
+    // ========================================================================
+    /**
+     * The four edges of a patch, followed by its four corners. The corner
+     * il_jl is the one where the il and jl edges meet, and so on.
+     */
     enum class PatchBoundary
     {
-        il, ir, jl, jr,
+        il, ir, jl, jr, il_jl, il_jr, ir_jl, ir_jr,
+    };
+
+
+    // ========================================================================
+    /**
+     * Built-in schemes for prolonging cell data from a coarse patch onto the
+     * next finer level. The default is piecewise constant (injection). The
+     * linear schemes reconstruct a slope in each coarse cell, limited with
+     * the minmod or monotonized-central limiter, and are conservative. In
+     * the coarse cells facing the fine patch being fetched, the neighbor
+     * value across the coarse/fine interface is the restriction of that
+     * patch's own boundary cells. Along the other edges of the coarse patch
+     * the slopes are set to zero.
+     */
+    enum class ProlongationScheme
+    {
+        piecewise_constant, linear_minmod, linear_mc,
+    };
+
+
+    // ========================================================================
+    /**
+     * Built-in schemes for restricting cell data from the four children on
+     * the next finer level. The default is the plain average. The volume
+     * weighted average uses the children's Field::cell_volume patches, which
+     * must then exist in the database.
+     */
+    enum class RestrictionScheme
+    {
+        average, volume_weighted,
+    };
+
+
+    // ========================================================================
+    /**
+     * Instruction sets for which the prolongation and restriction kernels
+     * used by fetch are compiled. The best one supported by the running CPU
+     * is picked at startup.
+     */
+    enum class KernelIsa
+    {
+        scalar, avx2, avx512, neon,
+    };
+
+
+    // ========================================================================
+    /**
+     * Compression schemes for patch data in checkpoints and in cold storage.
+     * The lossless scheme XORs each value with the same component of the
+     * previous cell, shuffles the bytes by significance, and run-length
+     * encodes them; it suits smooth and uniform data, like the geometric
+     * fields. The lossy scheme rounds each value to a multiple of a given
+     * tolerance, so that the error is at most half the tolerance, and
+     * stores the differences of the rounded values as variable-length
+     * integers.
+     */
+    enum class Compression
+    {
+        none, lossless, lossy,
+    };
+
+
+    // ========================================================================
+    /**
+     * Orders in which the patches of a database are visited and partitioned:
+     * by index (i, then j, then level, then field), or by the position of
+     * their block along a Morton (Z-order) or Hilbert space-filling curve,
+     * with each block placed just before its descendants on finer levels.
+     * Neighboring blocks are close together along the curves, and more so
+     * along the Hilbert curve.
+     */
+    enum class Ordering
+    {
+        index, morton, hilbert,
+    };
+
+
+    // ========================================================================
+    /**
+     * Operations counted by the instrumentation layer, which is compiled in
+     * when PATCHES_PROFILE is defined, and removed entirely otherwise. The
+     * guard zone regions of a fetch are counted by where their data comes
+     * from: same-level neighbors, prolongation from coarser patches,
+     * restriction from finer ones, or the boundary value callback. Reads and
+     * writes through a Serializer are counted by load and dump, per patch.
+     */
+    enum class Operation
+    {
+        fetch,
+        same_level,
+        prolongation,
+        restriction,
+        boundary_value,
+        commit,
+        insert,
+        serializer_read,
+        serializer_write,
+    };
+
+
+    // ========================================================================
+    /**
+     * The totals for one operation on patches of one field at one level.
+     * Times are wall-clock, and include nested operations (a fetch includes
+     * its guard zone regions). Allocations are those of patch-sized arrays
+     * by the database and its array pool, and are counted against the
+     * innermost operation on the thread. Levels beyond 31 are counted as 31.
+     */
+    struct ProfileCounter
+    {
+        Operation operation;
+        int level;
+        Field field;
+        std::uint64_t calls;
+        std::uint64_t bytes;
+        std::uint64_t allocations;
+        std::uint64_t nanoseconds;
+    };
+
+
+    /**
+     * A single timed operation, recorded while tracing is enabled. The start
+     * time is measured from the last reset, and threads are numbered in the
+     * order they first record an event.
+     */
+    struct ProfileEvent
+    {
+        Operation operation;
+        int level;
+        Field field;
+        int thread;
+        std::uint64_t start;
+        std::uint64_t duration;
+        std::uint64_t bytes;
     };
 
 
     // ========================================================================
     struct FieldDescriptor
     {
-        FieldDescriptor(int num_fields, MeshLocation location);
+        FieldDescriptor(int num_fields, MeshLocation location, Layout layout=Layout::aos);
         int num_fields;
         MeshLocation location;
+        Layout layout;
     };
 }
 
@@ -80,10 +261,28 @@ public:
      * having the number of guard zones (depth) in the off-bounds axis. For
      * example, if edge = PatchBoundary::il and depth = 2, then the callback
      * must return an array with shape [2, data.shape(1), data.shape(2)].
+     *
+     * The callback is also invoked for the corner regions, where the
+     * diagonal neighbor cannot be found. Then depth is the larger of the
+     * two guard zone counts meeting at that corner, and the callback must
+     * return an array with shape [depth, depth, data.shape(2)], laid out as
+     * it sits in the padded array; for the il_jl corner, element
+     * (depth - 1, depth - 1) is diagonally adjacent to the patch's element
+     * (0, 0). Only the part of it the fetch needs is used.
+     *
+     * The shapes above are for the aos layout. For a field with the soa
+     * layout, the patch and the returned array are planar, with the
+     * component axis first; see Layout.
      * 
      * Use the set_boundary_value method to set the callback. If no callback
      * has been supplied and a call to fetch would require it, then an
      * exception is raised.
+     *
+     * If a thread pool is set, then fetch_all and for_each_patch invoke the
+     * callback from the pool's worker threads, possibly for several target
+     * patches at once. The callback must then be safe to call concurrently;
+     * a pure function of its arguments always is. It is never called
+     * concurrently for the same target patch and edge.
      */
     using BoundaryValue = std::function<Array(
         
@@ -98,214 +297,1703 @@ public:
         )>;
 
 
-    // ========================================================================
-    Database(int ni, int nj, Header header);
+    /**
+     * A user-defined prolongation operator. It receives a whole coarse patch
+     * and a quadrant (I, J), each 0 or 1, and must return the fine patch,
+     * with shape [ni, nj, num_fields], covering that quadrant. Planar fields
+     * are passed and returned planar, as for the boundary value callback.
+     */
+    using ProlongationOperator = std::function<Array(const Array& coarse, int I, int J)>;
 
 
     /**
-     * Set the callback to be invoked when a target patch's guard zone region
-     * cannot be found in neighboring patches.
+     * A user-defined restriction operator. It receives the four children of
+     * a coarse patch tiled into one array of shape [2 ni, 2 nj, num_fields],
+     * and must return the coarse patch, with shape [ni, nj, num_fields].
+     * Planar fields are passed and returned planar.
      */
-    void set_boundary_value(BoundaryValue);
+    using RestrictionOperator = std::function<Array(const Array& fine)>;
 
 
     /**
-     * Insert a deep copy of the given array into the database at the given
-     * patch index. Any existing data at that location is overwritten.
+     * A tagging criterion for regrid. It receives the index and data of a
+     * patch, and returns a positive number if that patch should be refined,
+     * a negative number if it may be coarsened, or zero to leave it as is.
+     * If a thread pool is set, it is called concurrently for different
+     * patches.
      */
-    void insert(Index index, Array data);
+    using RefinementCriterion = std::function<int(Index index, const Array& patch)>;
 
 
     /**
-     * Erase any patch data at the given index.
+     * A function receiving the tiles of a streamed assemble, in turn. The
+     * arguments are the offset (i, j) of the tile in the assembled array and
+     * the tile data, in the field's layout. The tile array is reused for the
+     * next tile, so it must be copied to be kept.
      */
-    auto erase(Index index);
+    using TileSink = std::function<void(int i, int j, const Array& tile)>;
 
 
-    /** Clear all of the stored patches from the database. */
-    void clear();
+    /**
+     * A request for the region [i0, i1) x [j0, j1) of a patch stored on
+     * another rank. Queries are created by fetch_async and sent through the
+     * Transport; the rank owning the patch answers them with serve.
+     */
+    struct Query
+    {
+        Index index;
+        int i0, i1, j0, j1;
+    };
 
 
     /**
-     * Merge data into the database at index, with the given weighting factor.
-     * Setting rk_factor=0.0 corresponds to overwriting the existing data.
-     *
-     * An exception is throws if a patch does not already exist at the given patch
-     * index. Use insert to create a new patch.
+     * Reductions over the elements of one or more patches: the minimum,
+     * maximum, and sum of each component, and the number of elements of
+     * each component which were reduced. Every element of a patch array
+     * counts, so the shared vertices and faces on patch boundaries are
+     * counted once by each patch.
      */
-    void commit(Index index, Array data, double rk_factor=0.0);
+    struct Summary
+    {
+        std::vector<double> min;
+        std::vector<double> max;
+        std::vector<double> sum;
+        std::size_t count = 0;
+    };
 
 
     /**
-     * Return a deep copy of the data at the patch index, padded with the
-     * given number of guard zones at each edge of the array. If no data
-     * exists at that index, an exception is thrown.
-     *
-     *          jl
-     *      +--------+
-     *      |        |
-     *  il  |        |  ir
-     *      |        |
-     *      +--------+
-     *          jr
-     *
+     * A non-owning, read-only view of patch data, or of a rectangular part of
+     * it. Views are cheap to copy and never allocate. A view refers to the
+     * memory of the patch it came from, so it is invalidated by anything
+     * that invalidates references to the patch data: erasing the patch,
+     * clearing the database, or inserting new patches of the same field
+     * (which may grow the storage). Committing to the patch changes the data
+     * seen through the view.
      */
-    Array fetch(Index index, int ngil, int ngir, int ngjl, int ngjr) const;
+    class View
+    {
+    public:
+        View() {}
+        View(const double* data, std::array<int, 3> shape, std::array<int, 3> strides)
+        : ptr(data), count(shape), stride(strides) {}
+
+        const double& operator()(int i, int j, int k) const
+        {
+            return ptr[i * stride[0] + j * stride[1] + k * stride[2]];
+        }
+        View select(int i0, int i1, int j0, int j1) const
+        {
+            return View(&operator()(i0, j0, 0), {i1 - i0, j1 - j0, count[2]}, stride);
+        }
+        const double* data() const { return ptr; }
+        std::array<int, 3> shape() const { return count; }
+        std::array<int, 3> strides() const { return stride; }
+        int shape(int axis) const { return count[axis]; }
+        std::size_t size() const { return std::size_t(count[0]) * count[1] * count[2]; }
+        bool empty() const { return size() == 0; }
+        bool contiguous() const { return stride[2] == 1 && stride[1] == count[2] && stride[0] == count[1] * count[2]; }
+
+    private:
+        const double* ptr = nullptr;
+        std::array<int, 3> count = {{0, 0, 0}};
+        std::array<int, 3> stride = {{0, 0, 0}};
+    };
 
 
     /**
-     * Same as above, where the number of guard zones to be fetched is the
-     * same on each of the patch boundaries.
+     * A read-only view which looks like the array returned by assemble, but
+     * which reads each element from the patch that covers it, without
+     * copying anything. Shared vertex and face locations are read from the
+     * patch on the right, as in assemble. The same rules for invalidation
+     * apply as for View.
      */
-    Array fetch(Index index, int guard) const;
+    class AssembledView
+    {
+    public:
+        const double& operator()(int i, int j, int k) const
+        {
+            auto bi = std::min(i / ni, num_i - 1);
+            auto bj = std::min(j / nj, num_j - 1);
+            return blocks[bi * num_j + bj](i - bi * ni, j - bj * nj, k);
+        }
+        std::array<int, 3> shape() const { return count; }
+        int shape(int axis) const { return count[axis]; }
+        std::size_t size() const { return std::size_t(count[0]) * count[1] * count[2]; }
+
+    private:
+        friend class Database;
+        std::vector<View> blocks;
+        std::array<int, 3> count = {{0, 0, 0}};
+        int ni = 0;
+        int nj = 0;
+        int num_i = 0;
+        int num_j = 0;
+    };
 
 
     /**
-     * Return an array spanning a rectangular range of blocks at a fixed
-     * level. All of the enclosed patches must exist in the database. The
-     * upper indexes are non-inclusive. Note that vertex and face data
-     * formally has redundancies at the patch boundaries (the right faces of
-     * patch i and the left faces of patch i + 1 are the same physical
-     * things). This function does not make any attempt to reconcile
-     * differences between the data at the redundant locations (it replaces a
-     * patch's data values on the right if they can be read from the right
-     * neighbor patch), so it's up to you to make sure it's consistent.
+     * Options for a selective load. Only patches of the listed fields (all
+     * fields if empty), at levels in [min_level, max_level], and overlapping
+     * the bounding box [x0, x1) x [y0, y1) = bounds are loaded. The bounding
+     * box is in units of level-0 blocks, so that patch (i, j, level) covers
+     * [i, i + 1) x [j, j + 1) divided by 2^level. Levels are loaded coarsest
+     * first, and on_level, if given, is invoked with the partially loaded
+     * database once each level is complete. The bailout callback is checked
+     * after each patch is inserted; if it returns true, loading stops, but
+     * the patches inserted so far are complete. Fields listed in layouts
+     * are given that layout in the loaded database, whatever the layout they
+     * were written in.
      */
-    Array assemble(int i0, int i1, int j0, int j1, int level, Field field) const;
+    struct LoadOptions
+    {
+        std::set<Field> fields;
+        int min_level = 0;
+        int max_level = std::numeric_limits<int>::max();
+        std::array<double, 4> bounds = {{
+            -std::numeric_limits<double>::infinity(), std::numeric_limits<double>::infinity(),
+            -std::numeric_limits<double>::infinity(), std::numeric_limits<double>::infinity()}};
+        std::function<bool()> bailout = nullptr;
+        std::function<void(const Database&, int level)> on_level = nullptr;
+        std::shared_ptr<ThreadPool> pool = nullptr;
+        std::map<Field, Layout> layouts;
+    };
 
 
     /**
-     * Return a constant reference to the data at the given patch index. If no
-     * data exists at that index, an exception is thrown.
+     * The guard zone fill of every patch of one field, flattened into a list
+     * of tasks over packed buffers, so that it can be run where the patch
+     * data lives, e.g. as one batched kernel on a device which keeps the
+     * patches resident. The interiors are packed in the order of patches,
+     * each with the given shape in row-major order (as written by pack), and
+     * the padded results likewise with the padded shape. Each task writes
+     * the region [0, i1 - i0) x [0, j1 - j0) of a padded result at (di, dj),
+     * where element (a, b) is:
+     *
+     * copy:     source (i0 + a, j0 + b)
+     * prolong:  source ((i0 + a) / 2, (j0 + b) / 2)
+     * restrict: the average of source (2 (i0 + a) + {0, 1}, 2 (j0 + b) + {0, 1}),
+     *           summed in the order of restrict_row
+     * stage:    the staging buffer at offset + ((a (j1 - j0) + b) nf)
+     *
+     * for every component. The source of the copy, prolong, and restrict
+     * tasks is a packed interior. The stage tasks cover the regions which
+     * need the host: boundary values, user-defined operators, the linear
+     * and volume-weighted schemes, and vertex and face data from other
+     * levels; Database::stage computes them into the staging buffer. The
+     * tasks for each target are contiguous, and must run in order since
+     * some overwrite shared rows written by earlier ones; tasks of
+     * different targets are independent. A program is valid for as long as
+     * the topology of the database is unchanged, and the prolongation and
+     * restriction operators of its field are not set again, since those
+     * decide which regions are stage tasks.
      */
-    const Array& at(Index index) const;
+    struct GuardProgram
+    {
+        struct Task
+        {
+            enum class Kind { copy, prolong, restrict, stage };
+            Kind kind;
+            int target;             /**< Position of the padded result in patches */
+            int source;             /**< Position of the source interior, or -1 */
+            std::size_t offset;     /**< Offset into the staging buffer (stage) */
+            int i0, i1, j0, j1;
+            int di, dj;
+            PatchBoundary edge;
+            int depth;
+        };
+        std::vector<Index> patches;
+        std::array<int, 3> shape;
+        std::array<int, 3> padded;
+        std::vector<Task> tasks;
+        std::size_t staging_size = 0;
+        std::size_t version = 0;
+    };
+
+
+    // ========================================================================
+    Database(int ni, int nj, Header header);
 
 
     /**
-     * Same as above, except discards the index field and uses the given field
-     * instead.
+     * Set the callback to be invoked when a target patch's guard zone region
+     * cannot be found in neighboring patches.
      */
-    const Array& at(Index index, Field which) const;
+    void set_boundary_value(BoundaryValue);
 
 
-    /** Return all patches registered for the given field. */
-    std::map<Index, Array> all(Field which) const;
+    /**
+     * Set the built-in scheme used to prolong guard zone data of the given
+     * field from coarser patches. The built-in schemes are compiled into the
+     * guard zone kernels, and only compute the cells fetch asks for. Only
+     * cell data supports schemes other than piecewise_constant.
+     */
+    void set_prolongation(Field which, ProlongationScheme scheme);
 
 
-    /** Return an iterator to the beginning of the container of patches. */
-    auto begin() const { return patches.begin(); }
+    /**
+     * Use a user-defined operator to prolong guard zone data of the given
+     * field. The operator is called once per guard zone strip, with the whole
+     * coarse patch, and the strip is then cut out of its result. It is not
+     * supported for coarse patches stored on other ranks.
+     */
+    void set_prolongation(Field which, ProlongationOperator op);
 
 
-    /** Return an iterator to the end of the container of patches. */
-    auto end() const { return patches.end(); }
+    /**
+     * Set the built-in scheme used to restrict guard zone data of the given
+     * field from finer patches. Only cell data supports schemes other than
+     * average.
+     */
+    void set_restriction(Field which, RestrictionScheme scheme);
 
 
-    /** Return the number of patches. */
-    std::size_t size() const { return patches.size(); }
+    /**
+     * Use a user-defined operator to restrict guard zone data of the given
+     * field. The operator is called once per guard zone strip, with the four
+     * child patches tiled together. For vertex and face data, the tiled
+     * array holds the shared vertices and faces once (2 * ni + 1 of them
+     * along a staggered axis), taken from the child in the direction of
+     * increasing index. It is not supported for child patches stored on
+     * other ranks.
+     */
+    void set_restriction(Field which, RestrictionOperator op);
 
 
-    /** Return the number of patches associated with the given field. */
-    std::size_t count(Field which) const;
+    /**
+     * Set a thread pool to be used by fetch_all, commit_all, and
+     * for_each_patch. The pool may be shared between databases. If no pool
+     * is set (or it is null), those functions run serially on the calling
+     * thread.
+     */
+    void set_thread_pool(std::shared_ptr<ThreadPool>);
 
 
-    /** Return the total number of cells associated with the given field. */
-    std::size_t num_cells(Field which) const;
+    /**
+     * Set a pool of arrays from which the arrays returned by fetch (and the
+     * other fetch variants), assemble, tile, prolongation, and restriction
+     * are drawn, along with the temporaries used to fill guard zones. The
+     * temporaries are returned to the pool automatically. Arrays returned to
+     * the caller may be given back with ArrayPool::release once they are no
+     * longer used, so that a steady-state loop which does so allocates no
+     * memory. The pool may be shared between databases. If no pool is set
+     * (or it is null), every array is allocated fresh.
+     */
+    void set_array_pool(std::shared_ptr<ArrayPool>);
 
 
-    /** Print a description of the patch locations. */
-    void print(std::ostream& os) const;
+    /**
+     * Set the transport used to query guard zone data from patches stored on
+     * other ranks.
+     */
+    void set_transport(std::shared_ptr<Transport>);
 
 
-    /** Write the database using the given serialization scheme. */
-    void dump(const Serializer&) const;
+    /**
+     * Declare the rank which owns each patch in the global mesh. Indexes of
+     * patches stored in this database are ignored; the others are treated as
+     * existing on the given rank, and guard zone data is requested from them
+     * through the transport. This changes the topology, as insert and erase
+     * do.
+     */
+    void set_ownership(std::map<Index, int> owners);
 
 
     /**
-     * Load a database using the given serialization scheme. If the fields
-     * argument is empty, then all fields are loaded. Otherwise, only those
-     * fields are loaded and returned.
+     * Move patches between ranks to match a new partition of the global mesh
+     * (e.g. from repartition), where this database is the given rank. Each
+     * patch the partition assigns to this rank, which is not stored here,
+     * is requested whole through the transport from the rank which owns it
+     * according to the current ownership, and inserted; only patches whose
+     * owner changes are moved. The ownership is then set to the partition.
+     * Patches assigned to other ranks are not erased, since those ranks may
+     * still be requesting them; the indexes of those patches are returned,
+     * to be erased once every rank has finished migrating (e.g. after a
+     * barrier). An exception is thrown if the owner of an incoming patch is
+     * unknown.
      */
-    static Database load(const Serializer&, std::set<Field> fields={}, std::function<bool()> bailout=nullptr);
+    std::vector<Index> migrate(const std::map<Index, int>& partition, int rank);
 
 
-private:
-    // ========================================================================
-    int num_fields(Index index) const;
-    MeshLocation location(Index index) const;
-    std::array<int, 3> expected_shape(Index index) const;
-    std::array<Index, 4> refine(Index index) const;
-    Index coarsen(Index index) const;
-    Array check_shape(Array& array, Index index) const;
-    Array locate(Index index) const;
-    Array quadrant(const nd::array<double, 3>& A, int I, int J) const;
-    Array tile(std::array<Index, 4> indexes) const;
-    Array prolongation(const nd::array<double, 3>& A) const;
-    Array restriction(const nd::array<double, 3>& A) const;
+    /**
+     * Set the order in which patches are visited by begin and end, by
+     * for_each_view, and by the parallel loops (fetch_all, commit_all,
+     * for_each_patch, and their relatives), and in which their data is laid
+     * out in memory. Ordering the patches along a space-filling curve keeps
+     * neighboring patches close together in memory, and hands out nearby
+     * patches in turn to the threads of a pool, which improves cache
+     * locality. The stored data is moved into the new order, which changes
+     * the topology, as insert and erase do. The default is Ordering::index.
+     * An exception is thrown if a patch index is out of range for the
+     * curve; see morton_key.
+     */
+    void set_ordering(Ordering ordering);
 
-    template <typename IndexContainer>
-    bool contains_all(IndexContainer indexes) const
-    {
-        for (auto index : indexes)
-        {
-            if (patches.count(index) == 0)
-            {
-                return false;
-            }
-        }
-        return true;
-    }
 
-    // ========================================================================
-    int ni = 0;
-    int nj = 0;
-    Header header;
-    std::map<Index, Array> patches;
-    BoundaryValue boundary_value = nullptr;
-};
+    /**
+     * Insert a deep copy of the given array into the database at the given
+     * patch index. Any existing data at that location is overwritten.
+     */
+    void insert(Index index, Array data);
 
 
+    /**
+     * Erase any patch data at the given index, and return the number of
+     * patches erased (0 or 1).
+     */
+    std::size_t erase(Index index);
 
 
-// ============================================================================
-namespace patches2d {
-    std::string to_string(MeshLocation location);
-    std::string to_string(Field field);
-    std::string to_string(Database::Index index);
-    std::string to_string(Database::Index index, std::string field_name);
-    MeshLocation    parse_location(std::string str);
-    Field           parse_field(std::string str);
-    Database::Index parse_index(std::string str);
-}
+    /** Clear all of the stored patches from the database. */
+    void clear();
 
 
+    /**
+     * Move the patch at the given index into compressed cold storage, to
+     * save memory while it is not being used. Until it is thawed, a frozen
+     * patch is absent from the database as far as fetch, at, iteration, and
+     * its neighbors are concerned, as if it had been erased; it is still
+     * written by dump. Inserting or erasing at that index discards the
+     * frozen copy. An exception is thrown if no patch exists at the index.
+     */
+    void freeze(Index index, Compression compression=Compression::lossless, double tolerance=0.0);
 
 
-// ============================================================================
-class patches2d::Serializer
-{
-public:
     /**
-     * Destructor.
+     * Restore a frozen patch from cold storage. An exception is thrown if
+     * the patch at the given index is not frozen.
      */
-    virtual ~Serializer() {}
+    void thaw(Index index);
+
+
+    /** Return true if the patch at the given index is frozen. */
+    bool is_frozen(Index index) const;
+
+
+    /** Return the number of bytes used by frozen patches. */
+    std::size_t frozen_bytes() const;
+
 
     /**
-     * This method must return a list of the fields in a given patch. If this
-     * reader is filesystem-based, it probably returns a list of the file
-     * names in the directory for that patch. If it is HDF5, it might return
-     * the names of the datasets in the group for that patch..
+     * Replace the block at the given patch index with its four children one
+     * level finer. Every field stored at that (i, j, level) is refined; the
+     * field of the index is ignored. The child data is prolonged from the
+     * parent with each field's prolongation scheme or user operator, as for
+     * guard zones, so the built-in schemes conserve the parent's average.
+     * An exception is thrown if no patch is stored at the index, or if the
+     * data is on another rank.
      */
-    virtual std::vector<std::string> list_fields(std::string patch_index) const = 0;
+    void refine_patch(Index index);
+
 
     /**
-     * This method must return a list of the patches in the database.
+     * Replace the four children of the block at the given patch index, one
+     * level finer, with that block. Each field stored at all four children
+     * is restricted with its restriction scheme or user operator, as for
+     * guard zones. An exception is thrown if the children are incomplete,
+     * if the parent already exists, or if the data is on another rank.
      */
-    virtual std::vector<std::string> list_patches() const = 0;
+    void coarsen_patches(Index parent);
+
 
     /**
-     * This method must return an array read from the given location.
+     * Refine and coarsen the mesh according to the given criterion, which is
+     * evaluated on each patch of the given field. Patches tagged for
+     * refinement (below max_level) are refined, and any coarser neighbors
+     * (including diagonal ones) are refined along with them, so that
+     * adjacent patches differ by at most one level. Groups of four siblings
+     * which are all tagged for coarsening are coarsened, unless that would
+     * break the level balance or a sibling is being refined. All fields
+     * stored at a block move with it, as in refine_patch and
+     * coarsen_patches. The new data is computed on the thread pool if one is
+     * set, before any patch is replaced. The mesh is assumed to be balanced
+     * beforehand, and ownership on other ranks is not updated. Returns the
+     * number of blocks refined plus the number of sibling groups coarsened.
      */
-    virtual nd::array<double, 3> read_array(std::string path) const = 0;
+    std::size_t regrid(Field which, RefinementCriterion criterion, int max_level=std::numeric_limits<int>::max());
+
+
+    /**
+     * Merge data into the database at index, with the given weighting factor.
+     * Setting rk_factor=0.0 corresponds to overwriting the existing data.
+     *
+     * An exception is throws if a patch does not already exist at the given patch
+     * index. Use insert to create a new patch.
+     */
+    void commit(Index index, Array data, double rk_factor=0.0);
+
+
+    /**
+     * Same as commit, except that the data is the interior of an array
+     * padded with the given number of guard zones on each edge, such as the
+     * result of fetch(index, guard). The interior is read in place, so the
+     * caller does not need to slice it out first.
+     */
+    void commit_interior(Index index, const Array& padded, int guard, double rk_factor=0.0);
+
+
+    /**
+     * Return the version of the patch at the given index: a counter which
+     * increases whenever the patch is inserted, committed, or thawed, and
+     * never decreases. Writing into patch data by other means (e.g. through
+     * a shallow copy of the array returned by at) is not tracked. An
+     * exception is thrown if no patch exists at the index.
+     */
+    std::uint64_t version(Index index) const;
+
+
+    /**
+     * Enable or disable the strip cache. When it is enabled, the guard zone
+     * regions which fetch prolongs from coarser patches or restricts from
+     * finer ones are kept, along with the versions of the patches they were
+     * computed from, and reused by later fetches until one of those patches
+     * changes. Regions read from same-level neighbors are cheap to copy,
+     * and boundary values may change over time, so those are never cached.
+     * User-defined operators are assumed to depend only on their arguments.
+     * The cache is emptied whenever patches are inserted or erased, when a
+     * field's prolongation or restriction operator is changed, and when it
+     * is disabled.
+     */
+    void set_strip_cache(bool enabled);
+
+
+    /** Return the number of guard zone regions served from the strip cache. */
+    std::size_t strip_cache_hits() const;
+
+
+    /**
+     * Enable or disable keeping summaries of the patches of the given
+     * field. A summary holds the reductions of the patch, and for cell data
+     * a mipmap: the patch averaged over 2 x 2 cells, then 4 x 4, and so on
+     * for as long as the factor divides the block size. Summaries are
+     * computed when first needed by summary, reduce, or the downsampled
+     * assemble, and kept along with the patch version, so that after a
+     * commit only the patches which changed are summarized again. Disabling
+     * summaries discards them.
+     */
+    void set_summaries(Field which, bool enabled);
+
+
+    /**
+     * Return the reductions of the patch at the given index, which may be
+     * frozen. An exception is thrown if no patch exists at the index.
+     */
+    Summary summary(Index index) const;
+
+
+    /**
+     * Return the reductions over every patch of the given field, including
+     * frozen ones, at the given level, or at all levels if level is
+     * negative. Sums are plain sums of the patch elements, not weighted by
+     * cell volume. If summaries are enabled for the field, the stale ones
+     * are computed on the thread pool if one is set, and only those patches
+     * are read.
+     */
+    Summary reduce(Field which, int level=-1) const;
+
+
+    /**
+     * Return a deep copy of the data at the patch index, padded with the
+     * given number of guard zones at each edge of the array. If no data
+     * exists at that index, an exception is thrown.
+     *
+     * Vertex and face data are padded in the same way, so that the result
+     * has the patch shape plus the guard zones. A vertex or face on the
+     * boundary between two patches is shared by both of them. As in
+     * assemble, the shared one is taken from the patch in the direction of
+     * increasing index (ir or jr) when both are at the same level, and
+     * otherwise from the finer of the two. Vertex and face data are
+     * prolonged by injection, with the midpoints between coarse values
+     * averaged, and restricted by sampling the coincident fine vertices or
+     * averaging the fine faces which cover each coarse face.
+     *
+     *          jl
+     *      +--------+
+     *      |        |
+     *  il  |        |  ir
+     *      |        |
+     *      +--------+
+     *          jr
+     *
+     */
+    Array fetch(Index index, int ngil, int ngir, int ngjl, int ngjr) const;
+
+
+    /**
+     * Same as above, where the number of guard zones to be fetched is the
+     * same on each of the patch boundaries.
+     */
+    Array fetch(Index index, int guard) const;
+
+
+    /**
+     * Return the data at the given index, which need not be stored, built in
+     * full: the stored patch, a quadrant of its parent prolonged by
+     * injection, or its four children restricted by averaging. This is how
+     * fetch found guard zone data before it computed only the strips it
+     * needs, and is kept as a reference for tests and benchmarks. The
+     * result is in the field's layout. The field's operators are ignored,
+     * and an empty array is returned if none of those patches is stored.
+     * Only cell data is supported; vertex and face data are only read as
+     * strips, by fetch.
+     */
+    Array reference_patch(Index index) const;
+
+
+    /**
+     * Same as fetch, but write the padded patch into the given array rather
+     * than returning a new one. The array must have the padded shape, and
+     * may be a view into some larger array, such as a per-thread scratch
+     * buffer. An exception is thrown if the shape is wrong.
+     */
+    void fetch_into(Index index, int ngil, int ngir, int ngjl, int ngjr, Array& out) const;
+
+
+    /**
+     * Same as above, where the number of guard zones to be fetched is the
+     * same on each of the patch boundaries.
+     */
+    void fetch_into(Index index, int guard, Array& out) const;
+
+
+    /**
+     * Same as above, but write into caller-owned memory, such as a pinned
+     * staging buffer, where element (i, j, k) of the padded patch goes to
+     * data[i * strides[0] + j * strides[1] + k * strides[2]]. The memory
+     * must be large enough to hold the padded patch with those strides.
+     * The strides alone determine the layout of the result; the field's
+     * layout is not used.
+     */
+    void fetch_into(Index index, int ngil, int ngir, int ngjl, int ngjr, double* data, std::array<int, 3> strides) const;
+
+
+    /**
+     * Begin fetching the data at the patch index, padded with guard zones as
+     * in fetch, where some of the guard zone data may be owned by other
+     * ranks. Queries for remote data are sent through the transport, one
+     * message per rank, before any data is copied; the guard zones which can
+     * be filled locally are then filled while the queries are in flight.
+     * The returned future is deferred: the remote strips are prolonged or
+     * restricted as needed on the thread which calls get. The database must
+     * outlive the future, and its topology must not change in the meantime.
+     */
+    std::future<Array> fetch_async(Index index, int ngil, int ngir, int ngjl, int ngjr) const;
+
+
+    /**
+     * Same as above, where the number of guard zones to be fetched is the
+     * same on each of the patch boundaries.
+     */
+    std::future<Array> fetch_async(Index index, int guard) const;
+
+
+    /**
+     * Fetch several fields of the patch at (i, j, level), as in fetch,
+     * returning one array per field in the order given. The fields share one
+     * pass over the fill plan, and any remote queries for them are batched
+     * into at most one message per rank.
+     */
+    std::vector<Array> fetch_many(int i, int j, int level, std::vector<Field> fields, int guard) const;
+
+
+    /**
+     * Same as fetch_many, except that the fields are interleaved into a
+     * single array, whose last axis holds the components of the first field,
+     * followed by those of the second field, and so on. The guard zones are
+     * written directly into that array. All the fields must have the same
+     * mesh location.
+     */
+    Array fetch_interleaved(int i, int j, int level, std::vector<Field> fields, int guard) const;
+
+
+    /**
+     * Begin fetching every patch associated with the given field, as in
+     * fetch_async. The queries for all the patches are batched, so that at
+     * most one message is sent to each remote rank.
+     */
+    std::map<Index, std::future<Array>> fetch_all_async(Field which, int guard) const;
+
+
+    /**
+     * Answer queries received from another rank, returning the requested
+     * region of each patch, in the same order as the queries. An exception is
+     * thrown if any of the patches are not stored in this database.
+     */
+    std::vector<Array> serve(const std::vector<Query>& queries) const;
+
+
+    /**
+     * Fetch every patch associated with the given field, with the given
+     * number of guard zones, running on the thread pool if one is set.
+     * Concurrent calls to const methods are safe; calls which modify the
+     * database (insert, erase, clear, commit) must not overlap this one.
+     */
+    std::map<Index, Array> fetch_all(Field which, int guard) const;
+
+
+    /**
+     * Commit each of the given patches, as in commit, running on the thread
+     * pool if one is set. Every index must already exist in the database.
+     */
+    void commit_all(std::map<Index, Array> data, double rk_factor=0.0);
+
+
+    /**
+     * Invoke the given function with the index and fetched data of every
+     * patch associated with the given field, running on the thread pool if
+     * one is set. The function is called concurrently from the pool's worker
+     * threads, so it must be safe to do so. If any call throws, the first
+     * exception is rethrown here once the remaining calls have finished.
+     */
+    void for_each_patch(Field which, int guard, std::function<void(Index, Array)> fn) const;
+
+
+    /**
+     * Return an array spanning a rectangular range of blocks at a fixed
+     * level. All of the enclosed patches must exist in the database. The
+     * upper indexes are non-inclusive. Note that vertex and face data
+     * formally has redundancies at the patch boundaries (the right faces of
+     * patch i and the left faces of patch i + 1 are the same physical
+     * things). This function does not make any attempt to reconcile
+     * differences between the data at the redundant locations (it replaces a
+     * patch's data values on the right if they can be read from the right
+     * neighbor patch), so it's up to you to make sure it's consistent.
+     */
+    Array assemble(int i0, int i1, int j0, int j1, int level, Field field) const;
+
+
+    /**
+     * Same as assemble, for cell data, but with every block reduced by the
+     * given factor along both axes by averaging, so that each block spans
+     * ni / factor x nj / factor elements. The factor must be a power of two
+     * which divides the block size. A block which is not stored at that
+     * level may instead be covered by finer patches, whose data is then
+     * averaged down to the block. If summaries are enabled for the field,
+     * the result is read from the mipmaps, without reading the patch data
+     * again. An exception is thrown if a block is neither stored nor
+     * covered.
+     */
+    Array assemble(int i0, int i1, int j0, int j1, int level, Field field, int factor) const;
+
+
+    /**
+     * Return a view spanning a rectangular range of blocks at a fixed level,
+     * stitched together lazily from the patch data. The result has the same
+     * shape and contents as the array returned by assemble, but no patch
+     * data is copied. All of the enclosed patches must exist in the
+     * database.
+     */
+    AssembledView assemble_view(int i0, int i1, int j0, int j1, int level, Field field) const;
+
+
+    /**
+     * Stream the window [i0, i1) x [j0, j1) of a level to the given sink, in
+     * tiles of at most tile_i x tile_j elements, row by row of tiles. The
+     * window is in element coordinates of the level, where block (i, j)
+     * begins at element (i * ni, j * nj), so that the window [i0 * ni, i1 *
+     * ni + 1) x [j0 * nj, j1 * nj + 1) of vertex data is the array returned
+     * by assemble(i0, i1, j0, j1, ...). With a stride, only every stride-th
+     * element along each axis is kept, starting from (i0, j0). Shared
+     * vertices and faces are read as in assemble: from the patch in the
+     * direction of increasing index, except at the high edges of the window.
+     * Only one tile is held at a time, and each is filled from the patches
+     * it overlaps, which must all exist.
+     */
+    void assemble_tiles(int i0, int i1, int j0, int j1, int level, Field field, int tile_i, int tile_j, TileSink sink, int stride=1) const;
+
+
+    /**
+     * Same as above, but write element (i, j, k) of the (strided) window to
+     * data[i * strides[0] + j * strides[1] + k * strides[2]], such as a
+     * memory-mapped file or a render buffer. As for fetch_into, the strides
+     * alone determine the layout of the result. The strides and offsets are
+     * std::ptrdiff_t, so the window may hold more than 2^31 elements.
+     */
+    void assemble_into(int i0, int i1, int j0, int j1, int level, Field field, double* data, std::array<std::ptrdiff_t, 3> strides, int stride=1) const;
+
+
+    /**
+     * Write the (strided) window to the serializer at the given path, in the
+     * field's layout, with Serializer::write_rows (or write_planes, for a
+     * planar field). A serializer which streams the rows, such as the
+     * BinarySerializer, never holds the whole window, or a whole plane of
+     * it. The path is not a patch index, so a file written this way may not be
+     * loaded as a database.
+     */
+    void assemble_to(const Serializer& ser, std::string path, int i0, int i1, int j0, int j1, int level, Field field, int stride=1) const;
+
+
+    /**
+     * Build the guard zone fill program for every patch of the given field,
+     * with the given number of guard zones on each edge; see GuardProgram.
+     * Running the program (e.g. with run_guard_program) gives the same
+     * result as fetch for each patch, bit for bit. An exception is thrown if
+     * any guard zone data is stored on another rank.
+     */
+    GuardProgram guard_program(Field which, int guard) const;
+
+
+    /**
+     * Compute the stage tasks of a program into the staging buffer, which
+     * must hold program.staging_size elements; it may be pinned host memory
+     * for transfer to a device. The regions are computed from the patch
+     * data in this database, as fetch would, so if the data is being
+     * advanced elsewhere, the patches they read (and those passed to the
+     * boundary value callback) must be unpacked first to be current. An
+     * exception is thrown if the topology or the operators have changed
+     * since the program was built.
+     */
+    void stage(const GuardProgram& program, double* staging) const;
+
+
+    /**
+     * Copy the data of the given patches into a packed buffer, one after
+     * another in row-major order, as laid out by a GuardProgram; the buffer
+     * may be pinned host memory for transfer to a device.
+     */
+    void pack(const std::vector<Index>& indexes, double* data) const;
+
+
+    /**
+     * Commit the data of the given patches from a packed buffer laid out as
+     * by pack, with the given weighting factor, as in commit.
+     */
+    void unpack(const std::vector<Index>& indexes, const double* data, double rk_factor=0.0);
+
+
+    /**
+     * Return a read-only view of the data at the given patch index, without
+     * copying it. This is the same data as returned by fetch with zero guard
+     * zones. If no data exists at that index, an exception is thrown.
+     */
+    View view(Index index) const;
+
+
+    /**
+     * Invoke the given function with the index and a view of the data of
+     * every patch associated with the given field, in the database's
+     * ordering (see set_ordering), on the calling thread. No patch data is
+     * copied.
+     */
+    void for_each_view(Field which, std::function<void(Index, View)> fn) const;
+
+
+    /**
+     * Return a constant reference to the data at the given patch index. If no
+     * data exists at that index, an exception is thrown.
+     */
+    const Array& at(Index index) const;
+
+
+    /**
+     * Same as above, except discards the index field and uses the given field
+     * instead.
+     */
+    const Array& at(Index index, Field which) const;
+
+
+    /**
+     * Return all patches registered for the given field. To visit them
+     * without copying the container, use for_each_view.
+     */
+    std::map<Index, Array> all(Field which) const;
+
+
+    /** Return an iterator to the beginning of the container of patches. */
+    auto begin() const { return patches.begin(); }
+
+
+    /** Return an iterator to the end of the container of patches. */
+    auto end() const { return patches.end(); }
+
+
+    /** Return the number of patches. */
+    std::size_t size() const { return patches.size(); }
+
+
+    /** Return the number of patches associated with the given field. */
+    std::size_t count(Field which) const;
+
+
+    /** Return the total number of cells associated with the given field. */
+    std::size_t num_cells(Field which) const;
+
+
+    /** Print a description of the patch locations. */
+    void print(std::ostream& os) const;
+
+
+    /** Write the database using the given serialization scheme. */
+    void dump(const Serializer&) const;
+
+
+    /**
+     * Write the database on a background thread. A snapshot of the patch
+     * data is taken before this method returns, so the database may be
+     * modified immediately afterwards. The returned future becomes ready
+     * once the serializer has been flushed, and rethrows any exception
+     * raised while writing; the completion callback, if given, is invoked on
+     * the background thread just before that. Note that, as with std::async,
+     * destroying the future blocks until the write has finished.
+     */
+    std::future<void> dump_async(std::shared_ptr<const Serializer>, std::function<void()> on_complete=nullptr) const;
+
+
+    /**
+     * Load a database using the given serialization scheme. If the fields
+     * argument is empty, then all fields are loaded. Otherwise, only those
+     * fields are loaded and returned. If a thread pool is given, the patch
+     * data is read on it. Serializers which provide views of their arrays
+     * (see Serializer::read_view) are read without intermediate copies.
+     */
+    static Database load(const Serializer&, std::set<Field> fields={}, std::function<bool()> bailout=nullptr, std::shared_ptr<ThreadPool> pool=nullptr);
+
+
+    /**
+     * Load the part of a database selected by the given options; see
+     * LoadOptions. The patches to load are found from the serializer's
+     * index (see Serializer::read_index).
+     */
+    static Database load(const Serializer&, const LoadOptions& options);
+
+
+private:
+    friend class LevelScheduler;
+
+    // ========================================================================
+    /**
+     * Hash function for patch indexes.
+     */
+    struct IndexHash
+    {
+        std::size_t operator()(const Index& index) const;
+    };
+
+    /**
+     * Comparison of patch indexes in a given ordering. Patches of different
+     * fields in the same block are ordered by field.
+     */
+    struct IndexOrder
+    {
+        Ordering ordering = Ordering::index;
+        bool operator()(const Index& a, const Index& b) const;
+    };
+
+    /**
+     * Container for the patch data. Patches are iterated over in the given
+     * ordering as with a std::map, but lookups go through a hash table, and
+     * the data for all the patches of each field lives in one contiguous
+     * slab, which grows by doubling. Slots vacated by erase are reused. The
+     * Array objects in the container keep their address for as long as the
+     * patch exists; when a slab grows they are rebound to the new memory, so
+     * shallow copies of them taken before then no longer refer to the stored
+     * data. Copying the container makes a deep copy. The replace method
+     * erases and inserts a batch of patches, or throws without changing
+     * anything if a removed patch is missing or an added one already exists.
+     */
+    class PatchStore
+    {
+    public:
+        using container_type = std::map<Index, Array, IndexOrder>;
+        using const_iterator = container_type::const_iterator;
+
+        PatchStore() {}
+        PatchStore(Ordering ordering);
+        PatchStore(const PatchStore& other);
+        PatchStore(PatchStore&& other) = default;
+        PatchStore& operator=(const PatchStore& other);
+        PatchStore& operator=(PatchStore&& other) = default;
+
+        const_iterator begin() const { return ordered.begin(); }
+        const_iterator end() const { return ordered.end(); }
+        std::size_t size() const { return ordered.size(); }
+        std::size_t count(Index index) const { return lookup.count(index); }
+        const Array& at(Index index) const;
+        Array& at(Index index);
+        bool insert(Index index, const Array& data);
+        std::size_t erase(Index index);
+        void replace(const std::vector<Index>& removed, const std::vector<std::pair<Index, Array>>& added);
+        void clear();
+        void set_ordering(Ordering ordering);
+        Ordering ordering() const { return ordered.key_comp().ordering; }
+
+    private:
+        struct Slab
+        {
+            Array memory;
+            std::vector<Array*> slots;
+            std::vector<int> vacant;
+            int rows = 0;
+            int live = 0;
+        };
+        struct Entry
+        {
+            Array* patch;
+            int slot;
+        };
+        void grow(Slab& slab, std::array<int, 3> shape);
+        container_type ordered;
+        std::unordered_map<Index, Entry, IndexHash> lookup;
+        std::map<Field, Slab> slabs;
+    };
+
+    /**
+     * Describes where the data for a (possibly non-existent) patch index can
+     * be read from: a patch stored at that index, a quadrant of its parent
+     * patch at the next coarser level, the four child patches at the next
+     * finer level, or nowhere, in which case the boundary value callback is
+     * needed. The data pointers refer to nodes in the patches container, or
+     * are null for parts stored on another rank. The origin of each part is
+     * the patch coordinate of its element (0, 0); it is zero except for
+     * partial arrays received from a remote rank. The stagger is 1 along an
+     * axis where the data is vertex-centered, and 0 where it is
+     * cell-centered.
+     */
+    struct Source
+    {
+        enum class Kind { none, same_level, coarse, fine };
+        Kind kind = Kind::none;
+        std::array<const Array*, 4> data = {{nullptr, nullptr, nullptr, nullptr}};
+        std::array<Index, 4> parts;
+        std::array<int, 4> ranks = {{-1, -1, -1, -1}};
+        std::array<int, 4> origin_i = {{0, 0, 0, 0}};
+        std::array<int, 4> origin_j = {{0, 0, 0, 0}};
+        int quadrant_i = 0;
+        int quadrant_j = 0;
+        int stagger_i = 0;
+        int stagger_j = 0;
+        bool is_remote() const;
+    };
+
+    /**
+     * One of the guard zone regions of a target patch: the region
+     * [i0, i1) x [j0, j1) of the patch across the given edge or corner, to
+     * be written at (di, dj) in the padded result. For vertex and face data
+     * the region may include the row shared with the target patch, in
+     * addition to the depth guard zones. The depth of a corner is the larger
+     * of its two guard zone counts, or zero if either of them is.
+     */
+    struct Strip
+    {
+        PatchBoundary edge;
+        int depth;
+        int i0, i1, j0, j1;
+        int di, dj;
+    };
+
+    /**
+     * A record of the guard zone sources for each of the patches, indexed by
+     * PatchBoundary. The plan is valid only as long as the topology version
+     * it was built from is current; any insert of a new index, erase, or
+     * clear changes the topology and causes the plan to be rebuilt on the
+     * next call to fetch.
+     */
+    struct FillPlan
+    {
+        struct Entry
+        {
+            const Array* patch = nullptr;
+            std::array<Source, 8> edges;
+            bool remote = false;
+        };
+        std::size_t version = 0;
+        std::unordered_map<Index, Entry, IndexHash> patches;
+    };
+
+    /**
+     * Holds the cached fill plan. Copies of a database do not inherit the
+     * cache, since the plan points into the original database's patches.
+     * The mutex guards rebuilding the plan from concurrent fetch calls.
+     */
+    struct PlanCache
+    {
+        PlanCache() {}
+        PlanCache(const PlanCache&) {}
+        PlanCache& operator=(const PlanCache&) { plan.reset(); return *this; }
+        std::shared_ptr<const FillPlan> plan;
+        std::mutex mutex;
+    };
+
+    /**
+     * Holds the cached guard zone strips, keyed by the target patch, the
+     * edge, and the extent [i0, i1) x [j0, j1) of the strip, along with the
+     * versions of the patches each strip was computed from (its stamps).
+     * Like the fill plan, the strips are not inherited by copies.
+     */
+    struct StripCache
+    {
+        using Key = std::tuple<Index, PatchBoundary, int, int, int, int>;
+        using Stamps = std::array<std::uint64_t, 8>;
+        struct Entry
+        {
+            Stamps stamps;
+            Array data;
+        };
+        StripCache() {}
+        StripCache(const StripCache& other) : enabled(other.enabled) {}
+        StripCache& operator=(const StripCache& other) { enabled = other.enabled; strips.clear(); return *this; }
+        bool enabled = false;
+        std::size_t version = 0;
+        std::size_t hits = 0;
+        std::map<Key, Entry> strips;
+        std::mutex mutex;
+    };
+
+    /**
+     * Holds the summaries of the patches of the fields which have them
+     * enabled, each with the patch version it was computed from, in the
+     * stored layout. mipmaps[n] is the patch averaged over 2^(n + 1) x
+     * 2^(n + 1) cells. Entries for patches which no longer exist are pruned
+     * once the topology has changed. Like the strip cache, the summaries
+     * are not inherited by copies.
+     */
+    struct SummaryCache
+    {
+        struct Entry
+        {
+            std::uint64_t version = 0;
+            Summary summary;
+            std::vector<Array> mipmaps;
+        };
+        SummaryCache() {}
+        SummaryCache(const SummaryCache& other) : fields(other.fields) {}
+        SummaryCache& operator=(const SummaryCache& other) { fields = other.fields; entries.clear(); return *this; }
+        std::set<Field> fields;
+        std::size_t version = 0;
+        std::unordered_map<Index, std::shared_ptr<const Entry>, IndexHash> entries;
+        std::mutex mutex;
+    };
+
+    /**
+     * The prolongation and restriction operators registered for a field.
+     * The user-defined operators take precedence over the schemes if they
+     * are set.
+     */
+    struct Operators
+    {
+        ProlongationScheme prolongation = ProlongationScheme::piecewise_constant;
+        RestrictionScheme restriction = RestrictionScheme::average;
+        ProlongationOperator custom_prolongation = nullptr;
+        RestrictionOperator custom_restriction = nullptr;
+    };
+
+    // ========================================================================
+    int num_fields(Index index) const;
+    MeshLocation location(Index index) const;
+    std::array<int, 3> expected_shape(Index index) const;
+    std::array<Index, 4> refine(Index index) const;
+    using Block = std::tuple<int, int, int>; // i, j, level
+    void apply_regrid(const std::vector<Block>& refined, const std::vector<Block>& coarsened);
+    Index coarsen(Index index) const;
+    Array check_shape(Array& array, Index index) const;
+    Layout layout(Index index) const;
+    std::array<int, 3> layout_shape(Index index) const;
+    void insert_stored(Index index, Array data);
+    void commit_stored(Index index, View data, double rk_factor=0.0);
+    static View make_view(const Array& array);
+    static View layout_view(const Array& array, Layout layout);
+    static View layout_view(View view, Layout layout);
+    static Array to_stored(const Array& array, Layout layout);
+    static Array from_stored(const Array& array, Layout layout);
+    static bool has_contiguous_rows(const Array& array);
+    static void update(Array& target, View data, double rk_factor, Layout layout=Layout::aos);
+    Array locate(const Source& source, int i0, int i1, int j0, int j1, const Array* target=nullptr, PatchBoundary edge=PatchBoundary::il) const;
+    Source resolve(Index index) const;
+    const Operators& operators_for(Field which) const;
+    Array prolong_custom(const Source& source, int i0, int i1, int j0, int j1) const;
+    Array restrict_custom(const Source& source, int i0, int i1, int j0, int j1) const;
+    Array restrict_volume_weighted(const Source& source, int i0, int i1, int j0, int j1) const;
+    template<typename Limiter>
+    Array prolong_linear(const Source& source, int i0, int i1, int j0, int j1, const Array* target, PatchBoundary edge) const;
+    Array locate_staggered(const Source& source, int i0, int i1, int j0, int j1) const;
+    void assign_part(Source& source, int n, Index index) const;
+    bool exists(Index index) const;
+    std::array<int, 4> footprint(const Source& source, int n, const Strip& strip) const;
+    std::array<Strip, 8> strips(const FillPlan::Entry& entry, int ngil, int ngir, int ngjl, int ngjr) const;
+    Array boundary(Index index, const Strip& strip, const Array& patch) const;
+    void fill_local(Index index, const FillPlan::Entry& entry, std::array<int, 4> guards, const std::function<void(int, int, const Array&)>& emit) const;
+    void fill_strip(Index index, const FillPlan::Entry& entry, const Strip& strip, const std::function<void(int, int, const Array&)>& emit) const;
+    StripCache::Stamps stamps(Index index, const Source& source) const;
+    std::vector<std::future<Array>> fetch_batch_async(std::vector<Index> indexes, std::array<int, 4> guards, std::vector<Array> outputs={}) const;
+    std::shared_ptr<const FillPlan> fill_plan() const;
+    std::shared_ptr<const SummaryCache::Entry> summarize(Index index) const;
+    Array downsample(Index index, int factor, int deepest) const;
+    std::array<int, 2> window_shape(int i0, int i1, int j0, int j1, int stride) const;
+    void assemble_pieces(int i0, int i1, int j0, int j1, int level, Field field, int stride, std::array<int, 4> range, const std::function<void(int, int, View)>& emit) const;
+    std::vector<Index> indexes(Field which) const;
+    Array allocate(int ni, int nj, int nf) const;
+    void recycle(const Source& source, Array array) const;
+    void parallel_for(std::size_t count, std::function<void(std::size_t)> fn) const;
+    Array quadrant(const nd::array<double, 3>& A, int I, int J) const;
+    Array tile(std::array<Index, 4> indexes) const;
+    Array prolongation(const nd::array<double, 3>& A) const;
+    Array restriction(const nd::array<double, 3>& A) const;
+
+    template <typename IndexContainer>
+    bool contains_all(IndexContainer indexes) const
+    {
+        for (auto index : indexes)
+        {
+            if (patches.count(index) == 0)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // ========================================================================
+    int ni = 0;
+    int nj = 0;
+    Header header;
+    PatchStore patches;
+    std::map<Index, std::string> frozen;
+    std::size_t topology_version = 0;
+    std::unordered_map<Index, std::uint64_t, IndexHash> versions;
+    mutable StripCache strip_cache;
+    mutable SummaryCache summary_cache;
+    mutable PlanCache plan_cache;
+    BoundaryValue boundary_value = nullptr;
+    std::shared_ptr<ThreadPool> thread_pool;
+    std::shared_ptr<ArrayPool> array_pool;
+    std::shared_ptr<Transport> transport;
+    std::map<Index, int> owners;
+    std::map<Field, Operators> operators;
+};
+
+
+
+
+// ============================================================================
+/**
+ * A patch index packed into 64 bits: the level in the upper 6 bits, the
+ * block coordinates below it, interleaved bitwise in Morton order (i in the
+ * odd bits and j in the even bits of a 52-bit field), and the field in the
+ * lower 6 bits. Keys of one level sort in Morton order, with the fields of
+ * a block adjacent, and the parent, children, and neighbors of a block are
+ * found with a few bit operations instead of by building tuples. Levels 0
+ * to 63 and coordinates in [0, 2^26) are representable.
+ */
+class patches2d::PatchKey
+{
+public:
+    PatchKey() {}
+
+    /**
+     * Construct the key for the given block and field. An exception is
+     * thrown if the block is out of the representable range.
+     */
+    PatchKey(int i, int j, int level, Field field);
+
+    /** Construct the key for the given patch index, as above. */
+    explicit PatchKey(Database::Index index);
+
+    /** Return the key with the given bit pattern, as returned by bits. */
+    static PatchKey from_bits(std::uint64_t bits) { auto key = PatchKey(); key.packed = bits; return key; }
+
+    std::uint64_t bits() const { return packed; }
+    int i() const { return int(compact(packed >> (field_bits + 1))); }
+    int j() const { return int(compact(packed >> field_bits)); }
+    int level() const { return int(packed >> level_shift); }
+    Field field() const { return Field(packed & field_mask); }
+    Database::Index index() const { return std::make_tuple(i(), j(), level(), field()); }
+
+    /** Return the key of the same block, for another field. */
+    PatchKey with_field(Field which) const
+    {
+        return from_bits((packed & ~field_mask) | std::uint64_t(which));
+    }
+
+    /**
+     * Return the key of the block one level coarser which contains this one.
+     * An exception is thrown at level 0.
+     */
+    PatchKey parent() const
+    {
+        if (level() == 0)
+        {
+            throw std::logic_error("PatchKey::parent: a level 0 block has no parent");
+        }
+        auto position = ((packed & position_mask) >> 2) & position_mask;
+        return from_bits(((packed >> level_shift) - 1) << level_shift | position | (packed & field_mask));
+    }
+
+    /**
+     * Return the key of the child (I, J) one level finer, where I and J are
+     * 0 or 1. An exception is thrown if the child would be out of range.
+     */
+    PatchKey child(int I, int J) const
+    {
+        if (level() == max_level || (packed >> (level_shift - 2) & 3))
+        {
+            throw std::out_of_range("PatchKey::child: the child block is out of range");
+        }
+        auto position = (packed & position_mask) << 2 | std::uint64_t(I) << (field_bits + 1) | std::uint64_t(J) << field_bits;
+        return from_bits(((packed >> level_shift) + 1) << level_shift | position | (packed & field_mask));
+    }
+
+    /** Return the four children, ordered as in Database::refine_patch. */
+    std::array<PatchKey, 4> children() const
+    {
+        return {{child(0, 0), child(0, 1), child(1, 0), child(1, 1)}};
+    }
+
+    /**
+     * Return the key of the block across the given edge or corner, at the
+     * same level. Coordinates wrap around modulo 2^26, so the neighbor
+     * across a low edge of the domain is a block which is never stored in
+     * practice, much as a -1 coordinate in a Database::Index.
+     */
+    PatchKey neighbor(PatchBoundary edge) const
+    {
+        switch (edge)
+        {
+            case PatchBoundary::il:    return step_i(-1);
+            case PatchBoundary::ir:    return step_i(+1);
+            case PatchBoundary::jl:    return step_j(-1);
+            case PatchBoundary::jr:    return step_j(+1);
+            case PatchBoundary::il_jl: return step_i(-1).step_j(-1);
+            case PatchBoundary::il_jr: return step_i(-1).step_j(+1);
+            case PatchBoundary::ir_jl: return step_i(+1).step_j(-1);
+            case PatchBoundary::ir_jr: return step_i(+1).step_j(+1);
+        }
+        return *this;
+    }
+
+    bool operator==(const PatchKey& other) const { return packed == other.packed; }
+    bool operator!=(const PatchKey& other) const { return packed != other.packed; }
+    bool operator<(const PatchKey& other) const { return packed < other.packed; }
+
+    /** Hash function, for use in unordered containers. */
+    struct Hash
+    {
+        std::size_t operator()(const PatchKey& key) const
+        {
+            auto h = key.packed * 0x9E3779B97F4A7C15ull;
+            return std::size_t(h ^ (h >> 32));
+        }
+    };
+
+    static const int max_level = 63;
+    static const int max_coordinate = (1 << 26) - 1;
+
+private:
+    static const int field_bits = 6;
+    static const int level_shift = 58;
+    static const std::uint64_t field_mask = 0x3Full;
+    static const std::uint64_t j_mask = 0x5555555555555ull << field_bits;
+    static const std::uint64_t i_mask = j_mask << 1;
+    static const std::uint64_t position_mask = i_mask | j_mask;
+
+    static std::uint64_t compact(std::uint64_t x)
+    {
+        x &= 0x5555555555555555ull;
+        x = (x | (x >> 1)) & 0x3333333333333333ull;
+        x = (x | (x >> 2)) & 0x0F0F0F0F0F0F0F0Full;
+        x = (x | (x >> 4)) & 0x00FF00FF00FF00FFull;
+        x = (x | (x >> 8)) & 0x0000FFFF0000FFFFull;
+        x = (x | (x >> 16)) & 0x00000000FFFFFFFFull;
+        return x & 0x3FFFFFFull;
+    }
+
+    // ------------------------------------------------------------------------
+    // Adding or subtracting one in the interleaved i (or j) bits: the other
+    // bits are filled with ones so the carry passes over them, or cleared so
+    // the borrow does.
+    // ------------------------------------------------------------------------
+    PatchKey step_i(int delta) const
+    {
+        auto i = delta > 0 ? ((packed | ~i_mask) + (i_mask & -i_mask)) & i_mask : ((packed & i_mask) - (i_mask & -i_mask)) & i_mask;
+        return from_bits((packed & ~i_mask) | i);
+    }
+    PatchKey step_j(int delta) const
+    {
+        auto j = delta > 0 ? ((packed | ~j_mask) + (j_mask & -j_mask)) & j_mask : ((packed & j_mask) - (j_mask & -j_mask)) & j_mask;
+        return from_bits((packed & ~j_mask) | j);
+    }
+
+    std::uint64_t packed = 0;
+};
+
+
+
+
+// ============================================================================
+class patches2d::ThreadPool
+{
+public:
+    /**
+     * Create a pool with the given number of worker threads. The thread
+     * calling run also does work, so a pool with n workers runs on n + 1
+     * threads. A pool with zero workers runs everything on the calling
+     * thread.
+     */
+    ThreadPool(int num_workers);
+
+
+    /** Stop and join the worker threads. */
+    ~ThreadPool();
+
+
+    /** Return the number of worker threads. */
+    int size() const { return int(workers.size()); }
+
+
+    /**
+     * Invoke fn(n) for each n in [0, count), distributed over the worker
+     * threads and the calling thread, and return when all calls have
+     * finished. If any call throws, the first exception is rethrown here.
+     * Calls to run from several threads are serialized, and a call from
+     * inside fn runs serially on that thread.
+     */
+    void run(std::size_t count, std::function<void(std::size_t)> fn);
+
+private:
+    void work();
+    std::vector<std::thread> workers;
+    std::mutex run_mutex;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    std::function<void(std::size_t)> job;
+    std::size_t job_count = 0;
+    std::size_t next = 0;
+    std::size_t finished = 0;
+    std::size_t generation = 0;
+    int busy = 0;
+    bool stop = false;
+    std::exception_ptr error;
+};
+
+
+
+
+// ============================================================================
+/**
+ * A thread-safe cache of arrays, keyed by shape. Patch data across a
+ * database comes in a handful of shapes, so the arrays which fetch and its
+ * relatives would allocate over and over can instead be reused.
+ */
+class patches2d::ArrayPool
+{
+public:
+    /**
+     * Create a pool which caches at most max_per_shape released arrays of
+     * each shape; arrays released beyond that are freed.
+     */
+    ArrayPool(std::size_t max_per_shape=64);
+
+
+    /**
+     * Return an array of the given shape, reusing a released one if there
+     * is one. The contents of the array are unspecified.
+     */
+    nd::array<double, 3> acquire(std::array<int, 3> shape);
+
+
+    /**
+     * Give an array back to the pool, to be returned by a later call to
+     * acquire. The array must have been allocated whole, as by acquire or
+     * an array constructor (not selected from a larger one), and no other
+     * copy of it may be used afterwards.
+     */
+    void release(nd::array<double, 3> array);
+
+
+    /** Free all of the cached arrays. */
+    void clear();
+
+
+    /** Return the number of cached arrays. */
+    std::size_t size() const;
+
+
+    /** Return the number of arrays acquire has had to allocate. */
+    std::size_t allocations() const;
+
+private:
+    std::size_t max_per_shape;
+    std::size_t num_allocations = 0;
+    std::map<std::array<int, 3>, std::vector<nd::array<double, 3>>> cache;
+    mutable std::mutex mutex;
+};
+
+
+
+
+// ============================================================================
+/**
+ * Advances the patches of a database in time with Berger-Oliger style
+ * subcycling: each level takes two steps for every step of the next coarser
+ * level, so that fine patches do not force the coarse ones to take tiny
+ * steps. The mesh is assumed to be made of non-overlapping patches whose
+ * neighbors differ by at most one level, as maintained by
+ * Database::regrid, and all of the patches must be stored locally.
+ *
+ * While a level is stepping, each coarser patch bordering it holds the
+ * linear interpolation in time between its data before and after its own
+ * step, so that the guard zones which fine patches fetch from it are taken
+ * at the time the fine step begins. The coarse data is restored once the
+ * fine level has caught up.
+ *
+ * If the database holds Field::flux_i and Field::flux_j patches (at the
+ * face_i and face_j locations), they serve as flux registers. The step
+ * function must then write into them, for every patch it advances, the
+ * amount of each conserved quantity which crossed each face during the
+ * step, in the direction of increasing index (the flux times the face
+ * area and the time step). Once a fine level has caught up, each coarse
+ * cell on a coarse/fine interface is corrected by the difference between
+ * the coarse flux through that face and the sum of the fine fluxes through
+ * it over both fine steps, divided by the coarse cell's volume, so that the
+ * update is conservative. The coarse patches must then have
+ * Field::cell_volume data.
+ */
+class patches2d::LevelScheduler
+{
+public:
+    /**
+     * A function to advance the given patches, which are all at one level,
+     * from time to time + dt. It should fetch their guard zones and commit
+     * their new data to the database, and write the flux registers if they
+     * are in use. It is called on the thread which calls advance.
+     */
+    using Step = std::function<void(
+
+        int level,                                  /**< The level being advanced */
+
+        double time,                                /**< The time at the start of the step */
+
+        double dt,                                  /**< The time step at this level */
+
+        const std::vector<Database::Index>& patches /**< The patches to advance (all of the field) */
+
+        )>;
+
+
+    /**
+     * Create a scheduler for the patches of the given field, which is the
+     * one interpolated in time for coarse guard zones and corrected at
+     * coarse/fine interfaces. The database must outlive the scheduler.
+     */
+    LevelScheduler(Database& database, Field which, Step step);
+
+
+    /**
+     * Advance every level by the given time step of the coarsest level. The
+     * levels are taken from the patches present when this is called, so the
+     * mesh may be regridded between calls but not during one.
+     */
+    void advance(double dt);
+
+
+    /** Return the time of the coarsest level. */
+    double time() const { return current_time; }
+
+
+    /** Set the time of the coarsest level, e.g. when restarting a run. */
+    void set_time(double time) { current_time = time; }
+
+
+    /** Return the number of steps taken so far at the given level. */
+    std::size_t num_steps(int level) const;
+
+private:
+    using Index = Database::Index;
+    void advance_level(int level, double time, double dt);
+    void record_fluxes(int level);
+    void reflux(int level);
+    std::vector<Index> bordering(int level) const;
+    bool has_flux_registers() const;
+    Database& database;
+    Field which;
+    Step step;
+    double current_time = 0.0;
+    std::map<int, std::size_t> step_counts;
+    std::map<int, std::vector<Index>> levels;
+    std::set<Index> present;
+    std::map<std::pair<Index, PatchBoundary>, nd::array<double, 3>> registers;
+};
+
+
+
+
+// ============================================================================
+namespace patches2d {
+    std::string to_string(MeshLocation location);
+    std::string to_string(Field field);
+    std::string to_string(Database::Index index);
+    std::string to_string(Database::Index index, std::string field_name);
+    MeshLocation    parse_location(std::string str);
+    Field           parse_field(std::string str);
+    Database::Index parse_index(std::string str);
+
+    /**
+     * Parse a field name or a patch index from the characters [first, last),
+     * in the format written by to_string, e.g. "1.2-3/conserved", without
+     * allocating. An exception is thrown if the text is malformed.
+     */
+    Field           parse_field(const char* first, const char* last);
+    Database::Index parse_index(const char* first, const char* last);
+
+    /**
+     * Write the index into [first, last) in the format of to_string, without
+     * a terminating null, and return the end of what was written. A buffer
+     * of 64 characters is always enough; an exception is thrown if the
+     * given one is too short.
+     */
+    char* format_index(Database::Index index, char* first, char* last);
+
+    std::string to_string(KernelIsa isa);
+    std::string to_string(Compression compression);
+    std::string to_string(Layout layout);
+    Layout          parse_layout(std::string str);
+
+    /**
+     * Return the position of the block (i, j, level) along the Morton or
+     * Hilbert curve: the position of its first cell at level 20, in the
+     * upper 56 bits, followed by the level. Sorting blocks by key puts them
+     * in curve order, with each block just before its descendants. Levels
+     * 0 to 20 are supported, with up to 256 blocks along each axis at level
+     * 0; an exception is thrown for indexes out of that range.
+     */
+    std::uint64_t morton_key(int i, int j, int level);
+    std::uint64_t hilbert_key(int i, int j, int level);
+
+    /**
+     * Assign the given patches to num_parts ranks (or threads), so that each
+     * part receives a contiguous segment of the blocks in the given ordering
+     * with about the same total cost. The patches of all fields in a block
+     * are assigned together, and the cost of a block is the sum of theirs.
+     * If all the costs are zero, the blocks are given equal costs. Returns
+     * the part of each patch, where the parts are numbered along the curve.
+     */
+    std::map<Database::Index, int> partition(const std::map<Database::Index, double>& costs, int num_parts, Ordering ordering=Ordering::hilbert);
+
+    /**
+     * Update a partition after the mesh has changed, e.g. by regrid, while
+     * moving as few patches as possible. Blocks in the previous partition
+     * keep their part, and new blocks take the part of their parent or
+     * children in the previous partition (those they were refined from or
+     * coarsened from), or failing that, of the nearest preceding block in the
+     * ordering (or following, at the start). This is returned if the most
+     * heavily loaded part exceeds the average load by at most the given
+     * fraction. Otherwise the blocks are repartitioned as by partition; if
+     * the previous partition also came from partition with the same ordering,
+     * only the blocks near the shifted segment boundaries change parts.
+     */
+    std::map<Database::Index, int> repartition(const std::map<Database::Index, double>& costs, const std::map<Database::Index, int>& previous, int num_parts, double tolerance=0.1, Ordering ordering=Ordering::hilbert);
+
+    std::string to_string(Operation operation);
+
+    /** Return true if the instrumentation layer is compiled in. */
+    bool profiling_enabled();
+
+    /**
+     * Return a snapshot of the instrumentation counters, for every operation,
+     * level, and field which has been counted since the last reset. The
+     * counters are updated atomically, and may be read while other threads
+     * are working. Without PATCHES_PROFILE there are no counters, so this
+     * (like profile_events) returns an empty vector.
+     */
+    std::vector<ProfileCounter> profile_counters();
+
+    /** Zero the counters, discard the trace events, and restart the clock. */
+    void reset_profile();
+
+    /**
+     * Enable or disable recording a trace event for every operation, keeping
+     * at most max_events of them (later ones are dropped). Recording takes a
+     * lock, so it is more intrusive than the counters.
+     */
+    void set_profile_tracing(bool enabled, std::size_t max_events=1 << 20);
+
+    /** Return the trace events recorded since the last reset. */
+    std::vector<ProfileEvent> profile_events();
+
+    /**
+     * Format counters as a JSON array of objects, with the keys operation,
+     * level, field, calls, bytes, allocations, and seconds.
+     */
+    std::string profile_to_json(const std::vector<ProfileCounter>& counters);
+
+    /**
+     * Format trace events in the Chrome trace event format, which can be
+     * opened with chrome://tracing or Perfetto. Each operation is a complete
+     * event on its thread, with the level and byte count as arguments.
+     */
+    std::string profile_to_chrome_trace(const std::vector<ProfileEvent>& events);
+
+    /** Return the instruction set of the kernels currently in use. */
+    KernelIsa kernel_isa();
+
+    /**
+     * Override the instruction set of the kernels, e.g. to compare against
+     * the scalar kernels in tests and benchmarks. An exception is thrown if
+     * the running CPU does not support it. This is not thread-safe with
+     * respect to concurrent calls to fetch.
+     */
+    void set_kernel_isa(KernelIsa isa);
+
+    /**
+     * The row kernels used by fetch, with the instruction set currently in
+     * use. prolong_row writes the fine cells [j0, j1) of a row of
+     * num_fields-component cells, where fine cell j takes the value of
+     * coarse cell j / 2. restrict_row writes count coarse cells, each the
+     * average of the 2x2 fine cells beneath it in rows r0 and r1. They are
+     * exposed so that the 3D database can share them.
+     */
+    void prolong_row(const double* coarse, double* fine, int j0, int j1, int num_fields);
+    void restrict_row(const double* r0, const double* r1, double* out, int count, int num_fields);
+
+    /**
+     * Run a guard zone fill program on the host, reading the packed patch
+     * interiors and the staging buffer, and writing the packed padded
+     * results. This is the reference for device implementations. If a pool
+     * is given, the targets are distributed over it.
+     */
+    void run_guard_program(const Database::GuardProgram& program, const double* patches, const double* staging, double* padded, std::shared_ptr<ThreadPool> pool=nullptr);
+
+    /**
+     * Encode an array with the given compression scheme; see Compression.
+     * The tolerance must be positive for the lossy scheme, and the values
+     * finite. The result records the shape and scheme, so it can be decoded
+     * without any other information.
+     */
+    std::string compress(const nd::array<double, 3>& data, Compression compression, double tolerance=0.0);
+
+    /** Decode an array encoded by compress. */
+    nd::array<double, 3> decompress(const std::string& bytes);
+}
+
+
+
+
+// ============================================================================
+class patches2d::Serializer
+{
+public:
+    /**
+     * Destructor.
+     */
+    virtual ~Serializer() {}
+
+    /**
+     * This method must return a list of the fields in a given patch. If this
+     * reader is filesystem-based, it probably returns a list of the file
+     * names in the directory for that patch. If it is HDF5, it might return
+     * the names of the datasets in the group for that patch..
+     */
+    virtual std::vector<std::string> list_fields(std::string patch_index) const = 0;
+
+    /**
+     * This method must return a list of the patches in the database.
+     */
+    virtual std::vector<std::string> list_patches() const = 0;
+
+    /**
+     * This method must return an array read from the given location.
+     */
+    virtual nd::array<double, 3> read_array(std::string path) const = 0;
 
     /**
      * This method must return the block size (ni, nj) for the database at the
@@ -332,4 +2020,138 @@ public:
      * This method must write a block size (ni, nj) to the given location.
      */
     virtual void write_block_size(std::array<int, 2> block_size) const = 0;
+
+    /**
+     * This method may write an array of the given shape to the given location
+     * without holding all of it: fill(i0, i1, rows) is called for ranges of
+     * rows [i0, i1) in order, covering the array, and must write those rows
+     * into rows, which has shape [i1 - i0, shape[1], shape[2]]. The default
+     * gathers the whole array and calls write_array.
+     */
+    using RowFill = std::function<void(int i0, int i1, nd::array<double, 3>& rows)>;
+    virtual void write_rows(std::string path, std::array<int, 3> shape, RowFill fill) const;
+
+    /**
+     * This method may write an array of the given shape to the given location
+     * one plane at a time, without holding any plane whole: fill(n, i0, i1,
+     * rows) is called for ranges of rows [i0, i1) of each plane n along the
+     * first axis, in order, and must write them into rows, which has shape
+     * [1, i1 - i0, shape[2]]. The default gathers the whole array and calls
+     * write_array.
+     */
+    using PlaneFill = std::function<void(int n, int i0, int i1, nd::array<double, 3>& rows)>;
+    virtual void write_planes(std::string path, std::array<int, 3> shape, PlaneFill fill) const;
+
+    /**
+     * This method may return the index of every array in the database, from
+     * which the array paths are to_string(index). A serializer which keeps
+     * an index of its contents should return it, so that loading needs no
+     * directory scan. The default lists the patches and their fields, and
+     * parses the names.
+     */
+    virtual std::vector<Database::Index> read_index() const;
+
+    /**
+     * This method may return a view of the array at the given location, if
+     * it can do so without copying, e.g. from a memory-mapped file. The view
+     * must remain valid for the lifetime of the serializer. The default
+     * returns an empty view, in which case read_array is used.
+     */
+    virtual Database::View read_view(std::string /*path*/) const { return Database::View(); }
+
+    /**
+     * This method is called by Database::dump after everything has been
+     * written. Serializers which buffer their output, or write an index at
+     * the end, finish writing here. The default does nothing.
+     */
+    virtual void flush() const {}
+};
+
+
+
+
+// ============================================================================
+/**
+ * A serializer for single-file binary checkpoints. The file holds the patch
+ * data as raw doubles in native byte order, each array starting on a 64-byte
+ * boundary, followed by an index table with the header, the block size, and
+ * the name, offset, shape, and encoded size of each array. When reading,
+ * the file is memory-mapped where the platform supports it, and read_view
+ * returns views straight into the mapping. A serializer in write mode
+ * creates the file, and must be flushed (as Database::dump does) to write
+ * the index table. Arrays of the fields given to set_compression are
+ * written compressed, and are decoded by read_array rather than viewed.
+ */
+class patches2d::BinarySerializer : public Serializer
+{
+public:
+    enum class Mode { read, write };
+
+    BinarySerializer(std::string filename, Mode mode);
+    BinarySerializer(const BinarySerializer&) = delete;
+    BinarySerializer& operator=(const BinarySerializer&) = delete;
+    ~BinarySerializer();
+
+    std::vector<std::string> list_fields(std::string patch_index) const override;
+    std::vector<std::string> list_patches() const override;
+    nd::array<double, 3> read_array(std::string path) const override;
+    std::array<int, 2> read_block_size() const override;
+    Database::Header read_header() const override;
+    std::vector<Database::Index> read_index() const override;
+    Database::View read_view(std::string path) const override;
+    void write_array(std::string path, const nd::array<double, 3>& patch) const override;
+    void write_header(Database::Header header) const override;
+    void write_block_size(std::array<int, 2> block_size) const override;
+    void write_rows(std::string path, std::array<int, 3> shape, RowFill fill) const override;
+    void write_planes(std::string path, std::array<int, 3> shape, PlaneFill fill) const override;
+    void flush() const override;
+
+    /**
+     * Write the arrays of the given field with the given compression scheme;
+     * see patches2d::compress. Only valid in write mode.
+     */
+    void set_compression(Field field, Compression compression, double tolerance=0.0);
+
+private:
+    struct Entry
+    {
+        std::uint64_t offset;
+        std::array<int, 3> shape;
+        std::uint64_t bytes; // encoded size, or 0 if stored as raw doubles
+    };
+    void require(Mode required) const;
+    void unmap();
+    Mode mode;
+    std::string filename;
+    mutable std::map<std::string, Entry> entries;
+    mutable Database::Header header;
+    mutable std::array<int, 2> block_size = {{0, 0}};
+    mutable std::unique_ptr<std::ofstream> out;
+    mutable std::uint64_t position = 0;
+    std::map<Field, std::pair<Compression, double>> compression;
+    const char* base = nullptr;
+    std::size_t length = 0;
+    std::vector<double> buffer;
+};
+
+
+
+
+// ============================================================================
+class patches2d::Transport
+{
+public:
+    /**
+     * Destructor.
+     */
+    virtual ~Transport() {}
+
+    /**
+     * This method must send the given batch of queries to the given rank,
+     * and return a future to the responses, one array per query in the same
+     * order. The remote rank is expected to answer the queries by calling
+     * Database::serve on its own database. The queries for a single call to
+     * fetch_async or fetch_all_async are batched into one call per rank.
+     */
+    virtual std::future<std::vector<Database::Array>> query(int rank, std::vector<Database::Query> queries) = 0;
 };
@@ -0,0 +1,505 @@
+#include <algorithm>
+#include <cstdint>
+#include <ostream>
+#include <vector>
+#include <map>
+#include "patches3d.hpp"
+
+
+
+
+// ============================================================================
+std::string patches3d::to_string(Database::Index index)
+{
+    auto i = std::get<0>(index);
+    auto j = std::get<1>(index);
+    auto k = std::get<2>(index);
+    auto p = std::get<3>(index);
+    auto f = std::get<4>(index);
+    return std::to_string(p) + "." + std::to_string(i) + "-" + std::to_string(j) + "-" + std::to_string(k) + "/" + patches2d::to_string(f);
+}
+
+
+
+
+// ============================================================================
+patches3d::Database::Database(int ni, int nj, int nk, Header header)
+: ni(ni)
+, nj(nj)
+, nk(nk)
+, header(header)
+{
+    if (ni % 2 || nj % 2 || nk % 2)
+    {
+        throw std::invalid_argument("block size must be even along each axis");
+    }
+    for (const auto& field : header)
+    {
+        if (field.second.layout != patches2d::Layout::aos)
+        {
+            throw std::invalid_argument("the 3D database only supports the aos layout");
+        }
+    }
+}
+
+void patches3d::Database::set_boundary_value(BoundaryValue b)
+{
+    boundary_value = b;
+}
+
+void patches3d::Database::set_thread_pool(std::shared_ptr<ThreadPool> pool)
+{
+    thread_pool = pool;
+}
+
+void patches3d::Database::insert(Index index, Array data)
+{
+    if (data.shape() != expected_shape(index))
+    {
+        throw std::invalid_argument("input patch data has the wrong shape");
+    }
+    auto it = patches.find(index);
+
+    if (it == patches.end())
+    {
+        patches.emplace(index, data.copy());
+        ++topology_version;
+    }
+    else
+    {
+        it->second.become(data.copy());
+    }
+}
+
+std::size_t patches3d::Database::erase(Index index)
+{
+    ++topology_version;
+    return patches.erase(index);
+}
+
+void patches3d::Database::clear()
+{
+    ++topology_version;
+    patches.clear();
+}
+
+void patches3d::Database::commit(Index index, const Array& data, double rk_factor)
+{
+    auto& target = patches.at(index);
+
+    if (data.shape() != target.shape())
+    {
+        throw std::invalid_argument("input patch data has the wrong shape");
+    }
+    auto a = 1.0 - rk_factor;
+    auto b = rk_factor;
+
+    for (int i = 0; i < target.shape(0); ++i)
+    {
+        for (int j = 0; j < target.shape(1); ++j)
+        {
+            for (int k = 0; k < target.shape(2); ++k)
+            {
+                for (int q = 0; q < target.shape(3); ++q)
+                {
+                    auto& t = target(i, j, k, q);
+                    t = b == 0.0 ? data(i, j, k, q) : data(i, j, k, q) * a + t * b;
+                }
+            }
+        }
+    }
+}
+
+patches3d::Database::Array patches3d::Database::fetch(Index index, int guard) const
+{
+    return fetch(index, guard, guard, guard, guard, guard, guard);
+}
+
+patches3d::Database::Array patches3d::Database::fetch(Index index, int ngil, int ngir, int ngjl, int ngjr, int ngkl, int ngkr) const
+{
+    if (location(index) != MeshLocation::cell)
+    {
+        throw std::invalid_argument("can only fetch cell data (for now)");
+    }
+
+    auto _     = nd::axis::all();
+    auto plan  = fill_plan();
+    const auto& entry = plan->patches.at(index);
+    const auto& patch = *entry.patch;
+    auto res   = Array(ni + ngil + ngir, nj + ngjl + ngjr, nk + ngkl + ngkr, num_fields(index));
+
+    res.select(_|ngil|ni+ngil, _|ngjl|nj+ngjl, _|ngkl|nk+ngkl, _) = patch;
+
+    for (const auto& strip : strips(ngil, ngir, ngjl, ngjr, ngkl, ngkr))
+    {
+        if (strip.depth > 0)
+        {
+            const auto& source = entry.edges[int(strip.edge)];
+            auto bv = source.kind == Source::Kind::none
+            ? boundary_value(index, strip.edge, strip.depth, patch)
+            : locate(source, strip);
+            res.select(
+                _|strip.di|strip.di+bv.shape(0),
+                _|strip.dj|strip.dj+bv.shape(1),
+                _|strip.dk|strip.dk+bv.shape(2), _) = bv;
+        }
+    }
+    return res;
+}
+
+std::map<patches3d::Database::Index, patches3d::Database::Array> patches3d::Database::fetch_all(Field which, int guard) const
+{
+    auto keys = indexes(which);
+    auto data = std::vector<Array>(keys.size());
+    auto res = std::map<Index, Array>();
+
+    parallel_for(keys.size(), [&] (std::size_t n)
+    {
+        data[n].become(fetch(keys[n], guard));
+    });
+
+    for (std::size_t n = 0; n < keys.size(); ++n)
+    {
+        res.emplace(keys[n], data[n]);
+    }
+    return res;
+}
+
+void patches3d::Database::commit_all(std::map<Index, Array> data, double rk_factor)
+{
+    auto items = std::vector<std::map<Index, Array>::iterator>();
+
+    for (auto it = data.begin(); it != data.end(); ++it)
+    {
+        items.push_back(it);
+    }
+
+    parallel_for(items.size(), [&] (std::size_t n)
+    {
+        commit(items[n]->first, items[n]->second, rk_factor);
+    });
+}
+
+const patches3d::Database::Array& patches3d::Database::at(Index index) const
+{
+    return patches.at(index);
+}
+
+std::map<patches3d::Database::Index, patches3d::Database::Array> patches3d::Database::all(Field which) const
+{
+    auto res = std::map<Index, Array>();
+
+    for (const auto& patch : patches)
+    {
+        if (std::get<4>(patch.first) == which)
+        {
+            res.insert(patch);
+        }
+    }
+    return res;
+}
+
+std::size_t patches3d::Database::count(Field which) const
+{
+    std::size_t n = 0;
+
+    for (const auto& patch : patches)
+    {
+        if (std::get<4>(patch.first) == which)
+        {
+            ++n;
+        }
+    }
+    return n;
+}
+
+std::size_t patches3d::Database::num_cells(Field which) const
+{
+    return count(which) * ni * nj * nk;
+}
+
+void patches3d::Database::print(std::ostream& os) const
+{
+    os << std::string(52, '=') << "\n";
+    os << "Database:\n\n";
+    os << "block size: " << ni << " " << nj << " " << nk << "\n";
+    os << "mesh patches:\n\n";
+
+    for (const auto& patch : patches)
+    {
+        os << "\t" << to_string(patch.first) << "\n";
+    }
+    os << "\n";
+}
+
+
+
+
+// ============================================================================
+std::size_t patches3d::Database::IndexHash::operator()(const Index& index) const
+{
+    auto h = std::uint64_t(std::uint32_t(std::get<0>(index)));
+    h = h * 0x9E3779B97F4A7C15ull ^ std::uint32_t(std::get<1>(index));
+    h = h * 0x9E3779B97F4A7C15ull ^ std::uint32_t(std::get<2>(index));
+    h = h * 0x9E3779B97F4A7C15ull ^ std::uint32_t(std::get<3>(index));
+    h = h * 0x9E3779B97F4A7C15ull ^ std::uint32_t(std::get<4>(index));
+    return std::size_t(h ^ (h >> 32));
+}
+
+
+
+
+// ============================================================================
+int patches3d::Database::num_fields(Index index) const
+{
+    return header.at(std::get<4>(index)).num_fields;
+}
+
+patches3d::MeshLocation patches3d::Database::location(Index index) const
+{
+    return header.at(std::get<4>(index)).location;
+}
+
+std::array<int, 4> patches3d::Database::expected_shape(Index index) const
+{
+    switch (location(index))
+    {
+        case MeshLocation::cell: return {ni + 0, nj + 0, nk + 0, num_fields(index)};
+        case MeshLocation::vert: return {ni + 1, nj + 1, nk + 1, num_fields(index)};
+        case MeshLocation::face_i: return {ni + 1, nj + 0, nk + 0, num_fields(index)};
+        case MeshLocation::face_j: return {ni + 0, nj + 1, nk + 0, num_fields(index)};
+    }
+    throw;
+}
+
+std::array<patches3d::Database::Index, 8> patches3d::Database::refine(Index index) const
+{
+    auto i = std::get<0>(index);
+    auto j = std::get<1>(index);
+    auto k = std::get<2>(index);
+    auto p = std::get<3>(index);
+    auto f = std::get<4>(index);
+
+    return {
+        std::make_tuple(i * 2 + 0, j * 2 + 0, k * 2 + 0, p + 1, f),
+        std::make_tuple(i * 2 + 0, j * 2 + 0, k * 2 + 1, p + 1, f),
+        std::make_tuple(i * 2 + 0, j * 2 + 1, k * 2 + 0, p + 1, f),
+        std::make_tuple(i * 2 + 0, j * 2 + 1, k * 2 + 1, p + 1, f),
+        std::make_tuple(i * 2 + 1, j * 2 + 0, k * 2 + 0, p + 1, f),
+        std::make_tuple(i * 2 + 1, j * 2 + 0, k * 2 + 1, p + 1, f),
+        std::make_tuple(i * 2 + 1, j * 2 + 1, k * 2 + 0, p + 1, f),
+        std::make_tuple(i * 2 + 1, j * 2 + 1, k * 2 + 1, p + 1, f),
+    };
+}
+
+patches3d::Database::Index patches3d::Database::coarsen(Index index) const
+{
+    std::get<0>(index) >>= 1;
+    std::get<1>(index) >>= 1;
+    std::get<2>(index) >>= 1;
+    std::get<3>(index) -= 1;
+    return index;
+}
+
+patches3d::Database::Index patches3d::Database::neighbor(Index index, PatchBoundary edge) const
+{
+    switch (edge)
+    {
+        case PatchBoundary::il: std::get<0>(index) -= 1; break;
+        case PatchBoundary::ir: std::get<0>(index) += 1; break;
+        case PatchBoundary::jl: std::get<1>(index) -= 1; break;
+        case PatchBoundary::jr: std::get<1>(index) += 1; break;
+        case PatchBoundary::kl: std::get<2>(index) -= 1; break;
+        case PatchBoundary::kr: std::get<2>(index) += 1; break;
+    }
+    return index;
+}
+
+patches3d::Database::Source patches3d::Database::resolve(Index index) const
+{
+    auto source = Source();
+
+    if (patches.count(index))
+    {
+        source.kind = Source::Kind::same_level;
+        source.data[0] = &patches.at(index);
+    }
+    else if (patches.count(coarsen(index)))
+    {
+        source.kind = Source::Kind::coarse;
+        source.data[0] = &patches.at(coarsen(index));
+        source.octant_i = std::get<0>(index) & 1;
+        source.octant_j = std::get<1>(index) & 1;
+        source.octant_k = std::get<2>(index) & 1;
+    }
+    else
+    {
+        auto children = refine(index);
+
+        for (const auto& child : children)
+        {
+            if (! patches.count(child))
+            {
+                return source;
+            }
+        }
+        source.kind = Source::Kind::fine;
+
+        for (int n = 0; n < 8; ++n)
+        {
+            source.data[n] = &patches.at(children[n]);
+        }
+    }
+    return source;
+}
+
+patches3d::Database::Array patches3d::Database::locate(const Source& source, const Strip& strip) const
+{
+    // ------------------------------------------------------------------------
+    // Rows along the k axis have the same layout as the rows of 2D patches,
+    // so the 2D row kernels do the work. A coarse cell is the average of the
+    // two 2x2 averages of its children at fine i and i + 1, which the
+    // restrict_row kernel computes for one row pair each.
+    // ------------------------------------------------------------------------
+    auto _ = nd::axis::all();
+    auto i0 = strip.i0, i1 = strip.i1;
+    auto j0 = strip.j0, j1 = strip.j1;
+    auto k0 = strip.k0, k1 = strip.k1;
+
+    switch (source.kind)
+    {
+        case Source::Kind::none:
+        {
+            return Array();
+        }
+        case Source::Kind::same_level:
+        {
+            return source.data[0]->select(_|i0|i1, _|j0|j1, _|k0|k1, _).copy();
+        }
+        case Source::Kind::coarse:
+        {
+            const auto& A = *source.data[0];
+            auto oi = source.octant_i * ni / 2;
+            auto oj = source.octant_j * nj / 2;
+            auto ok = source.octant_k * nk / 2;
+            auto nf = A.shape(3);
+            auto res = Array(i1 - i0, j1 - j0, k1 - k0, nf);
+
+            for (int i = i0; i < i1; ++i)
+            {
+                for (int j = j0; j < j1; ++j)
+                {
+                    patches2d::prolong_row(&A(oi + i / 2, oj + j / 2, ok + k0 / 2, 0), &res(i - i0, j - j0, 0, 0), k0, k1, nf);
+                }
+            }
+            return res;
+        }
+        case Source::Kind::fine:
+        {
+            auto nf = source.data[0]->shape(3);
+            auto res = Array(i1 - i0, j1 - j0, k1 - k0, nf);
+            auto upper = std::vector<double>(std::size_t(k1 - k0) * nf);
+
+            for (int i = i0; i < i1; ++i)
+            {
+                for (int j = j0; j < j1; ++j)
+                {
+                    for (int K = 0; K < 2; ++K)
+                    {
+                        auto b0 = std::max(k0, K * nk / 2);
+                        auto b1 = std::min(k1, K * nk / 2 + nk / 2);
+
+                        if (b0 < b1)
+                        {
+                            auto I = (2 * i) / ni;
+                            auto J = (2 * j) / nj;
+                            auto r = 2 * i - I * ni;
+                            auto s = 2 * j - J * nj;
+                            auto t = 2 * b0 - K * nk;
+                            const auto& C = *source.data[I * 4 + J * 2 + K];
+                            auto out = &res(i - i0, j - j0, b0 - k0, 0);
+                            auto count = b1 - b0;
+
+                            patches2d::restrict_row(&C(r + 0, s, t, 0), &C(r + 0, s + 1, t, 0), out, count, nf);
+                            patches2d::restrict_row(&C(r + 1, s, t, 0), &C(r + 1, s + 1, t, 0), upper.data(), count, nf);
+
+                            for (int m = 0; m < count * nf; ++m)
+                            {
+                                out[m] = (out[m] + upper[m]) * 0.5;
+                            }
+                        }
+                    }
+                }
+            }
+            return res;
+        }
+    }
+    throw;
+}
+
+std::array<patches3d::Database::Strip, 6> patches3d::Database::strips(int ngil, int ngir, int ngjl, int ngjr, int ngkl, int ngkr) const
+{
+    return {{
+        {PatchBoundary::il, ngil, ni - ngil, ni, 0, nj, 0, nk, 0, ngjl, ngkl},
+        {PatchBoundary::ir, ngir, 0, ngir, 0, nj, 0, nk, ngil + ni, ngjl, ngkl},
+        {PatchBoundary::jl, ngjl, 0, ni, nj - ngjl, nj, 0, nk, ngil, 0, ngkl},
+        {PatchBoundary::jr, ngjr, 0, ni, 0, ngjr, 0, nk, ngil, ngjl + nj, ngkl},
+        {PatchBoundary::kl, ngkl, 0, ni, 0, nj, nk - ngkl, nk, ngil, ngjl, 0},
+        {PatchBoundary::kr, ngkr, 0, ni, 0, nj, 0, ngkr, ngil, ngjl, ngkl + nk},
+    }};
+}
+
+std::shared_ptr<const patches3d::Database::FillPlan> patches3d::Database::fill_plan() const
+{
+    std::lock_guard<std::mutex> lock(plan_cache.mutex);
+    auto& plan = plan_cache.plan;
+
+    if (plan && plan->version == topology_version)
+    {
+        return plan;
+    }
+    auto new_plan = std::make_shared<FillPlan>();
+    new_plan->version = topology_version;
+
+    for (const auto& patch : patches)
+    {
+        auto& entry = new_plan->patches[patch.first];
+        entry.patch = &patch.second;
+
+        for (auto edge : {PatchBoundary::il, PatchBoundary::ir, PatchBoundary::jl, PatchBoundary::jr, PatchBoundary::kl, PatchBoundary::kr})
+        {
+            entry.edges[int(edge)] = resolve(neighbor(patch.first, edge));
+        }
+    }
+    plan = new_plan;
+    return plan;
+}
+
+std::vector<patches3d::Database::Index> patches3d::Database::indexes(Field which) const
+{
+    auto res = std::vector<Index>();
+
+    for (const auto& patch : patches)
+    {
+        if (std::get<4>(patch.first) == which)
+        {
+            res.push_back(patch.first);
+        }
+    }
+    return res;
+}
+
+void patches3d::Database::parallel_for(std::size_t count, std::function<void(std::size_t)> fn) const
+{
+    if (thread_pool)
+    {
+        thread_pool->run(count, fn);
+    }
+    else
+    {
+        for (std::size_t n = 0; n < count; ++n)
+        {
+            fn(n);
+        }
+    }
+}
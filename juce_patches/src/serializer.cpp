@@ -71,22 +71,105 @@ Database::Header FileSystemSerializer::read_header() const
         auto num = int (field.value[0]);
         auto loc = patches2d::parse_location (field.value[1].toString().toStdString());
         auto ind = patches2d::parse_field (field.name.toString().toStdString());
-        header.emplace (ind, FieldDescriptor (num, loc));
+        auto lay = field.value.size() > 2 ? patches2d::parse_layout (field.value[2].toString().toStdString()) : patches2d::Layout::aos;
+        header.emplace (ind, FieldDescriptor (num, loc, lay));
     }
     return header;
 }
 
+std::vector<Database::Index> FileSystemSerializer::read_index() const
+{
+    auto file = chkpt.getChildFile ("index.json");
+
+    if (! file.existsAsFile())
+    {
+        return Serializer::read_index();
+    }
+    auto j = JSON::parse (file);
+
+    if (! j.isArray())
+    {
+        throw std::runtime_error ("corrupt database index");
+    }
+    auto res = std::vector<Database::Index>();
+
+    for (const auto& entry : *j.getArray())
+    {
+        auto field = patches2d::parse_field (entry[3].toString().toStdString());
+        res.push_back (std::make_tuple (int (entry[0]), int (entry[1]), int (entry[2]), field));
+    }
+    return res;
+}
+
 void FileSystemSerializer::write_array (std::string path, const nd::array<double, 3>& patch) const
 {
-    throw std::logic_error ("serializer is read-only");
+    auto file = chkpt.getChildFile (path);
+    auto result = file.getParentDirectory().createDirectory();
+
+    if (result.failed())
+    {
+        throw std::runtime_error (result.getErrorMessage().toStdString());
+    }
+    if (! file.replaceWithText (patch.dumps()))
+    {
+        throw std::runtime_error ("could not write " + file.getFullPathName().toStdString());
+    }
+    written.push_back (patches2d::parse_index (path));
 }
 
 void FileSystemSerializer::write_header (Database::Header header) const
 {
-    throw std::logic_error ("serializer is read-only");
+    // A dump starts with its header, so forget the patches of earlier dumps.
+    written.clear();
+
+    auto obj = std::make_unique<DynamicObject>();
+
+    for (const auto& field : header)
+    {
+        auto desc = juce::Array<var>();
+        desc.add (field.second.num_fields);
+        desc.add (String (patches2d::to_string (field.second.location)));
+        desc.add (String (patches2d::to_string (field.second.layout)));
+        obj->setProperty (String (patches2d::to_string (field.first)), desc);
+    }
+    writeJson ("header.json", var (obj.release()));
 }
 
 void FileSystemSerializer::write_block_size (std::array<int, 2> block_size) const
 {
-    throw std::logic_error ("serializer is read-only");
+    auto obj = std::make_unique<DynamicObject>();
+    obj->setProperty ("ni", block_size[0]);
+    obj->setProperty ("nj", block_size[1]);
+    writeJson ("block_size.json", var (obj.release()));
+}
+
+void FileSystemSerializer::flush() const
+{
+    auto index = juce::Array<var>();
+
+    for (const auto& entry : written)
+    {
+        auto item = juce::Array<var>();
+        item.add (std::get<0> (entry));
+        item.add (std::get<1> (entry));
+        item.add (std::get<2> (entry));
+        item.add (String (patches2d::to_string (std::get<3> (entry))));
+        index.add (item);
+    }
+    writeJson ("index.json", index);
+    written.clear();
+}
+
+void FileSystemSerializer::writeJson (String name, var value) const
+{
+    auto result = chkpt.createDirectory();
+
+    if (result.failed())
+    {
+        throw std::runtime_error (result.getErrorMessage().toStdString());
+    }
+    if (! chkpt.getChildFile (name).replaceWithText (JSON::toString (value)))
+    {
+        throw std::runtime_error ("could not write " + name.toStdString());
+    }
 }
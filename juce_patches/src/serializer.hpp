@@ -17,10 +17,14 @@ public:
     nd::array<double, 3> read_array (std::string path) const override;
     std::array<int, 2> read_block_size() const override;
     patches2d::Database::Header read_header() const override;
+    std::vector<patches2d::Database::Index> read_index() const override;
     void write_array (std::string path, const nd::array<double, 3>& patch) const override;
     void write_header (patches2d::Database::Header header) const override;
     void write_block_size (std::array<int, 2> block_size) const override;
+    void flush() const override;
 
 private:
+    void writeJson (juce::String name, juce::var value) const;
     juce::File chkpt;
+    mutable std::vector<patches2d::Database::Index> written;
 };
@@ -1,8 +1,24 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
 #include <ostream>
+#include <sstream>
 #include <vector>
 #include <map>
 #include "patches.hpp"
 
+#if defined(__unix__) || defined(__APPLE__)
+#define PATCHES_HAVE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 using namespace patches2d;
 
 
@@ -20,25 +36,96 @@ std::string patches2d::to_string(MeshLocation location)
     }
 }
 
-std::string patches2d::to_string(Field field)
-{
-    switch (field)
+namespace {
+
+    const char* field_name(Field field)
+    {
+        switch (field)
+        {
+            case Field::cell_volume: return "cell_volume";
+            case Field::cell_coords: return "cell_coords";
+            case Field::vert_coords: return "vert_coords";
+            case Field::face_area_i: return "face_area_i";
+            case Field::face_area_j: return "face_area_j";
+            case Field::face_velocity_i: return "face_velocity_i";
+            case Field::face_velocity_j: return "face_velocity_j";
+            case Field::conserved: return "conserved";
+            case Field::primitive: return "primitive";
+            case Field::flux_i: return "flux_i";
+            case Field::flux_j: return "flux_j";
+        }
+        throw std::invalid_argument("unknown field");
+    }
+
+    // ------------------------------------------------------------------------
+    // Read an optionally signed decimal integer at first, and return the end
+    // of it, or null if there is none or it does not fit in an int.
+    // ------------------------------------------------------------------------
+    const char* parse_int(const char* first, const char* last, int& value)
+    {
+        auto negative = first != last && *first == '-';
+        auto p = first + negative;
+        auto x = std::int64_t(0);
+
+        while (p != last && *p >= '0' && *p <= '9' && x <= std::numeric_limits<int>::max())
+        {
+            x = x * 10 + (*p++ - '0');
+        }
+        if (p == first + negative || x > std::int64_t(std::numeric_limits<int>::max()) + negative)
+        {
+            return nullptr;
+        }
+        value = int(negative ? -x : x);
+        return p;
+    }
+
+    char* format_int(int value, char* first, char* last)
+    {
+        char digits[12];
+        auto n = 0;
+        auto x = value < 0 ? -std::int64_t(value) : std::int64_t(value);
+
+        do
+        {
+            digits[n++] = char('0' + x % 10);
+            x /= 10;
+        } while (x);
+
+        if (last - first < n + (value < 0))
+        {
+            throw std::invalid_argument("format_index: the buffer is too short");
+        }
+        if (value < 0)
+        {
+            *first++ = '-';
+        }
+        while (n)
+        {
+            *first++ = digits[--n];
+        }
+        return first;
+    }
+
+    char* format_char(char c, char* first, char* last)
     {
-        case Field::cell_volume: return "cell_volume";
-        case Field::cell_coords: return "cell_coords";
-        case Field::vert_coords: return "vert_coords";
-        case Field::face_area_i: return "face_area_i";
-        case Field::face_area_j: return "face_area_j";
-        case Field::face_velocity_i: return "face_velocity_i";
-        case Field::face_velocity_j: return "face_velocity_j";
-        case Field::conserved: return "conserved";
-        case Field::primitive: return "primitive";
+        if (first == last)
+        {
+            throw std::invalid_argument("format_index: the buffer is too short");
+        }
+        *first = c;
+        return first + 1;
     }
 }
 
+std::string patches2d::to_string(Field field)
+{
+    return field_name(field);
+}
+
 std::string patches2d::to_string(Database::Index index)
 {
-    return to_string(index, to_string(std::get<3>(index)));
+    char buffer[64];
+    return std::string(buffer, format_index(index, buffer, buffer + 64));
 }
 
 std::string patches2d::to_string(Database::Index index, std::string field_name)
@@ -60,421 +147,5704 @@ MeshLocation patches2d::parse_location(std::string str)
 
 Field patches2d::parse_field(std::string str)
 {
-    if (str == "cell_volume") return Field::cell_volume;
-    if (str == "cell_coords") return Field::cell_coords;
-    if (str == "vert_coords") return Field::vert_coords;
-    if (str == "face_area_i") return Field::face_area_i;
-    if (str == "face_area_j") return Field::face_area_j;
-    if (str == "face_velocity_i") return Field::face_velocity_i;
-    if (str == "face_velocity_j") return Field::face_velocity_j;
-    if (str == "conserved")   return Field::conserved;
-    if (str == "primitive")   return Field::primitive;
-    throw std::invalid_argument("unknown field: " + str);
+    return parse_field(str.data(), str.data() + str.size());
 }
 
 Database::Index patches2d::parse_index(std::string str)
 {
-    auto dot   = str.find('.');
-    auto dash  = str.find('-');
-    auto slash = str.find('/');
-    int level  = std::stoi(str.substr(0, dot));
-    int i      = std::stoi(str.substr(dot  + 1, dash));
-    int j      = std::stoi(str.substr(dash + 1, slash));
-    auto field = parse_field(str.substr(slash + 1));
-    return std::make_tuple(i, j, level, field);
+    return parse_index(str.data(), str.data() + str.size());
 }
 
-
-
-
-// ============================================================================
-FieldDescriptor::FieldDescriptor(int num_fields, MeshLocation location)
-: num_fields(num_fields)
-, location(location)
+Field patches2d::parse_field(const char* first, const char* last)
 {
-}
-
-
-
+    for (int n = 0; n <= int(Field::flux_j); ++n)
+    {
+        auto name = field_name(Field(n));
+        auto size = std::strlen(name);
 
-// ============================================================================
-Database::Database(int ni, int nj, Header header)
-: ni(ni)
-, nj(nj)
-, header(header)
-{
+        if (std::size_t(last - first) == size && std::memcmp(first, name, size) == 0)
+        {
+            return Field(n);
+        }
+    }
+    throw std::invalid_argument("unknown field: " + std::string(first, last));
 }
 
-void Database::set_boundary_value(BoundaryValue b)
+Database::Index patches2d::parse_index(const char* first, const char* last)
 {
-    boundary_value = b;
+    auto skip = [first, last] (const char* p, char c)
+    {
+        if (p == nullptr || p == last || *p != c)
+        {
+            throw std::invalid_argument("malformed index: " + std::string(first, last));
+        }
+        return p + 1;
+    };
+    auto level = 0;
+    auto i = 0;
+    auto j = 0;
+    auto p = parse_int(first, last, level);
+    p = parse_int(skip(p, '.'), last, i);
+    p = parse_int(skip(p, '-'), last, j);
+    return std::make_tuple(i, j, level, parse_field(skip(p, '/'), last));
 }
 
-void Database::insert(Index index, Array data)
+char* patches2d::format_index(Database::Index index, char* first, char* last)
 {
-    patches[index].become(check_shape(data, index).copy());
-}
+    auto name = field_name(std::get<3>(index));
+    auto size = std::strlen(name);
 
-auto Database::erase(Index index)
-{
-    return patches.erase(index);
+    first = format_int(std::get<2>(index), first, last);
+    first = format_char('.', first, last);
+    first = format_int(std::get<0>(index), first, last);
+    first = format_char('-', first, last);
+    first = format_int(std::get<1>(index), first, last);
+    first = format_char('/', first, last);
+
+    if (std::size_t(last - first) < size)
+    {
+        throw std::invalid_argument("format_index: the buffer is too short");
+    }
+    return std::copy(name, name + size, first);
 }
 
-void Database::clear()
+std::string patches2d::to_string(KernelIsa isa)
 {
-    patches.clear();
+    switch (isa)
+    {
+        case KernelIsa::scalar: return "scalar";
+        case KernelIsa::avx2: return "avx2";
+        case KernelIsa::avx512: return "avx512";
+        case KernelIsa::neon: return "neon";
+    }
+    throw std::invalid_argument("unknown kernel isa");
 }
 
-void Database::commit(Index index, Array data, double rk_factor)
+std::string patches2d::to_string(Compression compression)
 {
-    auto target = patches.at(index);
-
-    if (rk_factor == 0.0)
+    switch (compression)
     {
-        target = data;
+        case Compression::none: return "none";
+        case Compression::lossless: return "lossless";
+        case Compression::lossy: return "lossy";
     }
-    else
+    throw std::invalid_argument("unknown compression");
+}
+
+std::string patches2d::to_string(Layout layout)
+{
+    switch (layout)
     {
-        target = data * (1 - rk_factor) + target * rk_factor;
+        case Layout::aos: return "aos";
+        case Layout::soa: return "soa";
     }
+    throw std::invalid_argument("unknown layout");
 }
 
-Database::Array Database::fetch(Index index, int guard) const
+Layout patches2d::parse_layout(std::string str)
 {
-    return fetch(index, guard, guard, guard, guard);
+    if (str == "aos") return Layout::aos;
+    if (str == "soa") return Layout::soa;
+    throw std::invalid_argument("unknown layout: " + str);
 }
 
-Database::Array Database::fetch(Index index, int ngil, int ngir, int ngjl, int ngjr) const
+std::string patches2d::to_string(Operation operation)
 {
-    if (location(index) != MeshLocation::cell)
+    switch (operation)
     {
-        throw std::invalid_argument("can only fetch cell data (for now)");
+        case Operation::fetch: return "fetch";
+        case Operation::same_level: return "same_level";
+        case Operation::prolongation: return "prolongation";
+        case Operation::restriction: return "restriction";
+        case Operation::boundary_value: return "boundary_value";
+        case Operation::commit: return "commit";
+        case Operation::insert: return "insert";
+        case Operation::serializer_read: return "serializer_read";
+        case Operation::serializer_write: return "serializer_write";
     }
+    throw std::invalid_argument("unknown operation");
+}
 
-    auto _     = nd::axis::all();
-    auto mi    = ni + ngil + ngir;
-    auto mj    = nj + ngjl + ngjr;
-    auto shape = std::array<int, 3>{mi, mj, num_fields(index)};
-    auto res   = nd::array<double, 3>(shape);
 
-    auto i = std::get<0>(index);
-    auto j = std::get<1>(index);
-    auto p = std::get<2>(index);
-    auto f = std::get<3>(index);
-    auto Ri = std::make_tuple(i + 1, j, p, f);
-    auto Li = std::make_tuple(i - 1, j, p, f);
-    auto Rj = std::make_tuple(i, j + 1, p, f);
-    auto Lj = std::make_tuple(i, j - 1, p, f);
 
-    res.select(_|ngil|ni+ngil, _|ngjl|nj+ngjl, _) = patches.at(index);
 
-    // i-left boundary
-    // ========================================================================
-    if (ngil > 0)
-    {
-        auto neighbor = locate(Li);
-        auto bv = neighbor.empty()
-        ? boundary_value(index, PatchBoundary::il, ngil, patches.at(index))
-        : neighbor.select(_|ni-ngil|ni, _, _);
-        res.select(_|0|ngil, _|ngjl|nj+ngjl, _) = bv;
-    }
+// ============================================================================
+// Instrumentation. The counters are a fixed table of atomics, indexed by
+// operation, field, and level, so that counting an operation takes no lock.
+// A profile scope times one operation and adds it to the table when it
+// ends. The scopes on each thread form a stack, so that an allocation is
+// counted against the innermost one. Without PATCHES_PROFILE none of this is
+// compiled: the scopes are empty, and there are no counters or events.
+// ============================================================================
+namespace {
+
+#ifdef PATCHES_PROFILE
+    const int num_profile_operations = int(Operation::serializer_write) + 1;
+    const int num_profile_fields = int(Field::flux_j) + 1;
+    const int num_profile_levels = 32;
 
-    // i-right boundary
-    // ========================================================================
-    if (ngir > 0)
+    struct ProfileSlot
     {
-        auto neighbor = locate(Ri);
-        auto bv = neighbor.empty()
-        ? boundary_value(index, PatchBoundary::ir, ngir, patches.at(index))
-        : neighbor.select(_|0|ngir, _, _);
-        res.select(_|mi-ngir|mi, _|ngjl|nj+ngjl, _) = bv;
-    }
+        std::atomic<std::uint64_t> calls;
+        std::atomic<std::uint64_t> bytes;
+        std::atomic<std::uint64_t> allocations;
+        std::atomic<std::uint64_t> nanoseconds;
+    };
 
-    // j-left boundary
-    // ========================================================================
-    if (ngjl > 0)
+    struct ProfileTrace
     {
-        auto neighbor = locate(Lj);
-        auto bv = neighbor.empty()
-        ? boundary_value(index, PatchBoundary::jl, ngjl, patches.at(index))
-        : neighbor.select(_, _|nj-ngjl|nj, _);
-        res.select(_|ngil|ni+ngil, _|0|ngjl, _) = bv;
-    }
+        std::mutex mutex;
+        std::vector<ProfileEvent> events;
+        std::size_t max_events = 0;
+        std::atomic<bool> enabled{false};
+    };
 
-    // j-right boundary
-    // ========================================================================
-    if (ngjr > 0)
+    std::int64_t profile_clock()
     {
-        auto neighbor = locate(Rj);
-        auto bv = neighbor.empty()
-        ? boundary_value(index, PatchBoundary::jr, ngjr, patches.at(index))
-        : neighbor.select(_, _|0|ngjr, _);
-        res.select(_|ngil|ni+ngil, _|mj-ngjr|mj, _) = bv;
+        auto now = std::chrono::steady_clock::now().time_since_epoch();
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(now).count();
     }
 
-    return res;
-}
-
-Database::Array Database::assemble(int i0, int i1, int j0, int j1, int level, Field field) const
-{
-    auto _ = nd::axis::all();
-    int mi = 0, mj = 0;
+    ProfileSlot profile_table[num_profile_operations][num_profile_fields][num_profile_levels];
+    ProfileTrace profile_trace;
+    std::atomic<std::int64_t> profile_epoch{profile_clock()};
+    std::atomic<int> profile_threads{0};
 
-    switch (header.at(field).location)
+    class ProfileScope
     {
-        case MeshLocation::cell  : mi = (i1 - i0) * ni + 0; mj = (j1 - j0) * nj + 0; break;
-        case MeshLocation::vert  : mi = (i1 - i0) * ni + 1; mj = (j1 - j0) * nj + 1; break;
-        case MeshLocation::face_i: mi = (i1 - i0) * ni + 1; mj = (j1 - j0) * nj + 0; break;
-        case MeshLocation::face_j: mi = (i1 - i0) * ni + 0; mj = (j1 - j0) * nj + 1; break;
-    }
+    public:
+        ProfileScope(Operation operation, Database::Index index, std::size_t bytes)
+        : operation(operation)
+        , level(std::get<2>(index))
+        , field(std::get<3>(index))
+        , bytes(bytes)
+        , parent(current)
+        , start(profile_clock())
+        {
+            current = this;
+        }
 
-    auto res = Array(mi, mj, header.at(field).num_fields);
+        ProfileScope(const ProfileScope&) = delete;
+        ProfileScope& operator=(const ProfileScope&) = delete;
 
-    for (int i = i0; i < i1; ++i)
-    {
-        for (int j = j0; j < j1; ++j)
+        ~ProfileScope()
         {
-            int di = 0, dj = 0;
+            auto duration = std::uint64_t(profile_clock() - start);
+            auto row = std::min(std::max(level, 0), num_profile_levels - 1);
+            auto& slot = profile_table[int(operation)][int(field)][row];
 
-            switch (header.at(field).location)
+            slot.calls.fetch_add(1, std::memory_order_relaxed);
+            slot.bytes.fetch_add(bytes, std::memory_order_relaxed);
+            slot.allocations.fetch_add(allocations, std::memory_order_relaxed);
+            slot.nanoseconds.fetch_add(duration, std::memory_order_relaxed);
+            current = parent;
+
+            if (profile_trace.enabled.load(std::memory_order_relaxed))
             {
-                case MeshLocation::cell  : di = (i == i1 - 1) * 0; dj = (j == j1 - 1) * 0; break;
-                case MeshLocation::vert  : di = (i == i1 - 1) * 1; dj = (j == j1 - 1) * 1; break;
-                case MeshLocation::face_i: di = (i == i1 - 1) * 1; dj = (j == j1 - 1) * 0; break;
-                case MeshLocation::face_j: di = (i == i1 - 1) * 0; dj = (j == j1 - 1) * 1; break;
-            }
+                thread_local int thread = profile_threads++;
+                auto event = ProfileEvent{operation, level, field, thread, std::uint64_t(std::max(start - profile_epoch.load(), std::int64_t(0))), duration, bytes};
+                std::lock_guard<std::mutex> lock(profile_trace.mutex);
 
-            const auto& patch = patches.at(std::make_tuple(i, j, level, field));
-            res.select(_|i*ni|(i+1)*ni+di, _|j*nj|(j+1)*nj+dj, _) = patch.select(_|0|ni+di, _|0|nj+dj, _);
+                if (profile_trace.events.size() < profile_trace.max_events)
+                {
+                    profile_trace.events.push_back(event);
+                }
+            }
         }
-    }
-    return res;
-}
 
-const Database::Array& Database::at(Index index) const
-{
-    return patches.at(index);
-}
+        static void count_allocation()
+        {
+            if (current)
+            {
+                ++current->allocations;
+            }
+        }
 
-const Database::Array& Database::at(Index index, Field which) const
-{
-    std::get<3>(index) = which;
-    return patches.at(index);
-}
+    private:
+        static thread_local ProfileScope* current;
+        Operation operation;
+        int level;
+        Field field;
+        std::uint64_t bytes;
+        std::uint64_t allocations = 0;
+        ProfileScope* parent;
+        std::int64_t start;
+    };
 
-std::map<Database::Index, Database::Array> Database::all(Field which) const
-{
-    auto res = std::map<Index, Array>();
+    thread_local ProfileScope* ProfileScope::current = nullptr;
 
-    for (const auto& patch : patches)
+    std::size_t region_bytes(int mi, int mj, int nf)
     {
-        if (std::get<3>(patch.first) == which)
-        {
-            res.insert(patch);
-        }
+        return std::size_t(mi) * std::size_t(mj) * std::size_t(nf) * sizeof(double);
     }
-    return res;
-}
 
-std::size_t Database::count(Field which) const
-{
-    std::size_t n = 0;
-
-    for (const auto& patch : patches)
+    std::size_t shape_bytes(std::array<int, 3> shape)
     {
-        if (std::get<3>(patch.first) == which)
-        {
-            ++n;
-        }
+        return region_bytes(shape[0], shape[1], shape[2]);
     }
-    return n;
-}
-
-std::size_t Database::num_cells(Field which) const
-{
-    return count(which) * ni * nj;
-}
+#endif
 
-void Database::print(std::ostream& os) const
-{
-    os << std::string(52, '=') << "\n";
-    os << "Database:\n\n";
-    os << "block size: " << ni << " " << nj << "\n";
-    os << "mesh patches:\n\n";
-
-    for (const auto& patch : patches)
+    std::string format_seconds(std::uint64_t nanoseconds, double scale)
     {
-        os << "\t" << to_string(patch.first) << "\n";
+        auto stream = std::ostringstream();
+        stream.precision(12);
+        stream << double(nanoseconds) * scale;
+        return stream.str();
     }
-    os << "\n";
 }
 
-void Database::dump(const Serializer& ser) const
-{
-    ser.write_header(header);
-    ser.write_block_size({ni, nj});
+#ifdef PATCHES_PROFILE
+#define PATCHES_PROFILE_SCOPE(operation, index, bytes) ProfileScope profile_scope(operation, index, bytes)
+#define PATCHES_PROFILE_ALLOCATION() ProfileScope::count_allocation()
+#else
+#define PATCHES_PROFILE_SCOPE(operation, index, bytes)
+#define PATCHES_PROFILE_ALLOCATION()
+#endif
 
-    for (const auto& patch : patches)
-    {
-        ser.write_array(to_string(patch.first), patch.second);
-    }
+bool patches2d::profiling_enabled()
+{
+#ifdef PATCHES_PROFILE
+    return true;
+#else
+    return false;
+#endif
 }
 
-Database Database::load(const Serializer& ser, std::set<Field> fields, std::function<bool()> bailout)
+#ifdef PATCHES_PROFILE
+std::vector<ProfileCounter> patches2d::profile_counters()
 {
-    auto header = ser.read_header();
-    auto blocks = ser.read_block_size();
-    auto database = Database(blocks[0], blocks[1], header);
+    auto res = std::vector<ProfileCounter>();
 
-    for (auto patch : ser.list_patches())
+    for (int op = 0; op < num_profile_operations; ++op)
     {
-        for (auto field : ser.list_fields(patch))
+        for (int f = 0; f < num_profile_fields; ++f)
         {
-            if (fields.empty() || fields.count(parse_field (field)))
+            for (int level = 0; level < num_profile_levels; ++level)
             {
-                auto ind = patch + "/" + field;
-                database.insert(parse_index(ind), ser.read_array(ind));
+                const auto& slot = profile_table[op][f][level];
+                auto calls = slot.calls.load();
 
-                if (bailout && bailout())
+                if (calls)
                 {
-                    return database;
+                    res.push_back({Operation(op), level, Field(f), calls, slot.bytes.load(), slot.allocations.load(), slot.nanoseconds.load()});
                 }
             }
         }
     }
-    return database;
+    return res;
 }
 
-
-
-
-// ========================================================================
-int Database::num_fields(Index index) const
+void patches2d::reset_profile()
 {
-    return header.at(std::get<3>(index)).num_fields;
+    for (auto& op : profile_table)
+    {
+        for (auto& field : op)
+        {
+            for (auto& slot : field)
+            {
+                slot.calls = 0;
+                slot.bytes = 0;
+                slot.allocations = 0;
+                slot.nanoseconds = 0;
+            }
+        }
+    }
+    std::lock_guard<std::mutex> lock(profile_trace.mutex);
+    profile_trace.events.clear();
+    profile_epoch = profile_clock();
 }
 
-MeshLocation Database::location(Index index) const
+void patches2d::set_profile_tracing(bool enabled, std::size_t max_events)
 {
-    return header.at(std::get<3>(index)).location;
+    std::lock_guard<std::mutex> lock(profile_trace.mutex);
+    profile_trace.max_events = max_events;
+    profile_trace.enabled = enabled;
 }
 
-Database::Array Database::check_shape(Array& array, Index index) const
+std::vector<ProfileEvent> patches2d::profile_events()
 {
-    if (array.shape() != expected_shape(index))
-    {
-        throw std::invalid_argument("input patch data has the wrong shape");
-    }
-    return array;
+    std::lock_guard<std::mutex> lock(profile_trace.mutex);
+    return profile_trace.events;
 }
-
-Database::Index Database::coarsen(Index index) const
+#else
+std::vector<ProfileCounter> patches2d::profile_counters()
 {
-    std::get<0>(index) /= 2;
-    std::get<1>(index) /= 2;
-    std::get<2>(index) -= 1;
-    return index;
+    return {};
 }
 
-std::array<Database::Index, 4> Database::refine(Index index) const
+void patches2d::reset_profile()
 {
-    auto i = std::get<0>(index);
-    auto j = std::get<1>(index);
-    auto p = std::get<2>(index);
-    auto f = std::get<3>(index);
+}
 
-    return {
-        std::make_tuple(i * 2 + 0, j * 2 + 0, p + 1, f),
-        std::make_tuple(i * 2 + 0, j * 2 + 1, p + 1, f),
-        std::make_tuple(i * 2 + 1, j * 2 + 0, p + 1, f),
-        std::make_tuple(i * 2 + 1, j * 2 + 1, p + 1, f),
-    };
+void patches2d::set_profile_tracing(bool /*enabled*/, std::size_t /*max_events*/)
+{
 }
 
-std::array<int, 3> Database::expected_shape(Index index) const
+std::vector<ProfileEvent> patches2d::profile_events()
 {
-    switch (location(index))
-    {
-        case MeshLocation::cell: return {ni + 0, nj + 0, num_fields(index)};
-        case MeshLocation::vert: return {ni + 1, nj + 1, num_fields(index)};
-        case MeshLocation::face_i: return {ni + 1, nj + 0, num_fields(index)};
-        case MeshLocation::face_j: return {ni + 0, nj + 1, num_fields(index)};
-    }
-    throw;
+    return {};
 }
+#endif
 
-nd::array<double, 3> Database::locate(Index index) const
+std::string patches2d::profile_to_json(const std::vector<ProfileCounter>& counters)
 {
-    if (patches.count(index))
-    {
-        return patches.at(index);
-    }
+    auto stream = std::ostringstream();
+    stream << "[";
 
-    if (patches.count(coarsen(index)))
+    for (std::size_t n = 0; n < counters.size(); ++n)
     {
-        auto i = std::get<0>(index);
-        auto j = std::get<1>(index);
-        return prolongation(quadrant(patches.at(coarsen(index)), i % 2, j % 2));
+        const auto& c = counters[n];
+        stream << (n ? ",\n" : "\n")
+        << "  {\"operation\": \"" << to_string(c.operation)
+        << "\", \"level\": " << c.level
+        << ", \"field\": \"" << to_string(c.field)
+        << "\", \"calls\": " << c.calls
+        << ", \"bytes\": " << c.bytes
+        << ", \"allocations\": " << c.allocations
+        << ", \"seconds\": " << format_seconds(c.nanoseconds, 1e-9) << "}";
     }
+    stream << "\n]\n";
+    return stream.str();
+}
 
-    if (contains_all(refine(index)))
+std::string patches2d::profile_to_chrome_trace(const std::vector<ProfileEvent>& events)
+{
+    auto stream = std::ostringstream();
+    stream << "{\"traceEvents\": [";
+
+    for (std::size_t n = 0; n < events.size(); ++n)
     {
-        return restriction(tile(refine(index)));
+        const auto& e = events[n];
+        stream << (n ? ",\n" : "\n")
+        << "  {\"name\": \"" << to_string(e.operation)
+        << "\", \"cat\": \"" << to_string(e.field)
+        << "\", \"ph\": \"X\", \"pid\": 0, \"tid\": " << e.thread
+        << ", \"ts\": " << format_seconds(e.start, 1e-3)
+        << ", \"dur\": " << format_seconds(e.duration, 1e-3)
+        << ", \"args\": {\"level\": " << e.level << ", \"bytes\": " << e.bytes << "}}";
     }
-
-    return nd::array<double, 3>();
+    stream << "\n], \"displayTimeUnit\": \"ns\"}\n";
+    return stream.str();
 }
 
-nd::array<double, 3> Database::quadrant(const nd::array<double, 3>& A, int I, int J) const
-{
-    auto _ = nd::axis::all();
 
-    if (I == 0 && J == 0) return A.select(_|0 |ni/2, _|0 |nj/2, _);
-    if (I == 0 && J == 1) return A.select(_|0 |ni/2, _|nj/2|nj, _);
-    if (I == 1 && J == 0) return A.select(_|ni/2|ni, _|0 |nj/2, _);
-    if (I == 1 && J == 1) return A.select(_|ni/2|ni, _|nj/2|nj, _);
 
-    throw std::invalid_argument("quadrant: I and J must be 0 or 1");
-}
+
+// ============================================================================
+// Row kernels for 2x prolongation (injection) and 2x2 restriction (averaging)
+// of cell data stored as [ni, nj, num_fields]. A row is contiguous in memory,
+// with the field index innermost.
+//
+// prolong_row: writes the fine cells [j0, j1) of a row, where fine cell j
+// takes the value of coarse cell j / 2, and coarse points at coarse cell
+// j0 / 2.
+//
+// restrict_row: writes count coarse cells, each of which is the average of
+// the 2x2 fine cells in rows r0 and r1 beneath it. The sum is accumulated in
+// the same order as Database::restriction, so the results are bit-identical.
+//
+// The vectorized kernels handle the common numbers of fields and fall back
+// to the scalar kernels otherwise.
+// ============================================================================
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PATCHES_KERNELS_X86
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#define PATCHES_KERNELS_NEON
+#include <arm_neon.h>
+#endif
+
+namespace {
+
+    using ProlongRow = void (*)(const double* coarse, double* fine, int j0, int j1, int nf);
+    using RestrictRow = void (*)(const double* r0, const double* r1, double* out, int count, int nf);
+
+    struct Kernels
+    {
+        KernelIsa isa;
+        ProlongRow prolong_row;
+        RestrictRow restrict_row;
+    };
+
+    void prolong_row_scalar(const double* coarse, double* fine, int j0, int j1, int nf)
+    {
+        for (int j = j0; j < j1; ++j)
+        {
+            auto c = coarse + (j / 2 - j0 / 2) * nf;
+            auto f = fine + (j - j0) * nf;
+
+            for (int k = 0; k < nf; ++k)
+            {
+                f[k] = c[k];
+            }
+        }
+    }
+
+    void restrict_row_scalar(const double* r0, const double* r1, double* out, int count, int nf)
+    {
+        for (int b = 0; b < count; ++b)
+        {
+            for (int k = 0; k < nf; ++k)
+            {
+                auto m = 2 * b * nf + k;
+                out[b * nf + k] = (r0[m] + r0[m + nf] + r1[m] + r1[m + nf]) * 0.25;
+            }
+        }
+    }
+
+#ifdef PATCHES_KERNELS_X86
+    __attribute__((target("avx2")))
+    void prolong_row_avx2(const double* coarse, double* fine, int j0, int j1, int nf)
+    {
+        if (nf == 1)
+        {
+            int j = j0;
+
+            if (j % 2 == 1 && j < j1)
+            {
+                *fine++ = *coarse++;
+                ++j;
+            }
+            for (; j + 4 <= j1; j += 4, coarse += 2, fine += 4)
+            {
+                auto c = _mm256_castpd128_pd256(_mm_loadu_pd(coarse));
+                _mm256_storeu_pd(fine, _mm256_permute4x64_pd(c, 0x50));
+            }
+            prolong_row_scalar(coarse, fine, j, j1, 1);
+        }
+        else if (nf % 4 == 0)
+        {
+            for (int j = j0; j < j1; ++j)
+            {
+                auto c = coarse + (j / 2 - j0 / 2) * nf;
+                auto f = fine + (j - j0) * nf;
+
+                for (int k = 0; k < nf; k += 4)
+                {
+                    _mm256_storeu_pd(f + k, _mm256_loadu_pd(c + k));
+                }
+            }
+        }
+        else
+        {
+            prolong_row_scalar(coarse, fine, j0, j1, nf);
+        }
+    }
+
+    __attribute__((target("avx2")))
+    void restrict_row_avx2(const double* r0, const double* r1, double* out, int count, int nf)
+    {
+        auto quarter = _mm256_set1_pd(0.25);
+
+        if (nf == 1)
+        {
+            int b = 0;
+
+            for (; b + 4 <= count; b += 4)
+            {
+                // Even and odd cells are separated with unpack, which leaves
+                // the sums in the order [0, 2, 1, 3]; the final permute puts
+                // them back in order.
+                auto x0 = _mm256_loadu_pd(r0 + 2 * b);
+                auto y0 = _mm256_loadu_pd(r0 + 2 * b + 4);
+                auto x1 = _mm256_loadu_pd(r1 + 2 * b);
+                auto y1 = _mm256_loadu_pd(r1 + 2 * b + 4);
+                auto s = _mm256_add_pd(_mm256_unpacklo_pd(x0, y0), _mm256_unpackhi_pd(x0, y0));
+                s = _mm256_add_pd(s, _mm256_unpacklo_pd(x1, y1));
+                s = _mm256_add_pd(s, _mm256_unpackhi_pd(x1, y1));
+                _mm256_storeu_pd(out + b, _mm256_permute4x64_pd(_mm256_mul_pd(s, quarter), 0xD8));
+            }
+            restrict_row_scalar(r0 + 2 * b, r1 + 2 * b, out + b, count - b, 1);
+        }
+        else if (nf % 4 == 0)
+        {
+            for (int b = 0; b < count; ++b)
+            {
+                for (int k = 0; k < nf; k += 4)
+                {
+                    auto m = 2 * b * nf + k;
+                    auto s = _mm256_add_pd(_mm256_loadu_pd(r0 + m), _mm256_loadu_pd(r0 + m + nf));
+                    s = _mm256_add_pd(s, _mm256_loadu_pd(r1 + m));
+                    s = _mm256_add_pd(s, _mm256_loadu_pd(r1 + m + nf));
+                    _mm256_storeu_pd(out + b * nf + k, _mm256_mul_pd(s, quarter));
+                }
+            }
+        }
+        else
+        {
+            restrict_row_scalar(r0, r1, out, count, nf);
+        }
+    }
+
+    __attribute__((target("avx512f")))
+    void prolong_row_avx512(const double* coarse, double* fine, int j0, int j1, int nf)
+    {
+        if (nf % 8 == 0)
+        {
+            for (int j = j0; j < j1; ++j)
+            {
+                auto c = coarse + (j / 2 - j0 / 2) * nf;
+                auto f = fine + (j - j0) * nf;
+
+                for (int k = 0; k < nf; k += 8)
+                {
+                    _mm512_storeu_pd(f + k, _mm512_loadu_pd(c + k));
+                }
+            }
+        }
+        else
+        {
+            prolong_row_avx2(coarse, fine, j0, j1, nf);
+        }
+    }
+
+    __attribute__((target("avx512f")))
+    void restrict_row_avx512(const double* r0, const double* r1, double* out, int count, int nf)
+    {
+        auto quarter = _mm512_set1_pd(0.25);
+
+        if (nf == 1)
+        {
+            auto even = _mm512_set_epi64(14, 12, 10, 8, 6, 4, 2, 0);
+            auto odd  = _mm512_set_epi64(15, 13, 11, 9, 7, 5, 3, 1);
+            int b = 0;
+
+            for (; b + 8 <= count; b += 8)
+            {
+                auto x0 = _mm512_loadu_pd(r0 + 2 * b);
+                auto y0 = _mm512_loadu_pd(r0 + 2 * b + 8);
+                auto x1 = _mm512_loadu_pd(r1 + 2 * b);
+                auto y1 = _mm512_loadu_pd(r1 + 2 * b + 8);
+                auto s = _mm512_add_pd(_mm512_permutex2var_pd(x0, even, y0), _mm512_permutex2var_pd(x0, odd, y0));
+                s = _mm512_add_pd(s, _mm512_permutex2var_pd(x1, even, y1));
+                s = _mm512_add_pd(s, _mm512_permutex2var_pd(x1, odd, y1));
+                _mm512_storeu_pd(out + b, _mm512_mul_pd(s, quarter));
+            }
+            restrict_row_avx2(r0 + 2 * b, r1 + 2 * b, out + b, count - b, 1);
+        }
+        else if (nf % 8 == 0)
+        {
+            for (int b = 0; b < count; ++b)
+            {
+                for (int k = 0; k < nf; k += 8)
+                {
+                    auto m = 2 * b * nf + k;
+                    auto s = _mm512_add_pd(_mm512_loadu_pd(r0 + m), _mm512_loadu_pd(r0 + m + nf));
+                    s = _mm512_add_pd(s, _mm512_loadu_pd(r1 + m));
+                    s = _mm512_add_pd(s, _mm512_loadu_pd(r1 + m + nf));
+                    _mm512_storeu_pd(out + b * nf + k, _mm512_mul_pd(s, quarter));
+                }
+            }
+        }
+        else
+        {
+            restrict_row_avx2(r0, r1, out, count, nf);
+        }
+    }
+#endif
+
+#ifdef PATCHES_KERNELS_NEON
+    void prolong_row_neon(const double* coarse, double* fine, int j0, int j1, int nf)
+    {
+        if (nf == 1)
+        {
+            int j = j0;
+
+            if (j % 2 == 1 && j < j1)
+            {
+                *fine++ = *coarse++;
+                ++j;
+            }
+            for (; j + 4 <= j1; j += 4, coarse += 2, fine += 4)
+            {
+                auto c = vld1q_f64(coarse);
+                vst1q_f64(fine + 0, vzip1q_f64(c, c));
+                vst1q_f64(fine + 2, vzip2q_f64(c, c));
+            }
+            prolong_row_scalar(coarse, fine, j, j1, 1);
+        }
+        else if (nf % 2 == 0)
+        {
+            for (int j = j0; j < j1; ++j)
+            {
+                auto c = coarse + (j / 2 - j0 / 2) * nf;
+                auto f = fine + (j - j0) * nf;
+
+                for (int k = 0; k < nf; k += 2)
+                {
+                    vst1q_f64(f + k, vld1q_f64(c + k));
+                }
+            }
+        }
+        else
+        {
+            prolong_row_scalar(coarse, fine, j0, j1, nf);
+        }
+    }
+
+    void restrict_row_neon(const double* r0, const double* r1, double* out, int count, int nf)
+    {
+        if (nf == 1)
+        {
+            int b = 0;
+
+            for (; b + 2 <= count; b += 2)
+            {
+                auto x0 = vld2q_f64(r0 + 2 * b);
+                auto x1 = vld2q_f64(r1 + 2 * b);
+                auto s = vaddq_f64(x0.val[0], x0.val[1]);
+                s = vaddq_f64(s, x1.val[0]);
+                s = vaddq_f64(s, x1.val[1]);
+                vst1q_f64(out + b, vmulq_n_f64(s, 0.25));
+            }
+            restrict_row_scalar(r0 + 2 * b, r1 + 2 * b, out + b, count - b, 1);
+        }
+        else if (nf % 2 == 0)
+        {
+            for (int b = 0; b < count; ++b)
+            {
+                for (int k = 0; k < nf; k += 2)
+                {
+                    auto m = 2 * b * nf + k;
+                    auto s = vaddq_f64(vld1q_f64(r0 + m), vld1q_f64(r0 + m + nf));
+                    s = vaddq_f64(s, vld1q_f64(r1 + m));
+                    s = vaddq_f64(s, vld1q_f64(r1 + m + nf));
+                    vst1q_f64(out + b * nf + k, vmulq_n_f64(s, 0.25));
+                }
+            }
+        }
+        else
+        {
+            restrict_row_scalar(r0, r1, out, count, nf);
+        }
+    }
+#endif
+
+    bool supports(KernelIsa isa)
+    {
+        switch (isa)
+        {
+            case KernelIsa::scalar: return true;
+#ifdef PATCHES_KERNELS_X86
+            case KernelIsa::avx2: return __builtin_cpu_supports("avx2");
+            case KernelIsa::avx512: return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx2");
+#endif
+#ifdef PATCHES_KERNELS_NEON
+            case KernelIsa::neon: return true;
+#endif
+            default: return false;
+        }
+    }
+
+    Kernels make_kernels(KernelIsa isa)
+    {
+        switch (isa)
+        {
+#ifdef PATCHES_KERNELS_X86
+            case KernelIsa::avx2: return {isa, prolong_row_avx2, restrict_row_avx2};
+            case KernelIsa::avx512: return {isa, prolong_row_avx512, restrict_row_avx512};
+#endif
+#ifdef PATCHES_KERNELS_NEON
+            case KernelIsa::neon: return {isa, prolong_row_neon, restrict_row_neon};
+#endif
+            default: return {KernelIsa::scalar, prolong_row_scalar, restrict_row_scalar};
+        }
+    }
+
+    Kernels best_kernels()
+    {
+        for (auto isa : {KernelIsa::avx512, KernelIsa::avx2, KernelIsa::neon})
+        {
+            if (supports(isa))
+            {
+                return make_kernels(isa);
+            }
+        }
+        return make_kernels(KernelIsa::scalar);
+    }
+
+    Kernels kernels = best_kernels();
+}
+
+// ============================================================================
+// Slope limiters for the linear prolongation schemes. Each receives the left
+// and right differences of a coarse cell, and returns the limited slope.
+// ============================================================================
+namespace {
+
+    struct Minmod
+    {
+        static double slope(double l, double r)
+        {
+            if (l * r <= 0.0) return 0.0;
+            return std::fabs(l) < std::fabs(r) ? l : r;
+        }
+    };
+
+    struct MonotonizedCentral
+    {
+        static double slope(double l, double r)
+        {
+            if (l * r <= 0.0) return 0.0;
+            auto c = 0.5 * (l + r);
+            auto m = std::min(std::min(2 * std::fabs(l), 2 * std::fabs(r)), std::fabs(c));
+            return c > 0.0 ? m : -m;
+        }
+    };
+}
+
+
+
+
+// ============================================================================
+KernelIsa patches2d::kernel_isa()
+{
+    return kernels.isa;
+}
+
+void patches2d::set_kernel_isa(KernelIsa isa)
+{
+    if (! supports(isa))
+    {
+        throw std::invalid_argument("kernel isa not supported: " + to_string(isa));
+    }
+    kernels = make_kernels(isa);
+}
+
+void patches2d::prolong_row(const double* coarse, double* fine, int j0, int j1, int num_fields)
+{
+    kernels.prolong_row(coarse, fine, j0, j1, num_fields);
+}
+
+void patches2d::restrict_row(const double* r0, const double* r1, double* out, int count, int num_fields)
+{
+    kernels.restrict_row(r0, r1, out, count, num_fields);
+}
+
+
+
+
+// ============================================================================
+FieldDescriptor::FieldDescriptor(int num_fields, MeshLocation location, Layout layout)
+: num_fields(num_fields)
+, location(location)
+, layout(layout)
+{
+}
+
+
+
+
+// ============================================================================
+Database::Database(int ni, int nj, Header header)
+: ni(ni)
+, nj(nj)
+, header(header)
+{
+}
+
+void Database::set_boundary_value(BoundaryValue b)
+{
+    boundary_value = b;
+}
+
+void Database::set_prolongation(Field which, ProlongationScheme scheme)
+{
+    if (scheme != ProlongationScheme::piecewise_constant && header.at(which).location != MeshLocation::cell)
+    {
+        throw std::invalid_argument("prolongation scheme is only supported for cell data");
+    }
+    operators[which].prolongation = scheme;
+    operators[which].custom_prolongation = nullptr;
+    ++topology_version;
+}
+
+void Database::set_prolongation(Field which, ProlongationOperator op)
+{
+    operators[which].custom_prolongation = op;
+    ++topology_version;
+}
+
+void Database::set_restriction(Field which, RestrictionScheme scheme)
+{
+    if (scheme != RestrictionScheme::average && header.at(which).location != MeshLocation::cell)
+    {
+        throw std::invalid_argument("restriction scheme is only supported for cell data");
+    }
+    operators[which].restriction = scheme;
+    operators[which].custom_restriction = nullptr;
+    ++topology_version;
+}
+
+void Database::set_restriction(Field which, RestrictionOperator op)
+{
+    operators[which].custom_restriction = op;
+    ++topology_version;
+}
+
+void Database::set_thread_pool(std::shared_ptr<ThreadPool> pool)
+{
+    thread_pool = pool;
+}
+
+void Database::set_array_pool(std::shared_ptr<ArrayPool> pool)
+{
+    array_pool = pool;
+}
+
+void Database::set_transport(std::shared_ptr<Transport> t)
+{
+    transport = t;
+}
+
+void Database::set_ownership(std::map<Index, int> o)
+{
+    ++topology_version;
+    owners = o;
+}
+
+std::vector<Database::Index> Database::migrate(const std::map<Index, int>& partition, int rank)
+{
+    // ------------------------------------------------------------------------
+    // Request every incoming patch whole, with one message per rank, as
+    // fetch_all_async does for guard zones.
+    // ------------------------------------------------------------------------
+    auto queries = std::map<int, std::vector<Query>>();
+
+    for (const auto& owner : partition)
+    {
+        if (owner.second == rank && ! patches.count(owner.first))
+        {
+            auto from = owners.find(owner.first);
+
+            if (from == owners.end())
+            {
+                throw std::invalid_argument("migrate: no rank is known to store " + to_string(owner.first));
+            }
+            auto shape = expected_shape(owner.first);
+            queries[from->second].push_back({owner.first, 0, shape[0], 0, shape[1]});
+        }
+    }
+
+    if (! queries.empty() && ! transport)
+    {
+        throw std::logic_error("migrate requires data from another rank, but no transport is set");
+    }
+    auto replies = std::map<int, std::future<std::vector<Array>>>();
+
+    for (const auto& q : queries)
+    {
+        replies[q.first] = transport->query(q.first, q.second);
+    }
+
+    for (auto& reply : replies)
+    {
+        auto arrays = reply.second.get();
+        const auto& sent = queries.at(reply.first);
+
+        if (arrays.size() != sent.size())
+        {
+            throw std::runtime_error("migrate: wrong number of patches received from rank " + std::to_string(reply.first));
+        }
+        for (std::size_t n = 0; n < sent.size(); ++n)
+        {
+            insert_stored(sent[n].index, arrays[n]);
+        }
+    }
+
+    auto outgoing = std::vector<Index>();
+
+    for (const auto& patch : patches)
+    {
+        auto owner = partition.find(patch.first);
+
+        if (owner != partition.end() && owner->second != rank)
+        {
+            outgoing.push_back(patch.first);
+        }
+    }
+    set_ownership(partition);
+    return outgoing;
+}
+
+void Database::set_ordering(Ordering ordering)
+{
+    ++topology_version;
+    patches.set_ordering(ordering);
+}
+
+void Database::insert(Index index, Array data)
+{
+    insert_stored(index, to_stored(check_shape(data, index), layout(index)));
+}
+
+void Database::insert_stored(Index index, Array data)
+{
+    PATCHES_PROFILE_SCOPE(Operation::insert, index, region_bytes(data.shape(0), data.shape(1), data.shape(2)));
+
+    if (data.shape() != expected_shape(index))
+    {
+        throw std::invalid_argument("input patch data has the wrong shape");
+    }
+    if (patches.insert(index, data))
+    {
+        ++topology_version;
+    }
+    frozen.erase(index);
+    ++versions[index];
+}
+
+std::size_t Database::erase(Index index)
+{
+    ++topology_version;
+    summary_cache.entries.erase(index);
+    return patches.erase(index) + frozen.erase(index);
+}
+
+void Database::clear()
+{
+    ++topology_version;
+    summary_cache.entries.clear();
+    patches.clear();
+    frozen.clear();
+}
+
+void Database::freeze(Index index, Compression compression, double tolerance)
+{
+    auto bytes = compress(patches.at(index), compression, tolerance);
+    patches.erase(index);
+    frozen[index] = std::move(bytes);
+    ++topology_version;
+}
+
+void Database::thaw(Index index)
+{
+    auto it = frozen.find(index);
+
+    if (it == frozen.end())
+    {
+        throw std::invalid_argument("patch " + to_string(index) + " is not frozen");
+    }
+    patches.insert(index, decompress(it->second));
+    frozen.erase(it);
+    ++versions[index];
+    ++topology_version;
+}
+
+bool Database::is_frozen(Index index) const
+{
+    return frozen.count(index);
+}
+
+std::size_t Database::frozen_bytes() const
+{
+    auto bytes = std::size_t(0);
+
+    for (const auto& patch : frozen)
+    {
+        bytes += patch.second.size();
+    }
+    return bytes;
+}
+
+void Database::refine_patch(Index index)
+{
+    apply_regrid({Block(std::get<0>(index), std::get<1>(index), std::get<2>(index))}, {});
+}
+
+void Database::coarsen_patches(Index parent)
+{
+    apply_regrid({}, {Block(std::get<0>(parent), std::get<1>(parent), std::get<2>(parent))});
+}
+
+std::size_t Database::regrid(Field which, RefinementCriterion criterion, int max_level)
+{
+    // ------------------------------------------------------------------------
+    // Tag every patch of the given field, then close the refinement set
+    // under the level balance: when a block at level L is refined, any
+    // neighbor covered by a leaf at level L - 1 must be refined too. Blocks
+    // are leaves of the given field.
+    // ------------------------------------------------------------------------
+    auto keys = indexes(which);
+    auto tags = std::vector<int>(keys.size());
+
+    parallel_for(keys.size(), [&] (std::size_t n)
+    {
+        tags[n] = criterion(keys[n], from_stored(patches.at(keys[n]), layout(keys[n])));
+    });
+
+    auto block = [] (Index index) { return Block(std::get<0>(index), std::get<1>(index), std::get<2>(index)); };
+    auto leaves = std::set<Block>();
+    auto refined = std::set<Block>();
+    auto coarsen = std::map<Block, int>();
+
+    for (std::size_t n = 0; n < keys.size(); ++n)
+    {
+        auto b = block(keys[n]);
+        leaves.insert(b);
+
+        if (tags[n] > 0 && std::get<2>(b) < max_level)
+        {
+            refined.insert(b);
+        }
+        else if (tags[n] < 0 && std::get<2>(b) > 0)
+        {
+            ++coarsen[Block(std::get<0>(b) >> 1, std::get<1>(b) >> 1, std::get<2>(b) - 1)];
+        }
+    }
+
+    auto work = std::vector<Block>(refined.begin(), refined.end());
+
+    while (! work.empty())
+    {
+        auto b = work.back();
+        work.pop_back();
+
+        for (int di = -1; di <= 1; ++di)
+        {
+            for (int dj = -1; dj <= 1; ++dj)
+            {
+                auto i = std::get<0>(b) + di;
+                auto j = std::get<1>(b) + dj;
+                auto level = std::get<2>(b);
+                auto coarser = Block(i >> 1, j >> 1, level - 1);
+
+                if (level > 0 && ! leaves.count(Block(i, j, level)) && leaves.count(coarser) && ! refined.count(coarser))
+                {
+                    refined.insert(coarser);
+                    work.push_back(coarser);
+                }
+            }
+        }
+    }
+
+    // ------------------------------------------------------------------------
+    // A sibling group may be coarsened into its parent P at level L if none
+    // of the siblings is being refined, and the region of each neighbor of P
+    // will hold nothing finer than level L + 1 after refinement. That region
+    // is fine if it is a leaf at level L or coarser; otherwise its children
+    // must be leaves which are not being refined, or empty.
+    // ------------------------------------------------------------------------
+    auto child = [] (Block b, int n)
+    {
+        return Block(std::get<0>(b) * 2 + n / 2, std::get<1>(b) * 2 + n % 2, std::get<2>(b) + 1);
+    };
+
+    auto balanced = [&] (Block q)
+    {
+        for (int k = 0; k <= std::get<2>(q); ++k)
+        {
+            if (leaves.count(Block(std::get<0>(q) >> k, std::get<1>(q) >> k, std::get<2>(q) - k)))
+            {
+                return true;
+            }
+        }
+        for (int n = 0; n < 4; ++n)
+        {
+            auto c = child(q, n);
+
+            if (leaves.count(c) ? refined.count(c) : leaves.count(child(c, 0)) || leaves.count(child(c, 1)) || leaves.count(child(c, 2)) || leaves.count(child(c, 3)))
+            {
+                return false;
+            }
+        }
+        return true;
+    };
+
+    auto coarsened = std::vector<Block>();
+
+    for (const auto& group : coarsen)
+    {
+        auto p = group.first;
+        auto allowed = group.second == 4;
+
+        for (int n = 0; n < 4 && allowed; ++n)
+        {
+            allowed = ! refined.count(child(p, n));
+        }
+        for (int di = -1; di <= 1 && allowed; ++di)
+        {
+            for (int dj = -1; dj <= 1 && allowed; ++dj)
+            {
+                allowed = (di == 0 && dj == 0) || balanced(Block(std::get<0>(p) + di, std::get<1>(p) + dj, std::get<2>(p)));
+            }
+        }
+        if (allowed)
+        {
+            coarsened.push_back(p);
+        }
+    }
+
+    apply_regrid(std::vector<Block>(refined.begin(), refined.end()), coarsened);
+    return refined.size() + coarsened.size();
+}
+
+void Database::apply_regrid(const std::vector<Block>& refined, const std::vector<Block>& coarsened)
+{
+    // ------------------------------------------------------------------------
+    // Each job replaces one field of one block. The new patches are all
+    // computed from the current data (in parallel, if a pool is set) before
+    // any patch is erased or inserted, so the jobs are independent.
+    // ------------------------------------------------------------------------
+    struct Job
+    {
+        Index index;
+        bool refine;
+        std::vector<std::pair<Index, Array>> result;
+    };
+    auto jobs = std::vector<Job>();
+
+    for (const auto& b : refined)
+    {
+        auto found = false;
+
+        for (const auto& field : header)
+        {
+            auto index = std::make_tuple(std::get<0>(b), std::get<1>(b), std::get<2>(b), field.first);
+
+            if (patches.count(index))
+            {
+                jobs.push_back({index, true, {}});
+                found = true;
+            }
+        }
+        if (! found)
+        {
+            auto index = std::make_tuple(std::get<0>(b), std::get<1>(b), std::get<2>(b), Field::cell_volume);
+            throw std::invalid_argument("refine_patch: no patch stored at " + to_string(index, "*"));
+        }
+    }
+
+    for (const auto& b : coarsened)
+    {
+        auto found = false;
+
+        for (const auto& field : header)
+        {
+            auto index = std::make_tuple(std::get<0>(b), std::get<1>(b), std::get<2>(b), field.first);
+            auto children = refine(index);
+            auto count = 0;
+
+            for (const auto& child : children)
+            {
+                count += patches.count(child);
+            }
+            if (count == 0)
+            {
+                continue;
+            }
+            if (count != 4)
+            {
+                throw std::invalid_argument("coarsen_patches: the children of " + to_string(index) + " are incomplete");
+            }
+            if (exists(index))
+            {
+                throw std::invalid_argument("coarsen_patches: a patch already exists at " + to_string(index));
+            }
+            jobs.push_back({index, false, {}});
+            found = true;
+        }
+        if (! found)
+        {
+            auto index = std::make_tuple(std::get<0>(b), std::get<1>(b), std::get<2>(b), Field::cell_volume);
+            throw std::invalid_argument("coarsen_patches: no children stored beneath " + to_string(index, "*"));
+        }
+    }
+
+    parallel_for(jobs.size(), [&] (std::size_t n)
+    {
+        auto& job = jobs[n];
+        auto targets = job.refine ? refine(job.index) : std::array<Index, 4>{job.index, job.index, job.index, job.index};
+
+        for (int t = 0; t < (job.refine ? 4 : 1); ++t)
+        {
+            auto source = resolve(targets[t]);
+
+            if (source.is_remote())
+            {
+                throw std::logic_error("regrid requires locally stored patches");
+            }
+            auto shape = expected_shape(targets[t]);
+            auto data = locate(source, 0, shape[0], 0, shape[1]);
+            job.result.emplace_back(targets[t], data);
+        }
+    });
+
+    // ------------------------------------------------------------------------
+    // The edits are then applied as one batch, which throws before changing
+    // the mesh if any of them is invalid, and the topology changes once.
+    // ------------------------------------------------------------------------
+    auto removed = std::vector<Index>();
+    auto added = std::vector<std::pair<Index, Array>>();
+
+    for (auto& job : jobs)
+    {
+        if (job.refine)
+        {
+            removed.push_back(job.index);
+        }
+        else
+        {
+            for (const auto& child : refine(job.index))
+            {
+                removed.push_back(child);
+            }
+        }
+        for (auto& patch : job.result)
+        {
+            if (patch.second.shape() != expected_shape(patch.first))
+            {
+                throw std::invalid_argument("input patch data has the wrong shape");
+            }
+            added.push_back(std::move(patch));
+        }
+    }
+    patches.replace(removed, added);
+
+    for (const auto& index : removed)
+    {
+        frozen.erase(index);
+        summary_cache.entries.erase(index);
+    }
+    for (const auto& patch : added)
+    {
+        frozen.erase(patch.first);
+        ++versions[patch.first];
+    }
+    ++topology_version;
+}
+
+void Database::commit(Index index, Array data, double rk_factor)
+{
+    commit_stored(index, layout_view(check_shape(data, index), layout(index)), rk_factor);
+}
+
+void Database::commit_stored(Index index, View data, double rk_factor)
+{
+    PATCHES_PROFILE_SCOPE(Operation::commit, index, region_bytes(data.shape(0), data.shape(1), data.shape(2)));
+    auto& target = patches.at(index);
+
+    if (data.shape() != target.shape())
+    {
+        throw std::invalid_argument("input patch data has the wrong shape");
+    }
+    update(target, data, rk_factor);
+    ++versions.at(index);
+}
+
+void Database::commit_interior(Index index, const Array& padded, int guard, double rk_factor)
+{
+    PATCHES_PROFILE_SCOPE(Operation::commit, index, region_bytes(padded.shape(0) - 2 * guard, padded.shape(1) - 2 * guard, padded.shape(2)));
+    auto& target = patches.at(index);
+    auto source = layout_view(padded, layout(index));
+
+    if (source.shape(0) != target.shape(0) + 2 * guard ||
+        source.shape(1) != target.shape(1) + 2 * guard ||
+        source.shape(2) != target.shape(2))
+    {
+        throw std::invalid_argument("input patch data has the wrong shape");
+    }
+    update(target, source.select(guard, guard + target.shape(0), guard, guard + target.shape(1)), rk_factor);
+    ++versions.at(index);
+}
+
+std::uint64_t Database::version(Index index) const
+{
+    patches.at(index);
+    return versions.at(index);
+}
+
+void Database::set_strip_cache(bool enabled)
+{
+    std::lock_guard<std::mutex> lock(strip_cache.mutex);
+    strip_cache.enabled = enabled;
+    strip_cache.strips.clear();
+}
+
+std::size_t Database::strip_cache_hits() const
+{
+    std::lock_guard<std::mutex> lock(strip_cache.mutex);
+    return strip_cache.hits;
+}
+
+namespace {
+
+    Database::Summary empty_summary(int nf)
+    {
+        auto res = Database::Summary();
+        res.min.assign(nf, std::numeric_limits<double>::infinity());
+        res.max.assign(nf, -std::numeric_limits<double>::infinity());
+        res.sum.assign(nf, 0.0);
+        return res;
+    }
+
+    void merge_summary(Database::Summary& into, const Database::Summary& from)
+    {
+        for (std::size_t k = 0; k < into.sum.size(); ++k)
+        {
+            into.min[k] = std::min(into.min[k], from.min[k]);
+            into.max[k] = std::max(into.max[k], from.max[k]);
+            into.sum[k] += from.sum[k];
+        }
+        into.count += from.count;
+    }
+
+    nd::array<double, 3> average_cells(const nd::array<double, 3>& A)
+    {
+        auto res = nd::array<double, 3>(A.shape(0) / 2, A.shape(1) / 2, A.shape(2));
+
+        for (int i = 0; i < res.shape(0); ++i)
+        {
+            for (int j = 0; j < res.shape(1); ++j)
+            {
+                for (int k = 0; k < res.shape(2); ++k)
+                {
+                    res(i, j, k) = ((A(2 * i, 2 * j, k) + A(2 * i, 2 * j + 1, k)) + (A(2 * i + 1, 2 * j, k) + A(2 * i + 1, 2 * j + 1, k))) * 0.25;
+                }
+            }
+        }
+        return res;
+    }
+}
+
+void Database::set_summaries(Field which, bool enabled)
+{
+    std::lock_guard<std::mutex> lock(summary_cache.mutex);
+
+    if (enabled)
+    {
+        summary_cache.fields.insert(which);
+        return;
+    }
+    summary_cache.fields.erase(which);
+
+    for (auto it = summary_cache.entries.begin(); it != summary_cache.entries.end();)
+    {
+        it = std::get<3>(it->first) == which ? summary_cache.entries.erase(it) : std::next(it);
+    }
+}
+
+Database::Summary Database::summary(Index index) const
+{
+    return summarize(index)->summary;
+}
+
+Database::Summary Database::reduce(Field which, int level) const
+{
+    auto keys = std::vector<Index>();
+
+    for (const auto& patch : patches)
+    {
+        if (std::get<3>(patch.first) == which && (level < 0 || std::get<2>(patch.first) == level))
+        {
+            keys.push_back(patch.first);
+        }
+    }
+    for (const auto& patch : frozen)
+    {
+        if (std::get<3>(patch.first) == which && (level < 0 || std::get<2>(patch.first) == level))
+        {
+            keys.push_back(patch.first);
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(summary_cache.mutex);
+
+        if (summary_cache.version != topology_version)
+        {
+            for (auto it = summary_cache.entries.begin(); it != summary_cache.entries.end();)
+            {
+                it = patches.count(it->first) || frozen.count(it->first) ? std::next(it) : summary_cache.entries.erase(it);
+            }
+            summary_cache.version = topology_version;
+        }
+    }
+
+    auto entries = std::vector<std::shared_ptr<const SummaryCache::Entry>>(keys.size());
+    auto res = empty_summary(header.at(which).num_fields);
+
+    parallel_for(keys.size(), [&] (std::size_t n)
+    {
+        entries[n] = summarize(keys[n]);
+    });
+
+    for (const auto& entry : entries)
+    {
+        merge_summary(res, entry->summary);
+    }
+    return res;
+}
+
+Database::Array Database::fetch(Index index, int guard) const
+{
+    return fetch(index, guard, guard, guard, guard);
+}
+
+Database::Array Database::fetch(Index index, int ngil, int ngir, int ngjl, int ngjr) const
+{
+    auto plan = fill_plan();
+    const auto& entry = plan->patches.at(index);
+    const auto& patch = *entry.patch;
+
+    if (entry.remote)
+    {
+        return fetch_async(index, ngil, ngir, ngjl, ngjr).get();
+    }
+
+    auto _     = nd::axis::all();
+    auto mi    = patch.shape(0) + ngil + ngir;
+    auto mj    = patch.shape(1) + ngjl + ngjr;
+    auto nf    = num_fields(index);
+    auto soa   = layout(index) == Layout::soa;
+    PATCHES_PROFILE_SCOPE(Operation::fetch, index, region_bytes(mi, mj, nf));
+    auto res   = soa ? allocate(nf, mi, mj) : allocate(mi, mj, nf);
+
+    fill_local(index, entry, {ngil, ngir, ngjl, ngjr}, [&] (int di, int dj, const Array& bv)
+    {
+        if (soa)
+        {
+            auto region = res.select(_, _|di|di+bv.shape(0), _|dj|dj+bv.shape(1));
+            update(region, make_view(bv), 0.0, Layout::soa);
+        }
+        else
+        {
+            res.select(_|di|di+bv.shape(0), _|dj|dj+bv.shape(1), _) = bv;
+        }
+    });
+    return res;
+}
+
+void Database::fetch_into(Index index, int guard, Array& out) const
+{
+    fetch_into(index, guard, guard, guard, guard, out);
+}
+
+void Database::fetch_into(Index index, int ngil, int ngir, int ngjl, int ngjr, Array& out) const
+{
+    auto plan = fill_plan();
+    const auto& entry = plan->patches.at(index);
+    const auto& patch = *entry.patch;
+    auto shape = std::array<int, 3>{patch.shape(0) + ngil + ngir, patch.shape(1) + ngjl + ngjr, patch.shape(2)};
+    auto soa = layout(index) == Layout::soa;
+
+    if (out.shape() != (soa ? std::array<int, 3>{shape[2], shape[0], shape[1]} : shape))
+    {
+        throw std::invalid_argument("fetch_into: output array has the wrong shape");
+    }
+    if (entry.remote && soa)
+    {
+        out = fetch_async(index, ngil, ngir, ngjl, ngjr).get();
+        return;
+    }
+    if (entry.remote)
+    {
+        fetch_batch_async({index}, {ngil, ngir, ngjl, ngjr}, {out})[0].get();
+        return;
+    }
+
+    PATCHES_PROFILE_SCOPE(Operation::fetch, index, region_bytes(shape[0], shape[1], shape[2]));
+    auto _ = nd::axis::all();
+
+    fill_local(index, entry, {ngil, ngir, ngjl, ngjr}, [&] (int di, int dj, const Array& bv)
+    {
+        if (soa)
+        {
+            auto region = out.select(_, _|di|di+bv.shape(0), _|dj|dj+bv.shape(1));
+            update(region, make_view(bv), 0.0, Layout::soa);
+        }
+        else
+        {
+            out.select(_|di|di+bv.shape(0), _|dj|dj+bv.shape(1), _) = bv;
+        }
+    });
+}
+
+void Database::fetch_into(Index index, int ngil, int ngir, int ngjl, int ngjr, double* data, std::array<int, 3> strides) const
+{
+    // ------------------------------------------------------------------------
+    // Data from other ranks is first assembled into a temporary array, so it
+    // is copied once more than data stored locally.
+    // ------------------------------------------------------------------------
+    if (! data)
+    {
+        throw std::invalid_argument("fetch_into: output pointer is null");
+    }
+    auto write = [data, strides] (int di, int dj, const Array& bv)
+    {
+        for (int i = 0; i < bv.shape(0); ++i)
+        {
+            for (int j = 0; j < bv.shape(1); ++j)
+            {
+                auto row = data + std::ptrdiff_t(di + i) * strides[0] + std::ptrdiff_t(dj + j) * strides[1];
+
+                for (int k = 0; k < bv.shape(2); ++k)
+                {
+                    row[std::ptrdiff_t(k) * strides[2]] = bv(i, j, k);
+                }
+            }
+        }
+    };
+
+    auto plan = fill_plan();
+    const auto& entry = plan->patches.at(index);
+
+    if (entry.remote)
+    {
+        const auto& patch = *entry.patch;
+        auto res = allocate(patch.shape(0) + ngil + ngir, patch.shape(1) + ngjl + ngjr, patch.shape(2));
+        fetch_batch_async({index}, {ngil, ngir, ngjl, ngjr}, {res})[0].get();
+        write(0, 0, res);
+
+        if (array_pool)
+        {
+            array_pool->release(res);
+        }
+        return;
+    }
+
+    PATCHES_PROFILE_SCOPE(Operation::fetch, index, region_bytes(entry.patch->shape(0) + ngil + ngir, entry.patch->shape(1) + ngjl + ngjr, entry.patch->shape(2)));
+    fill_local(index, entry, {ngil, ngir, ngjl, ngjr}, write);
+}
+
+void Database::fill_local(Index index, const FillPlan::Entry& entry, std::array<int, 4> guards, const std::function<void(int, int, const Array&)>& emit) const
+{
+    // ------------------------------------------------------------------------
+    // Pass the patch data, then each of the guard zone regions, to emit,
+    // along with the position (di, dj) where it sits in the padded patch.
+    // The patch must not depend on data stored on other ranks.
+    // ------------------------------------------------------------------------
+    emit(guards[0], guards[2], *entry.patch);
+
+    for (const auto& strip : strips(entry, guards[0], guards[1], guards[2], guards[3]))
+    {
+        if (strip.depth > 0)
+        {
+            fill_strip(index, entry, strip, emit);
+        }
+    }
+}
+
+void Database::fill_strip(Index index, const FillPlan::Entry& entry, const Strip& strip, const std::function<void(int, int, const Array&)>& emit) const
+{
+    // ------------------------------------------------------------------------
+    // Pass one guard zone region of a patch to emit, reading it from the
+    // strip cache if it is enabled and the cached region is current. Only
+    // regions computed from coarse or fine data are cached.
+    // ------------------------------------------------------------------------
+    const auto& patch = *entry.patch;
+    const auto& source = entry.edges[int(strip.edge)];
+
+#ifdef PATCHES_PROFILE
+    auto operation =
+    source.kind == Source::Kind::same_level ? Operation::same_level :
+    source.kind == Source::Kind::coarse ? Operation::prolongation :
+    source.kind == Source::Kind::fine ? Operation::restriction : Operation::boundary_value;
+#endif
+    PATCHES_PROFILE_SCOPE(operation, index, region_bytes(strip.i1 - strip.i0, strip.j1 - strip.j0, patch.shape(2)));
+
+    if (source.kind == Source::Kind::none)
+    {
+        emit(strip.di, strip.dj, boundary(index, strip, patch));
+        return;
+    }
+
+    auto cached = strip_cache.enabled && (source.kind == Source::Kind::coarse || source.kind == Source::Kind::fine);
+    auto key = StripCache::Key(index, strip.edge, strip.i0, strip.i1, strip.j0, strip.j1);
+    auto current = StripCache::Stamps();
+
+    if (cached)
+    {
+        current = stamps(index, source);
+        auto bv = Array();
+        {
+            std::lock_guard<std::mutex> lock(strip_cache.mutex);
+
+            if (strip_cache.version != topology_version)
+            {
+                strip_cache.strips.clear();
+                strip_cache.version = topology_version;
+            }
+            auto it = strip_cache.strips.find(key);
+
+            if (it != strip_cache.strips.end() && it->second.stamps == current)
+            {
+                bv = it->second.data;
+                ++strip_cache.hits;
+            }
+        }
+        if (! bv.empty())
+        {
+            emit(strip.di, strip.dj, bv);
+            return;
+        }
+    }
+
+    auto bv = locate(source, strip.i0, strip.i1, strip.j0, strip.j1, &patch, strip.edge);
+    emit(strip.di, strip.dj, bv);
+
+    if (cached)
+    {
+        std::lock_guard<std::mutex> lock(strip_cache.mutex);
+
+        if (strip_cache.version == topology_version)
+        {
+            strip_cache.strips[key] = StripCache::Entry{current, bv};
+        }
+    }
+    else
+    {
+        recycle(source, bv);
+    }
+}
+
+Database::StripCache::Stamps Database::stamps(Index index, const Source& source) const
+{
+    // ------------------------------------------------------------------------
+    // Return the versions of the patches a strip is computed from: the
+    // source parts, the target patch if it is read by linear prolongation,
+    // and the children's volumes if they weight the restriction. Unused
+    // slots are zero.
+    // ------------------------------------------------------------------------
+    auto res = StripCache::Stamps();
+    auto field = std::get<3>(source.parts[0]);
+    const auto& ops = operators_for(field);
+    auto staggered = source.stagger_i || source.stagger_j;
+    auto n = 0;
+
+    if (source.kind == Source::Kind::coarse)
+    {
+        res[n++] = versions.at(source.parts[0]);
+
+        if (! ops.custom_prolongation && ! staggered && ops.prolongation != ProlongationScheme::piecewise_constant)
+        {
+            res[n++] = versions.at(index);
+        }
+    }
+    else
+    {
+        for (int part = 0; part < 4; ++part)
+        {
+            res[n++] = versions.at(source.parts[part]);
+        }
+        if (! ops.custom_restriction && ! staggered && ops.restriction == RestrictionScheme::volume_weighted)
+        {
+            for (int part = 0; part < 4; ++part)
+            {
+                auto volume = source.parts[part];
+                std::get<3>(volume) = Field::cell_volume;
+                res[n++] = versions.at(volume);
+            }
+        }
+    }
+    return res;
+}
+
+Database::GuardProgram Database::guard_program(Field which, int guard) const
+{
+    // ------------------------------------------------------------------------
+    // Translate each strip of the fill plan into tasks, in the order
+    // fill_local visits them. Same-level strips become copies, and strips
+    // from coarser or finer cell data using injection or plain averaging
+    // become prolong or restrict tasks; the region of a prolong task is in
+    // the refined coordinates of the whole coarse patch, and a fine strip is
+    // split among the children it covers, with each region in the coarsened
+    // coordinates of the child. Everything else is staged.
+    // ------------------------------------------------------------------------
+    using Task = GuardProgram::Task;
+    auto plan = fill_plan();
+    auto program = GuardProgram();
+    auto position = std::unordered_map<Index, int, IndexHash>();
+    auto shape = expected_shape(std::make_tuple(0, 0, 0, which));
+    const auto& ops = operators_for(which);
+
+    program.patches = indexes(which);
+    program.shape = shape;
+    program.padded = {{shape[0] + 2 * guard, shape[1] + 2 * guard, shape[2]}};
+    program.version = plan->version;
+
+    for (std::size_t n = 0; n < program.patches.size(); ++n)
+    {
+        position[program.patches[n]] = int(n);
+    }
+
+    for (std::size_t n = 0; n < program.patches.size(); ++n)
+    {
+        const auto& entry = plan->patches.at(program.patches[n]);
+        auto target = int(n);
+
+        if (entry.remote)
+        {
+            throw std::logic_error("guard programs require locally stored patches");
+        }
+        program.tasks.push_back({Task::Kind::copy, target, target, 0, 0, shape[0], 0, shape[1], guard, guard, PatchBoundary::il, 0});
+
+        for (const auto& strip : strips(entry, guard, guard, guard, guard))
+        {
+            if (strip.depth == 0)
+            {
+                continue;
+            }
+            const auto& source = entry.edges[int(strip.edge)];
+            auto staggered = source.stagger_i || source.stagger_j;
+            auto task = Task{Task::Kind::stage, target, -1, 0, strip.i0, strip.i1, strip.j0, strip.j1, strip.di, strip.dj, strip.edge, strip.depth};
+
+            if (source.kind == Source::Kind::same_level)
+            {
+                task.kind = Task::Kind::copy;
+                task.source = position.at(source.parts[0]);
+            }
+            else if (source.kind == Source::Kind::coarse && ! staggered && ! ops.custom_prolongation && ops.prolongation == ProlongationScheme::piecewise_constant)
+            {
+                task.kind = Task::Kind::prolong;
+                task.source = position.at(source.parts[0]);
+                task.i0 += source.quadrant_i * ni;
+                task.i1 += source.quadrant_i * ni;
+                task.j0 += source.quadrant_j * nj;
+                task.j1 += source.quadrant_j * nj;
+            }
+            else if (source.kind == Source::Kind::fine && ! staggered && ! ops.custom_restriction && ops.restriction == RestrictionScheme::average)
+            {
+                for (int c = 0; c < 4; ++c)
+                {
+                    auto I = c / 2;
+                    auto J = c % 2;
+                    auto a0 = std::max(strip.i0, I * ni / 2);
+                    auto a1 = std::min(strip.i1, I * ni / 2 + ni / 2);
+                    auto b0 = std::max(strip.j0, J * nj / 2);
+                    auto b1 = std::min(strip.j1, J * nj / 2 + nj / 2);
+
+                    if (a0 < a1 && b0 < b1)
+                    {
+                        auto part = task;
+                        part.kind = Task::Kind::restrict;
+                        part.source = position.at(source.parts[c]);
+                        part.i0 = a0 - I * ni / 2;
+                        part.i1 = a1 - I * ni / 2;
+                        part.j0 = b0 - J * nj / 2;
+                        part.j1 = b1 - J * nj / 2;
+                        part.di = strip.di + a0 - strip.i0;
+                        part.dj = strip.dj + b0 - strip.j0;
+                        program.tasks.push_back(part);
+                    }
+                }
+                continue;
+            }
+            else
+            {
+                task.offset = program.staging_size;
+                program.staging_size += std::size_t(strip.i1 - strip.i0) * (strip.j1 - strip.j0) * shape[2];
+            }
+            program.tasks.push_back(task);
+        }
+    }
+    return program;
+}
+
+void Database::stage(const GuardProgram& program, double* staging) const
+{
+    auto plan = fill_plan();
+
+    if (plan->version != program.version)
+    {
+        throw std::logic_error("the guard program is out of date with the database topology");
+    }
+    auto nf = program.shape[2];
+
+    for (const auto& task : program.tasks)
+    {
+        if (task.kind != GuardProgram::Task::Kind::stage)
+        {
+            continue;
+        }
+        const auto& index = program.patches[task.target];
+        auto strip = Strip{task.edge, task.depth, task.i0, task.i1, task.j0, task.j1, task.di, task.dj};
+        auto out = staging + task.offset;
+
+        fill_strip(index, plan->patches.at(index), strip, [out, nf] (int, int, const Array& bv)
+        {
+            for (int i = 0; i < bv.shape(0); ++i)
+            {
+                for (int j = 0; j < bv.shape(1); ++j)
+                {
+                    for (int k = 0; k < nf; ++k)
+                    {
+                        out[(std::size_t(i) * bv.shape(1) + j) * nf + k] = bv(i, j, k);
+                    }
+                }
+            }
+        });
+    }
+}
+
+void Database::pack(const std::vector<Index>& indexes, double* data) const
+{
+    for (const auto& index : indexes)
+    {
+        auto source = make_view(patches.at(index));
+
+        for (int i = 0; i < source.shape(0); ++i)
+        {
+            for (int j = 0; j < source.shape(1); ++j)
+            {
+                for (int k = 0; k < source.shape(2); ++k)
+                {
+                    *data++ = source(i, j, k);
+                }
+            }
+        }
+    }
+}
+
+void Database::unpack(const std::vector<Index>& indexes, const double* data, double rk_factor)
+{
+    for (const auto& index : indexes)
+    {
+        auto shape = expected_shape(index);
+        auto strides = std::array<int, 3>{{shape[1] * shape[2], shape[2], 1}};
+
+        update(patches.at(index), View(data, shape, strides), rk_factor);
+        ++versions.at(index);
+        data += std::size_t(shape[0]) * shape[1] * shape[2];
+    }
+}
+
+std::future<Database::Array> Database::fetch_async(Index index, int guard) const
+{
+    return fetch_async(index, guard, guard, guard, guard);
+}
+
+std::future<Database::Array> Database::fetch_async(Index index, int ngil, int ngir, int ngjl, int ngjr) const
+{
+    return std::move(fetch_batch_async({index}, {ngil, ngir, ngjl, ngjr})[0]);
+}
+
+std::vector<Database::Array> Database::fetch_many(int i, int j, int level, std::vector<Field> fields, int guard) const
+{
+    auto keys = std::vector<Index>();
+    auto res = std::vector<Array>();
+
+    for (auto field : fields)
+    {
+        keys.push_back(std::make_tuple(i, j, level, field));
+    }
+    for (auto& future : fetch_batch_async(keys, {guard, guard, guard, guard}))
+    {
+        res.push_back(future.get());
+    }
+    return res;
+}
+
+Database::Array Database::fetch_interleaved(int i, int j, int level, std::vector<Field> fields, int guard) const
+{
+    // ------------------------------------------------------------------------
+    // Each field is filled through a view of its own components in the
+    // interleaved array, so the guard zones are only written once.
+    // ------------------------------------------------------------------------
+    if (fields.empty())
+    {
+        throw std::invalid_argument("fetch_interleaved requires at least one field");
+    }
+
+    auto _ = nd::axis::all();
+    auto keys = std::vector<Index>();
+    auto views = std::vector<Array>();
+    auto shape = expected_shape(std::make_tuple(i, j, level, fields[0]));
+    auto nf = 0;
+
+    for (auto field : fields)
+    {
+        if (header.at(field).location != header.at(fields[0]).location)
+        {
+            throw std::invalid_argument("interleaved fields must have the same mesh location");
+        }
+        nf += header.at(field).num_fields;
+    }
+
+    auto res = allocate(shape[0] + 2 * guard, shape[1] + 2 * guard, nf);
+    auto k = 0;
+
+    for (auto field : fields)
+    {
+        keys.push_back(std::make_tuple(i, j, level, field));
+        views.push_back(res.select(_|0|res.shape(0), _|0|res.shape(1), _|k|k+header.at(field).num_fields));
+        k += header.at(field).num_fields;
+    }
+    for (auto& future : fetch_batch_async(keys, {guard, guard, guard, guard}, views))
+    {
+        future.get();
+    }
+    return res;
+}
+
+std::map<Database::Index, std::future<Database::Array>> Database::fetch_all_async(Field which, int guard) const
+{
+    auto keys = indexes(which);
+    auto futures = fetch_batch_async(keys, {guard, guard, guard, guard});
+    auto res = std::map<Index, std::future<Array>>();
+
+    for (std::size_t n = 0; n < keys.size(); ++n)
+    {
+        res.emplace(keys[n], std::move(futures[n]));
+    }
+    return res;
+}
+
+std::vector<Database::Array> Database::serve(const std::vector<Query>& queries) const
+{
+    auto _ = nd::axis::all();
+    auto res = std::vector<Array>();
+
+    for (const auto& q : queries)
+    {
+        res.push_back(patches.at(q.index).select(_|q.i0|q.i1, _|q.j0|q.j1, _).copy());
+    }
+    return res;
+}
+
+std::map<Database::Index, Database::Array> Database::fetch_all(Field which, int guard) const
+{
+    auto keys = indexes(which);
+    auto data = std::vector<Array>(keys.size());
+    auto res = std::map<Index, Array>();
+
+    parallel_for(keys.size(), [&] (std::size_t n)
+    {
+        data[n].become(fetch(keys[n], guard));
+    });
+
+    for (std::size_t n = 0; n < keys.size(); ++n)
+    {
+        res.emplace(keys[n], data[n]);
+    }
+    return res;
+}
+
+void Database::commit_all(std::map<Index, Array> data, double rk_factor)
+{
+    auto items = std::vector<std::map<Index, Array>::iterator>();
+
+    for (auto it = data.begin(); it != data.end(); ++it)
+    {
+        items.push_back(it);
+    }
+
+    parallel_for(items.size(), [&] (std::size_t n)
+    {
+        commit(items[n]->first, items[n]->second, rk_factor);
+    });
+}
+
+void Database::for_each_patch(Field which, int guard, std::function<void(Index, Array)> fn) const
+{
+    auto keys = indexes(which);
+
+    parallel_for(keys.size(), [&] (std::size_t n)
+    {
+        fn(keys[n], fetch(keys[n], guard));
+    });
+}
+
+Database::Array Database::assemble(int i0, int i1, int j0, int j1, int level, Field field) const
+{
+    auto _ = nd::axis::all();
+    int mi = 0, mj = 0;
+
+    switch (header.at(field).location)
+    {
+        case MeshLocation::cell  : mi = (i1 - i0) * ni + 0; mj = (j1 - j0) * nj + 0; break;
+        case MeshLocation::vert  : mi = (i1 - i0) * ni + 1; mj = (j1 - j0) * nj + 1; break;
+        case MeshLocation::face_i: mi = (i1 - i0) * ni + 1; mj = (j1 - j0) * nj + 0; break;
+        case MeshLocation::face_j: mi = (i1 - i0) * ni + 0; mj = (j1 - j0) * nj + 1; break;
+    }
+
+    auto nf = header.at(field).num_fields;
+    auto soa = header.at(field).layout == Layout::soa;
+    auto res = soa ? allocate(nf, mi, mj) : allocate(mi, mj, nf);
+
+    for (int i = i0; i < i1; ++i)
+    {
+        for (int j = j0; j < j1; ++j)
+        {
+            int di = 0, dj = 0;
+
+            switch (header.at(field).location)
+            {
+                case MeshLocation::cell  : di = (i == i1 - 1) * 0; dj = (j == j1 - 1) * 0; break;
+                case MeshLocation::vert  : di = (i == i1 - 1) * 1; dj = (j == j1 - 1) * 1; break;
+                case MeshLocation::face_i: di = (i == i1 - 1) * 1; dj = (j == j1 - 1) * 0; break;
+                case MeshLocation::face_j: di = (i == i1 - 1) * 0; dj = (j == j1 - 1) * 1; break;
+            }
+
+            const auto& patch = patches.at(std::make_tuple(i, j, level, field));
+
+            if (soa)
+            {
+                auto block = res.select(_, _|(i-i0)*ni|(i-i0+1)*ni+di, _|(j-j0)*nj|(j-j0+1)*nj+dj);
+                update(block, make_view(patch.select(_|0|ni+di, _|0|nj+dj, _)), 0.0, Layout::soa);
+            }
+            else
+            {
+                res.select(_|(i-i0)*ni|(i-i0+1)*ni+di, _|(j-j0)*nj|(j-j0+1)*nj+dj, _) = patch.select(_|0|ni+di, _|0|nj+dj, _);
+            }
+        }
+    }
+    return res;
+}
+
+Database::Array Database::assemble(int i0, int i1, int j0, int j1, int level, Field field, int factor) const
+{
+    if (header.at(field).location != MeshLocation::cell)
+    {
+        throw std::invalid_argument("assemble: downsampling is only supported for cell data");
+    }
+    if (factor < 1 || (factor & (factor - 1)) || ni % factor || nj % factor)
+    {
+        throw std::invalid_argument("assemble: the factor must be a power of two which divides the block size");
+    }
+    auto _ = nd::axis::all();
+    auto mi = ni / factor;
+    auto mj = nj / factor;
+    auto deepest = level;
+
+    for (const auto& patch : patches)
+    {
+        if (std::get<3>(patch.first) == field)
+        {
+            deepest = std::max(deepest, std::get<2>(patch.first));
+        }
+    }
+    for (const auto& patch : frozen)
+    {
+        if (std::get<3>(patch.first) == field)
+        {
+            deepest = std::max(deepest, std::get<2>(patch.first));
+        }
+    }
+    auto res = allocate((i1 - i0) * mi, (j1 - j0) * mj, header.at(field).num_fields);
+
+    for (int i = i0; i < i1; ++i)
+    {
+        for (int j = j0; j < j1; ++j)
+        {
+            res.select(_|(i-i0)*mi|(i-i0+1)*mi, _|(j-j0)*mj|(j-j0+1)*mj, _) = downsample(std::make_tuple(i, j, level, field), factor, deepest);
+        }
+    }
+    return from_stored(res, header.at(field).layout);
+}
+
+Database::AssembledView Database::assemble_view(int i0, int i1, int j0, int j1, int level, Field field) const
+{
+    auto res = AssembledView();
+    auto extent = expected_shape(std::make_tuple(i0, j0, level, field));
+
+    res.ni = ni;
+    res.nj = nj;
+    res.num_i = i1 - i0;
+    res.num_j = j1 - j0;
+    res.count = {(i1 - i0) * ni + extent[0] - ni, (j1 - j0) * nj + extent[1] - nj, extent[2]};
+
+    for (int i = i0; i < i1; ++i)
+    {
+        for (int j = j0; j < j1; ++j)
+        {
+            res.blocks.push_back(view(std::make_tuple(i, j, level, field)));
+        }
+    }
+    return res;
+}
+
+void Database::assemble_tiles(int i0, int i1, int j0, int j1, int level, Field field, int tile_i, int tile_j, TileSink sink, int stride) const
+{
+    if (tile_i < 1 || tile_j < 1)
+    {
+        throw std::invalid_argument("assemble_tiles: the tile size must be positive");
+    }
+    auto _ = nd::axis::all();
+    auto shape = window_shape(i0, i1, j0, j1, stride);
+    auto nf = header.at(field).num_fields;
+    auto field_layout = header.at(field).layout;
+    auto ti = std::min(tile_i, shape[0]);
+    auto tj = std::min(tile_j, shape[1]);
+    auto buffer = field_layout == Layout::soa ? allocate(nf, ti, tj) : allocate(ti, tj, nf);
+
+    for (int p0 = 0; p0 < shape[0]; p0 += ti)
+    {
+        for (int q0 = 0; q0 < shape[1]; q0 += tj)
+        {
+            auto p1 = std::min(p0 + ti, shape[0]);
+            auto q1 = std::min(q0 + tj, shape[1]);
+            auto full = p1 - p0 == ti && q1 - q0 == tj;
+            auto tile = full ? buffer : (field_layout == Layout::soa ? allocate(nf, p1 - p0, q1 - q0) : allocate(p1 - p0, q1 - q0, nf));
+
+            assemble_pieces(i0, i1, j0, j1, level, field, stride, {p0, p1, q0, q1}, [&] (int p, int q, View piece)
+            {
+                auto di = p - p0;
+                auto dj = q - q0;
+
+                if (field_layout == Layout::soa)
+                {
+                    auto region = tile.select(_, _|di|di+piece.shape(0), _|dj|dj+piece.shape(1));
+                    update(region, piece, 0.0, Layout::soa);
+                }
+                else
+                {
+                    auto region = tile.select(_|di|di+piece.shape(0), _|dj|dj+piece.shape(1), _);
+                    update(region, piece, 0.0);
+                }
+            });
+            sink(p0, q0, tile);
+        }
+    }
+}
+
+void Database::assemble_into(int i0, int i1, int j0, int j1, int level, Field field, double* data, std::array<std::ptrdiff_t, 3> strides, int stride) const
+{
+    auto shape = window_shape(i0, i1, j0, j1, stride);
+
+    assemble_pieces(i0, i1, j0, j1, level, field, stride, {0, shape[0], 0, shape[1]}, [&] (int p, int q, View piece)
+    {
+        for (int i = 0; i < piece.shape(0); ++i)
+        {
+            for (int j = 0; j < piece.shape(1); ++j)
+            {
+                auto out = data + std::ptrdiff_t(p + i) * strides[0] + std::ptrdiff_t(q + j) * strides[1];
+
+                for (int k = 0; k < piece.shape(2); ++k)
+                {
+                    out[std::ptrdiff_t(k) * strides[2]] = piece(i, j, k);
+                }
+            }
+        }
+    });
+}
+
+void Database::assemble_to(const Serializer& ser, std::string path, int i0, int i1, int j0, int j1, int level, Field field, int stride) const
+{
+    // ------------------------------------------------------------------------
+    // The rows of an interleaved array are rows of the window. A planar one
+    // is written a component at a time, in ranges of window rows, so the
+    // pieces are visited once for each component.
+    // ------------------------------------------------------------------------
+    auto _ = nd::axis::all();
+    auto shape = window_shape(i0, i1, j0, j1, stride);
+    auto nf = header.at(field).num_fields;
+
+    if (header.at(field).layout == Layout::soa)
+    {
+        ser.write_planes(path, {nf, shape[0], shape[1]}, [&] (int k, int r0, int r1, Array& rows)
+        {
+            assemble_pieces(i0, i1, j0, j1, level, field, stride, {r0, r1, 0, shape[1]}, [&] (int p, int q, View piece)
+            {
+                auto component = View(&piece(0, 0, k), {piece.shape(0), piece.shape(1), 1}, piece.strides());
+                auto region = rows.select(_, _|p-r0|p-r0+piece.shape(0), _|q|q+piece.shape(1));
+                update(region, component, 0.0, Layout::soa);
+            });
+        });
+        return;
+    }
+    ser.write_rows(path, {shape[0], shape[1], nf}, [&] (int r0, int r1, Array& rows)
+    {
+        assemble_pieces(i0, i1, j0, j1, level, field, stride, {r0, r1, 0, shape[1]}, [&] (int p, int q, View piece)
+        {
+            auto region = rows.select(_|p-r0|p-r0+piece.shape(0), _|q|q+piece.shape(1), _);
+            update(region, piece, 0.0);
+        });
+    });
+}
+
+Database::View Database::view(Index index) const
+{
+    auto res = make_view(patches.at(index));
+
+    if (layout(index) == Layout::soa)
+    {
+        auto shape = res.shape();
+        auto strides = res.strides();
+        return View(res.data(), {shape[2], shape[0], shape[1]}, {strides[2], strides[0], strides[1]});
+    }
+    return res;
+}
+
+void Database::for_each_view(Field which, std::function<void(Index, View)> fn) const
+{
+    for (const auto& patch : patches)
+    {
+        if (std::get<3>(patch.first) == which)
+        {
+            fn(patch.first, view(patch.first));
+        }
+    }
+}
+
+const Database::Array& Database::at(Index index) const
+{
+    return patches.at(index);
+}
+
+const Database::Array& Database::at(Index index, Field which) const
+{
+    std::get<3>(index) = which;
+    return patches.at(index);
+}
+
+std::map<Database::Index, Database::Array> Database::all(Field which) const
+{
+    auto res = std::map<Index, Array>();
+
+    for (const auto& patch : patches)
+    {
+        if (std::get<3>(patch.first) == which)
+        {
+            res.emplace(patch.first, from_stored(patch.second, layout(patch.first)));
+        }
+    }
+    return res;
+}
+
+std::size_t Database::count(Field which) const
+{
+    std::size_t n = 0;
+
+    for (const auto& patch : patches)
+    {
+        if (std::get<3>(patch.first) == which)
+        {
+            ++n;
+        }
+    }
+    return n;
+}
+
+std::size_t Database::num_cells(Field which) const
+{
+    return count(which) * ni * nj;
+}
+
+void Database::print(std::ostream& os) const
+{
+    os << std::string(52, '=') << "\n";
+    os << "Database:\n\n";
+    os << "block size: " << ni << " " << nj << "\n";
+    os << "mesh patches:\n\n";
+
+    for (const auto& patch : patches)
+    {
+        os << "\t" << to_string(patch.first) << "\n";
+    }
+    os << "\n";
+}
+
+void Database::dump(const Serializer& ser) const
+{
+    ser.write_header(header);
+    ser.write_block_size({ni, nj});
+
+    for (const auto& patch : patches)
+    {
+        PATCHES_PROFILE_SCOPE(Operation::serializer_write, patch.first, region_bytes(patch.second.shape(0), patch.second.shape(1), patch.second.shape(2)));
+        ser.write_array(to_string(patch.first), from_stored(patch.second, layout(patch.first)));
+    }
+    for (const auto& patch : frozen)
+    {
+        PATCHES_PROFILE_SCOPE(Operation::serializer_write, patch.first, shape_bytes(expected_shape(patch.first)));
+        ser.write_array(to_string(patch.first), from_stored(decompress(patch.second), layout(patch.first)));
+    }
+    ser.flush();
+}
+
+std::future<void> Database::dump_async(std::shared_ptr<const Serializer> ser, std::function<void()> on_complete) const
+{
+    // ------------------------------------------------------------------------
+    // Patches share slab storage and are updated in place by commit, so the
+    // snapshot is a deep copy. It is only a memory copy, which is cheap next
+    // to the cost of writing the data out.
+    // ------------------------------------------------------------------------
+    auto snapshot = std::make_shared<Database>(ni, nj, header);
+    snapshot->patches = patches;
+    snapshot->frozen = frozen;
+
+    return std::async(std::launch::async, [snapshot, ser, on_complete]
+    {
+        snapshot->dump(*ser);
+
+        if (on_complete)
+        {
+            on_complete();
+        }
+    });
+}
+
+Database Database::load(const Serializer& ser, std::set<Field> fields, std::function<bool()> bailout, std::shared_ptr<ThreadPool> pool)
+{
+    auto options = LoadOptions();
+    options.fields = fields;
+    options.bailout = bailout;
+    options.pool = pool;
+    return load(ser, options);
+}
+
+Database Database::load(const Serializer& ser, const LoadOptions& options)
+{
+    // ------------------------------------------------------------------------
+    // Select the patches to load from the serializer's index, grouped by
+    // level so that the coarse levels come first. The arrays are read in the
+    // layout they were written in, and stored interleaved as always.
+    // ------------------------------------------------------------------------
+    auto written = ser.read_header();
+    auto header = written;
+    auto blocks = ser.read_block_size();
+
+    for (const auto& layout : options.layouts)
+    {
+        if (header.count(layout.first))
+        {
+            header.at(layout.first).layout = layout.second;
+        }
+    }
+
+    auto database = Database(blocks[0], blocks[1], header);
+    auto levels = std::map<int, std::vector<Index>>();
+    const auto& bounds = options.bounds;
+
+    for (const auto& index : ser.read_index())
+    {
+        auto i     = std::get<0>(index);
+        auto j     = std::get<1>(index);
+        auto level = std::get<2>(index);
+        auto field = std::get<3>(index);
+        auto scale = std::ldexp(1.0, -level);
+
+        if ((options.fields.empty() || options.fields.count(field))
+            && level >= options.min_level && level <= options.max_level
+            && i * scale < bounds[1] && (i + 1) * scale > bounds[0]
+            && j * scale < bounds[3] && (j + 1) * scale > bounds[2])
+        {
+            levels[level].push_back(index);
+        }
+    }
+
+    auto run = [pool = options.pool] (std::size_t count, std::function<void(std::size_t)> fn)
+    {
+        if (pool)
+        {
+            pool->run(count, fn);
+        }
+        else
+        {
+            for (std::size_t n = 0; n < count; ++n)
+            {
+                fn(n);
+            }
+        }
+    };
+
+    for (const auto& level : levels)
+    {
+        // --------------------------------------------------------------------
+        // Patches are inserted serially, since inserting may grow the
+        // storage. Those which the serializer can view in place are inserted
+        // blank, and their data is then copied in from the views, in parallel
+        // if a pool is given. The others are read with read_array, in
+        // parallel beforehand if a pool is given.
+        // --------------------------------------------------------------------
+        const auto& keys = level.second;
+        auto names = std::vector<std::string>(keys.size());
+        auto views = std::vector<View>(keys.size());
+        auto arrays = std::vector<Array>(keys.size());
+        auto blanks = std::map<Field, Array>();
+        auto loaded = std::size_t(0);
+
+        for (std::size_t n = 0; n < keys.size(); ++n)
+        {
+            names[n] = to_string(keys[n]);
+            views[n] = layout_view(ser.read_view(names[n]), written.at(std::get<3>(keys[n])).layout);
+
+            if (! views[n].empty() && views[n].shape() != database.expected_shape(keys[n]))
+            {
+                throw std::invalid_argument("input patch data has the wrong shape");
+            }
+        }
+
+        if (options.pool)
+        {
+            run(keys.size(), [&] (std::size_t n)
+            {
+                if (views[n].empty())
+                {
+                    PATCHES_PROFILE_SCOPE(Operation::serializer_read, keys[n], shape_bytes(database.expected_shape(keys[n])));
+                    arrays[n].become(ser.read_array(names[n]));
+                }
+            });
+        }
+
+        auto bailed = false;
+
+        while (loaded < keys.size() && ! bailed)
+        {
+            auto n = loaded++;
+
+            if (! views[n].empty())
+            {
+                auto field = std::get<3>(keys[n]);
+
+                if (! blanks.count(field))
+                {
+                    blanks.emplace(field, Array(database.expected_shape(keys[n])));
+                }
+                database.insert_stored(keys[n], blanks.at(field));
+            }
+            else
+            {
+                if (arrays[n].empty())
+                {
+                    PATCHES_PROFILE_SCOPE(Operation::serializer_read, keys[n], shape_bytes(database.expected_shape(keys[n])));
+                    arrays[n].become(ser.read_array(names[n]));
+                }
+                database.insert_stored(keys[n], to_stored(arrays[n], written.at(std::get<3>(keys[n])).layout));
+            }
+            bailed = options.bailout && options.bailout();
+        }
+
+        run(loaded, [&] (std::size_t n)
+        {
+            if (! views[n].empty())
+            {
+                PATCHES_PROFILE_SCOPE(Operation::serializer_read, keys[n], region_bytes(views[n].shape(0), views[n].shape(1), views[n].shape(2)));
+                update(database.patches.at(keys[n]), views[n], 0.0);
+            }
+        });
+
+        if (bailed)
+        {
+            break;
+        }
+        if (options.on_level)
+        {
+            options.on_level(database, level.first);
+        }
+    }
+    return database;
+}
+
+
+
+
+// ========================================================================
+std::size_t Database::IndexHash::operator()(const Index& index) const
+{
+    auto h = std::uint64_t(std::uint32_t(std::get<0>(index)));
+    h = h * 0x9E3779B97F4A7C15ull ^ std::uint32_t(std::get<1>(index));
+    h = h * 0x9E3779B97F4A7C15ull ^ std::uint32_t(std::get<2>(index));
+    h = h * 0x9E3779B97F4A7C15ull ^ std::uint32_t(std::get<3>(index));
+    return std::size_t(h ^ (h >> 32));
+}
+
+
+
+
+bool Database::IndexOrder::operator()(const Index& a, const Index& b) const
+{
+    if (ordering == Ordering::index)
+    {
+        return a < b;
+    }
+    auto key = ordering == Ordering::morton ? morton_key : hilbert_key;
+    auto ka = key(std::get<0>(a), std::get<1>(a), std::get<2>(a));
+    auto kb = key(std::get<0>(b), std::get<1>(b), std::get<2>(b));
+    return ka < kb || (ka == kb && std::get<3>(a) < std::get<3>(b));
+}
+
+
+
+
+// ========================================================================
+Database::PatchStore::PatchStore(Ordering ordering) : ordered(IndexOrder{ordering})
+{
+}
+
+Database::PatchStore::PatchStore(const PatchStore& other) : ordered(other.ordered.key_comp())
+{
+    for (const auto& patch : other)
+    {
+        insert(patch.first, patch.second);
+    }
+}
+
+Database::PatchStore& Database::PatchStore::operator=(const PatchStore& other)
+{
+    if (this != &other)
+    {
+        clear();
+        ordered = container_type(other.ordered.key_comp());
+
+        for (const auto& patch : other)
+        {
+            insert(patch.first, patch.second);
+        }
+    }
+    return *this;
+}
+
+const Database::Array& Database::PatchStore::at(Index index) const
+{
+    auto it = lookup.find(index);
+
+    if (it == lookup.end())
+    {
+        throw std::out_of_range("no patch at index " + to_string(index));
+    }
+    return *it->second.patch;
+}
+
+Database::Array& Database::PatchStore::at(Index index)
+{
+    auto it = lookup.find(index);
+
+    if (it == lookup.end())
+    {
+        throw std::out_of_range("no patch at index " + to_string(index));
+    }
+    return *it->second.patch;
+}
+
+bool Database::PatchStore::insert(Index index, const Array& data)
+{
+    auto _ = nd::axis::all();
+    auto it = lookup.find(index);
+
+    if (it != lookup.end())
+    {
+        *it->second.patch = data;
+        return false;
+    }
+    auto& slab = slabs[std::get<3>(index)];
+
+    if (slab.vacant.empty())
+    {
+        grow(slab, data.shape());
+    }
+    auto slot = slab.vacant.back();
+    auto& patch = ordered[index];
+
+    patch.become(slab.memory.select(_|slot*slab.rows|(slot+1)*slab.rows, _, _));
+    patch = data;
+
+    slab.vacant.pop_back();
+    slab.slots[slot] = &patch;
+    slab.live += 1;
+    lookup[index] = Entry{&patch, slot};
+    return true;
+}
+
+std::size_t Database::PatchStore::erase(Index index)
+{
+    auto it = lookup.find(index);
+
+    if (it == lookup.end())
+    {
+        return 0;
+    }
+    auto field = std::get<3>(index);
+    auto& slab = slabs.at(field);
+
+    slab.slots[it->second.slot] = nullptr;
+    slab.vacant.push_back(it->second.slot);
+    slab.live -= 1;
+    lookup.erase(it);
+    ordered.erase(index);
+
+    if (slab.live == 0)
+    {
+        slabs.erase(field);
+    }
+    return 1;
+}
+
+void Database::PatchStore::replace(const std::vector<Index>& removed, const std::vector<std::pair<Index, Array>>& added)
+{
+    // ------------------------------------------------------------------------
+    // Everything is checked, and room made in the slabs, before the store is
+    // changed. The new patches go in before the old ones come out, so that
+    // no slab empties and is released partway through.
+    // ------------------------------------------------------------------------
+    auto needed = std::map<Field, std::pair<std::size_t, std::array<int, 3>>>();
+
+    for (const auto& index : removed)
+    {
+        if (! lookup.count(index))
+        {
+            throw std::out_of_range("no patch at index " + to_string(index));
+        }
+    }
+    for (const auto& patch : added)
+    {
+        if (lookup.count(patch.first))
+        {
+            throw std::invalid_argument("a patch already exists at " + to_string(patch.first));
+        }
+        auto& need = needed[std::get<3>(patch.first)];
+        need.first += 1;
+        need.second = patch.second.shape();
+    }
+    for (const auto& need : needed)
+    {
+        auto& slab = slabs[need.first];
+
+        while (slab.vacant.size() < need.second.first)
+        {
+            grow(slab, need.second.second);
+        }
+    }
+    for (const auto& patch : added)
+    {
+        insert(patch.first, patch.second);
+    }
+    for (const auto& index : removed)
+    {
+        erase(index);
+    }
+}
+
+void Database::PatchStore::clear()
+{
+    ordered.clear();
+    lookup.clear();
+    slabs.clear();
+}
+
+void Database::PatchStore::set_ordering(Ordering new_ordering)
+{
+    // ------------------------------------------------------------------------
+    // Insert the patches into a new store in the new order, so that the slots
+    // of each slab are filled in that order too.
+    // ------------------------------------------------------------------------
+    auto order = IndexOrder{new_ordering};
+    auto sorted = std::vector<const container_type::value_type*>();
+
+    for (const auto& patch : ordered)
+    {
+        sorted.push_back(&patch);
+    }
+    std::sort(sorted.begin(), sorted.end(), [order] (auto a, auto b) { return order(a->first, b->first); });
+
+    auto store = PatchStore(new_ordering);
+
+    for (auto patch : sorted)
+    {
+        store.insert(patch->first, patch->second);
+    }
+    *this = std::move(store);
+}
+
+void Database::PatchStore::grow(Slab& slab, std::array<int, 3> shape)
+{
+    auto _ = nd::axis::all();
+    auto old_capacity = int(slab.slots.size());
+    auto new_capacity = std::max(8, old_capacity * 2);
+    auto memory = Array(new_capacity * shape[0], shape[1], shape[2]);
+    PATCHES_PROFILE_ALLOCATION();
+
+    if (old_capacity > 0)
+    {
+        memory.select(_|0|old_capacity*slab.rows, _, _) = slab.memory;
+    }
+    slab.rows = shape[0];
+    slab.memory.become(memory);
+    slab.slots.resize(new_capacity, nullptr);
+
+    for (int slot = 0; slot < old_capacity; ++slot)
+    {
+        if (slab.slots[slot])
+        {
+            slab.slots[slot]->become(slab.memory.select(_|slot*slab.rows|(slot+1)*slab.rows, _, _));
+        }
+    }
+    for (int slot = new_capacity - 1; slot >= old_capacity; --slot)
+    {
+        slab.vacant.push_back(slot);
+    }
+}
+
+
+
+
+// ========================================================================
+int Database::num_fields(Index index) const
+{
+    return header.at(std::get<3>(index)).num_fields;
+}
+
+MeshLocation Database::location(Index index) const
+{
+    return header.at(std::get<3>(index)).location;
+}
+
+Database::View Database::make_view(const Array& array)
+{
+    // ------------------------------------------------------------------------
+    // The strides are measured from the element addresses, so that this works
+    // for any array whose elements are laid out with constant strides.
+    // ------------------------------------------------------------------------
+    auto shape = array.shape();
+    auto strides = std::array<int, 3>{shape[1] * shape[2], shape[2], 1};
+
+    if (array.empty())
+    {
+        return View();
+    }
+    const double* origin = &array(0, 0, 0);
+
+    if (shape[0] > 1) strides[0] = int(&array(1, 0, 0) - origin);
+    if (shape[1] > 1) strides[1] = int(&array(0, 1, 0) - origin);
+    if (shape[2] > 1) strides[2] = int(&array(0, 0, 1) - origin);
+
+    return View(origin, shape, strides);
+}
+
+Database::View Database::layout_view(const Array& array, Layout layout)
+{
+    return layout_view(make_view(array), layout);
+}
+
+Database::View Database::layout_view(View view, Layout layout)
+{
+    // ------------------------------------------------------------------------
+    // Return a view of data in the given layout, indexed as (i, j, k) like
+    // the stored data regardless of the layout.
+    // ------------------------------------------------------------------------
+    if (layout == Layout::soa && ! view.empty())
+    {
+        auto shape = view.shape();
+        auto strides = view.strides();
+        return View(view.data(), {shape[1], shape[2], shape[0]}, {strides[1], strides[2], strides[0]});
+    }
+    return view;
+}
+
+Database::Array Database::to_stored(const Array& array, Layout layout)
+{
+    if (layout == Layout::aos)
+    {
+        return array;
+    }
+    auto res = Array(array.shape(1), array.shape(2), array.shape(0));
+    update(res, layout_view(array, layout), 0.0);
+    return res;
+}
+
+Database::Array Database::from_stored(const Array& array, Layout layout)
+{
+    if (layout == Layout::aos)
+    {
+        return array;
+    }
+    auto res = Array(array.shape(2), array.shape(0), array.shape(1));
+    update(res, make_view(array), 0.0, layout);
+    return res;
+}
+
+bool Database::has_contiguous_rows(const Array& array)
+{
+    auto strides = make_view(array).strides();
+    return strides[2] == 1 && strides[1] == array.shape(2);
+}
+
+void Database::update(Array& target, View data, double rk_factor, Layout layout)
+{
+    // ------------------------------------------------------------------------
+    // Write data * (1 - rk_factor) + target * rk_factor into the target's
+    // memory in a single pass, without temporary arrays. Contiguous data is
+    // handled as one flat loop, which the compiler vectorizes; otherwise the
+    // loop runs over the (contiguous) rows of the target. A planar target is
+    // written one component at a time, so that its rows are contiguous too.
+    // ------------------------------------------------------------------------
+    auto dst = layout_view(target, layout);
+    auto out = &target(0, 0, 0);
+    auto a = 1.0 - rk_factor;
+    auto b = rk_factor;
+
+    if (dst.contiguous() && data.contiguous())
+    {
+        auto src = data.data();
+        auto n = data.size();
+
+        if (b == 0.0)
+        {
+            std::copy(src, src + n, out);
+        }
+        else
+        {
+            for (std::size_t m = 0; m < n; ++m)
+            {
+                out[m] = src[m] * a + out[m] * b;
+            }
+        }
+        return;
+    }
+
+    auto ds = dst.strides();
+    auto ss = data.strides();
+
+    if (layout == Layout::soa)
+    {
+        for (int k = 0; k < data.shape(2); ++k)
+        {
+            for (int i = 0; i < data.shape(0); ++i)
+            {
+                auto d = out + k * ds[2] + i * ds[0];
+                auto s = &data(i, 0, k);
+
+                for (int j = 0; j < data.shape(1); ++j)
+                {
+                    d[j * ds[1]] = b == 0.0 ? s[j * ss[1]] : s[j * ss[1]] * a + d[j * ds[1]] * b;
+                }
+            }
+        }
+        return;
+    }
+
+    for (int i = 0; i < data.shape(0); ++i)
+    {
+        for (int j = 0; j < data.shape(1); ++j)
+        {
+            auto d = out + i * ds[0] + j * ds[1];
+            auto s = &data(i, j, 0);
+
+            for (int k = 0; k < data.shape(2); ++k)
+            {
+                d[k * ds[2]] = b == 0.0 ? s[k * ss[2]] : s[k * ss[2]] * a + d[k * ds[2]] * b;
+            }
+        }
+    }
+}
+
+Database::Array Database::check_shape(Array& array, Index index) const
+{
+    if (array.shape() != layout_shape(index))
+    {
+        throw std::invalid_argument("input patch data has the wrong shape");
+    }
+    return array;
+}
+
+Layout Database::layout(Index index) const
+{
+    return header.at(std::get<3>(index)).layout;
+}
+
+std::array<int, 3> Database::layout_shape(Index index) const
+{
+    auto shape = expected_shape(index);
+
+    if (layout(index) == Layout::soa)
+    {
+        return {{shape[2], shape[0], shape[1]}};
+    }
+    return shape;
+}
+
+Database::Index Database::coarsen(Index index) const
+{
+    std::get<0>(index) >>= 1;
+    std::get<1>(index) >>= 1;
+    std::get<2>(index) -= 1;
+    return index;
+}
+
+std::array<Database::Index, 4> Database::refine(Index index) const
+{
+    auto i = std::get<0>(index);
+    auto j = std::get<1>(index);
+    auto p = std::get<2>(index);
+    auto f = std::get<3>(index);
+
+    return {
+        std::make_tuple(i * 2 + 0, j * 2 + 0, p + 1, f),
+        std::make_tuple(i * 2 + 0, j * 2 + 1, p + 1, f),
+        std::make_tuple(i * 2 + 1, j * 2 + 0, p + 1, f),
+        std::make_tuple(i * 2 + 1, j * 2 + 1, p + 1, f),
+    };
+}
+
+std::array<int, 3> Database::expected_shape(Index index) const
+{
+    switch (location(index))
+    {
+        case MeshLocation::cell: return {ni + 0, nj + 0, num_fields(index)};
+        case MeshLocation::vert: return {ni + 1, nj + 1, num_fields(index)};
+        case MeshLocation::face_i: return {ni + 1, nj + 0, num_fields(index)};
+        case MeshLocation::face_j: return {ni + 0, nj + 1, num_fields(index)};
+    }
+    throw;
+}
+
+Database::Array Database::reference_patch(Index index) const
+{
+    if (location(index) != MeshLocation::cell)
+    {
+        throw std::invalid_argument("reference_patch: only cell data is supported");
+    }
+    if (patches.count(index))
+    {
+        return from_stored(patches.at(index), layout(index));
+    }
+
+    if (patches.count(coarsen(index)))
+    {
+        auto i = std::get<0>(index);
+        auto j = std::get<1>(index);
+        return from_stored(prolongation(quadrant(patches.at(coarsen(index)), i & 1, j & 1)), layout(index));
+    }
+
+    if (contains_all(refine(index)))
+    {
+        return from_stored(restriction(tile(refine(index))), layout(index));
+    }
+
+    return nd::array<double, 3>();
+}
+
+bool Database::Source::is_remote() const
+{
+    for (auto rank : ranks)
+    {
+        if (rank != -1)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+Database::Source Database::resolve(Index index) const
+{
+    auto source = Source();
+    auto where = location(index);
+
+    source.stagger_i = where == MeshLocation::vert || where == MeshLocation::face_i;
+    source.stagger_j = where == MeshLocation::vert || where == MeshLocation::face_j;
+
+    if (exists(index))
+    {
+        source.kind = Source::Kind::same_level;
+        assign_part(source, 0, index);
+    }
+    else if (exists(coarsen(index)))
+    {
+        source.kind = Source::Kind::coarse;
+        source.quadrant_i = std::get<0>(index) & 1;
+        source.quadrant_j = std::get<1>(index) & 1;
+        assign_part(source, 0, coarsen(index));
+    }
+    else
+    {
+        auto children = refine(index);
+
+        if (exists(children[0]) && exists(children[1]) && exists(children[2]) && exists(children[3]))
+        {
+            source.kind = Source::Kind::fine;
+
+            for (int n = 0; n < 4; ++n)
+            {
+                assign_part(source, n, children[n]);
+            }
+        }
+    }
+    return source;
+}
+
+void Database::assign_part(Source& source, int n, Index index) const
+{
+    source.parts[n] = index;
+
+    if (patches.count(index))
+    {
+        source.data[n] = &patches.at(index);
+    }
+    else
+    {
+        source.ranks[n] = owners.at(index);
+    }
+}
+
+bool Database::exists(Index index) const
+{
+    return patches.count(index) || owners.count(index);
+}
+
+std::array<int, 4> Database::footprint(const Source& source, int n, const Strip& strip) const
+{
+    // ------------------------------------------------------------------------
+    // Return the region {i0, i1, j0, j1} of the n-th part of the source which
+    // the given strip depends on. The region is empty (i0 >= i1 or j0 >= j1)
+    // if that part is not needed. Along a staggered axis, a fine vertex may
+    // fall between two coarse ones, and the coarse vertex at 2 * i and the
+    // fine vertex at i coincide.
+    // ------------------------------------------------------------------------
+    auto si = source.stagger_i;
+    auto sj = source.stagger_j;
+
+    switch (source.kind)
+    {
+        case Source::Kind::none:
+        {
+            return {0, 0, 0, 0};
+        }
+        case Source::Kind::same_level:
+        {
+            return {strip.i0, strip.i1, strip.j0, strip.j1};
+        }
+        case Source::Kind::coarse:
+        {
+            // The linear schemes also read the neighbors of each coarse cell.
+            auto oi = source.quadrant_i * ni / 2;
+            auto oj = source.quadrant_j * nj / 2;
+            auto halo = operators_for(std::get<3>(source.parts[0])).prolongation != ProlongationScheme::piecewise_constant;
+            return {
+                std::max(0,       oi + strip.i0 / 2 - halo),
+                std::min(ni + si, oi + (strip.i1 - 1 + si) / 2 + 1 + halo),
+                std::max(0,       oj + strip.j0 / 2 - halo),
+                std::min(nj + sj, oj + (strip.j1 - 1 + sj) / 2 + 1 + halo),
+            };
+        }
+        case Source::Kind::fine:
+        {
+            auto I = n / 2;
+            auto J = n % 2;
+            return {
+                std::max(2 * strip.i0, I * ni) - I * ni,
+                std::min(2 * strip.i1 - si, I * ni + ni + I * si) - I * ni,
+                std::max(2 * strip.j0, J * nj) - J * nj,
+                std::min(2 * strip.j1 - sj, J * nj + nj + J * sj) - J * nj,
+            };
+        }
+    }
+    throw;
+}
+
+std::array<Database::Strip, 8> Database::strips(const FillPlan::Entry& entry, int ngil, int ngir, int ngjl, int ngjr) const
+{
+    // ------------------------------------------------------------------------
+    // Along a staggered axis, the row of vertices or faces on the boundary
+    // with a neighbor is shared. It belongs to the neighbor on the ir and jr
+    // edges unless that neighbor is coarser, and on the il and jl edges only
+    // if that neighbor is finer. The strip is then widened by one row to
+    // overwrite the target's own copy. The corner regions only cover guard
+    // zones, since the shared rows are part of the edge strips.
+    // ------------------------------------------------------------------------
+    auto kind = [&] (PatchBoundary edge) { return entry.edges[int(edge)].kind; };
+    auto si = entry.edges[0].stagger_i;
+    auto sj = entry.edges[0].stagger_j;
+    auto eil = si && kind(PatchBoundary::il) == Source::Kind::fine;
+    auto ejl = sj && kind(PatchBoundary::jl) == Source::Kind::fine;
+    auto eir = si && (kind(PatchBoundary::ir) == Source::Kind::same_level || kind(PatchBoundary::ir) == Source::Kind::fine);
+    auto ejr = sj && (kind(PatchBoundary::jr) == Source::Kind::same_level || kind(PatchBoundary::jr) == Source::Kind::fine);
+    auto corner = [] (int ngi, int ngj) { return ngi > 0 && ngj > 0 ? std::max(ngi, ngj) : 0; };
+    auto dir = ngil + ni + si;
+    auto djr = ngjl + nj + sj;
+
+    return {{
+        {PatchBoundary::il, ngil, ni - ngil, ni + eil, 0, nj + sj, 0, ngjl},
+        {PatchBoundary::ir, ngir, si - eir, si + ngir, 0, nj + sj, dir - eir, ngjl},
+        {PatchBoundary::jl, ngjl, 0, ni + si, nj - ngjl, nj + ejl, ngil, 0},
+        {PatchBoundary::jr, ngjr, 0, ni + si, sj - ejr, sj + ngjr, ngil, djr - ejr},
+        {PatchBoundary::il_jl, corner(ngil, ngjl), ni - ngil, ni, nj - ngjl, nj, 0, 0},
+        {PatchBoundary::il_jr, corner(ngil, ngjr), ni - ngil, ni, sj, sj + ngjr, 0, djr},
+        {PatchBoundary::ir_jl, corner(ngir, ngjl), si, si + ngir, nj - ngjl, nj, dir, 0},
+        {PatchBoundary::ir_jr, corner(ngir, ngjr), si, si + ngir, sj, sj + ngjr, dir, djr},
+    }};
+}
+
+nd::array<double, 3> Database::boundary(Index index, const Strip& strip, const Array& patch) const
+{
+    // ------------------------------------------------------------------------
+    // Invoke the boundary value callback for the given strip. A corner is
+    // requested as a square of the strip's depth, and cropped to the part of
+    // it adjacent to the patch. Planar fields are passed to the callback,
+    // and returned from it, in their own layout.
+    // ------------------------------------------------------------------------
+    auto _ = nd::axis::all();
+    auto bv = layout(index) == Layout::soa
+    ? to_stored(boundary_value(index, strip.edge, strip.depth, from_stored(patch, Layout::soa)), Layout::soa)
+    : boundary_value(index, strip.edge, strip.depth, patch);
+    auto mi = strip.i1 - strip.i0;
+    auto mj = strip.j1 - strip.j0;
+    auto d = strip.depth;
+
+    switch (strip.edge)
+    {
+        case PatchBoundary::il_jl: return bv.select(_|d-mi|d, _|d-mj|d, _);
+        case PatchBoundary::il_jr: return bv.select(_|d-mi|d, _|0|mj, _);
+        case PatchBoundary::ir_jl: return bv.select(_|0|mi, _|d-mj|d, _);
+        case PatchBoundary::ir_jr: return bv.select(_|0|mi, _|0|mj, _);
+        default: return bv;
+    }
+}
+
+std::vector<std::future<Database::Array>> Database::fetch_batch_async(std::vector<Index> indexes, std::array<int, 4> guards, std::vector<Array> outputs) const
+{
+    // ------------------------------------------------------------------------
+    // A strip whose source is partly stored on another rank, along with the
+    // rank and position in the reply of each part that had to be queried. If
+    // outputs are given, the n-th result is written into outputs[n], which
+    // must have the padded shape; it may be a view into a larger array.
+    // Otherwise the results are converted to the layout of their field.
+    // ------------------------------------------------------------------------
+    struct Pending
+    {
+        std::size_t target;
+        Strip strip;
+        Source source;
+        std::array<std::pair<int, std::size_t>, 4> replies;
+    };
+
+    struct State
+    {
+        std::vector<Array> results;
+        std::vector<const Array*> targets;
+        std::vector<Pending> pending;
+        std::map<int, std::shared_future<std::vector<Array>>> replies;
+    };
+
+    auto _ = nd::axis::all();
+    auto plan = fill_plan();
+    auto state = std::make_shared<State>();
+    auto queries = std::map<int, std::vector<Query>>();
+    auto ngil = guards[0];
+    auto ngir = guards[1];
+    auto ngjl = guards[2];
+    auto ngjr = guards[3];
+
+    for (std::size_t n = 0; n < indexes.size(); ++n)
+    {
+        const auto& entry = plan->patches.at(indexes[n]);
+
+        for (const auto& strip : strips(entry, ngil, ngir, ngjl, ngjr))
+        {
+            const auto& source = entry.edges[int(strip.edge)];
+
+            if (strip.depth > 0 && source.is_remote())
+            {
+                auto pending = Pending{n, strip, source, {}};
+
+                for (int part = 0; part < 4; ++part)
+                {
+                    auto region = footprint(source, part, strip);
+
+                    if (source.ranks[part] != -1 && region[0] < region[1] && region[2] < region[3])
+                    {
+                        auto& q = queries[source.ranks[part]];
+                        pending.replies[part] = std::make_pair(source.ranks[part], q.size());
+                        q.push_back({source.parts[part], region[0], region[1], region[2], region[3]});
+                    }
+                }
+                state->pending.push_back(pending);
+            }
+        }
+    }
+
+    if (! queries.empty() && ! transport)
+    {
+        throw std::logic_error("fetch requires data from another rank, but no transport is set");
+    }
+
+    for (auto& q : queries)
+    {
+        state->replies[q.first] = transport->query(q.first, std::move(q.second)).share();
+    }
+
+    for (std::size_t n = 0; n < indexes.size(); ++n)
+    {
+        const auto& index = indexes[n];
+        const auto& entry = plan->patches.at(index);
+        const auto& patch = *entry.patch;
+        PATCHES_PROFILE_SCOPE(Operation::fetch, index, region_bytes(patch.shape(0) + ngil + ngir, patch.shape(1) + ngjl + ngjr, patch.shape(2)));
+        auto res = outputs.empty()
+        ? allocate(patch.shape(0) + ngil + ngir, patch.shape(1) + ngjl + ngjr, num_fields(index))
+        : outputs[n];
+
+        res.select(_|ngil|patch.shape(0)+ngil, _|ngjl|patch.shape(1)+ngjl, _) = patch;
+
+        for (const auto& strip : strips(entry, ngil, ngir, ngjl, ngjr))
+        {
+            const auto& source = entry.edges[int(strip.edge)];
+
+            if (strip.depth > 0 && ! source.is_remote())
+            {
+                fill_strip(index, entry, strip, [&] (int di, int dj, const Array& bv)
+                {
+                    res.select(_|di|di+bv.shape(0), _|dj|dj+bv.shape(1), _) = bv;
+                });
+            }
+        }
+        state->results.push_back(res);
+        state->targets.push_back(&patch);
+    }
+
+    auto futures = std::vector<std::future<Array>>();
+
+    for (std::size_t n = 0; n < indexes.size(); ++n)
+    {
+        auto soa = outputs.empty() && layout(indexes[n]) == Layout::soa;
+
+        futures.push_back(std::async(std::launch::deferred, [this, state, n, soa] ()
+        {
+            auto _ = nd::axis::all();
+            auto& res = state->results[n];
+
+            for (const auto& pending : state->pending)
+            {
+                if (pending.target != n)
+                {
+                    continue;
+                }
+                auto source = pending.source;
+                const auto& strip = pending.strip;
+
+                for (int part = 0; part < 4; ++part)
+                {
+                    if (source.ranks[part] != -1)
+                    {
+                        auto region = footprint(source, part, strip);
+
+                        if (region[0] < region[1] && region[2] < region[3])
+                        {
+                            const auto& reply = state->replies.at(pending.replies[part].first).get();
+                            source.data[part] = &reply.at(pending.replies[part].second);
+                            source.origin_i[part] = region[0];
+                            source.origin_j[part] = region[2];
+                        }
+                    }
+                }
+                auto bv = locate(source, strip.i0, strip.i1, strip.j0, strip.j1, state->targets[n], strip.edge);
+                res.select(_|strip.di|strip.di+bv.shape(0), _|strip.dj|strip.dj+bv.shape(1), _) = bv;
+                recycle(source, bv);
+            }
+            if (soa)
+            {
+                auto planar = from_stored(res, Layout::soa);
+
+                if (array_pool)
+                {
+                    array_pool->release(res);
+                }
+                return planar;
+            }
+            return res;
+        }));
+    }
+    return futures;
+}
+
+std::shared_ptr<const Database::FillPlan> Database::fill_plan() const
+{
+    std::lock_guard<std::mutex> lock(plan_cache.mutex);
+    auto& plan = plan_cache.plan;
+
+    if (plan && plan->version == topology_version)
+    {
+        return plan;
+    }
+    auto new_plan = std::make_shared<FillPlan>();
+    new_plan->version = topology_version;
+
+    for (const auto& patch : patches)
+    {
+        auto i = std::get<0>(patch.first);
+        auto j = std::get<1>(patch.first);
+        auto p = std::get<2>(patch.first);
+        auto f = std::get<3>(patch.first);
+        auto& entry = new_plan->patches[patch.first];
+
+        entry.patch = &patch.second;
+        entry.edges[int(PatchBoundary::il)] = resolve(std::make_tuple(i - 1, j, p, f));
+        entry.edges[int(PatchBoundary::ir)] = resolve(std::make_tuple(i + 1, j, p, f));
+        entry.edges[int(PatchBoundary::jl)] = resolve(std::make_tuple(i, j - 1, p, f));
+        entry.edges[int(PatchBoundary::jr)] = resolve(std::make_tuple(i, j + 1, p, f));
+        entry.edges[int(PatchBoundary::il_jl)] = resolve(std::make_tuple(i - 1, j - 1, p, f));
+        entry.edges[int(PatchBoundary::il_jr)] = resolve(std::make_tuple(i - 1, j + 1, p, f));
+        entry.edges[int(PatchBoundary::ir_jl)] = resolve(std::make_tuple(i + 1, j - 1, p, f));
+        entry.edges[int(PatchBoundary::ir_jr)] = resolve(std::make_tuple(i + 1, j + 1, p, f));
+
+        for (const auto& source : entry.edges)
+        {
+            entry.remote = entry.remote || source.is_remote();
+        }
+    }
+    plan = new_plan;
+    return plan;
+}
+
+nd::array<double, 3> Database::locate(const Source& source, int i0, int i1, int j0, int j1, const Array* target, PatchBoundary edge) const
+{
+    // ------------------------------------------------------------------------
+    // Return the region [i0, i1) x [j0, j1) of the data described by source,
+    // reading only the source cells it depends on (see footprint). For cell
+    // data with the default operators, the result is bit-identical to the
+    // same region of reference_patch(index). If given, target is the patch
+    // whose guard zones across the given edge are being filled; the linear
+    // prolongation schemes read it.
+    // ------------------------------------------------------------------------
+    auto _ = nd::axis::all();
+
+    switch (source.kind)
+    {
+        case Source::Kind::none:
+        {
+            return nd::array<double, 3>();
+        }
+        case Source::Kind::same_level:
+        {
+            auto oi = source.origin_i[0];
+            auto oj = source.origin_j[0];
+            return source.data[0]->select(_|i0-oi|i1-oi, _|j0-oj|j1-oj, _);
+        }
+        case Source::Kind::coarse:
+        {
+            const auto& ops = operators_for(std::get<3>(source.parts[0]));
+
+            if (ops.custom_prolongation)
+            {
+                return prolong_custom(source, i0, i1, j0, j1);
+            }
+            if (source.stagger_i || source.stagger_j)
+            {
+                return locate_staggered(source, i0, i1, j0, j1);
+            }
+            switch (ops.prolongation)
+            {
+                case ProlongationScheme::linear_minmod: return prolong_linear<Minmod>(source, i0, i1, j0, j1, target, edge);
+                case ProlongationScheme::linear_mc: return prolong_linear<MonotonizedCentral>(source, i0, i1, j0, j1, target, edge);
+                case ProlongationScheme::piecewise_constant: break;
+            }
+            const auto& A = *source.data[0];
+            auto oi = source.quadrant_i * ni / 2 - source.origin_i[0];
+            auto oj = source.quadrant_j * nj / 2 - source.origin_j[0];
+            auto nf = A.shape(2);
+            auto res = allocate(i1 - i0, j1 - j0, nf);
+
+            if (has_contiguous_rows(A) && make_view(res).contiguous())
+            {
+                auto out = &res(0, 0, 0);
+
+                for (int i = i0; i < i1; ++i)
+                {
+                    kernels.prolong_row(&A(oi + i / 2, oj + j0 / 2, 0), out + (i - i0) * (j1 - j0) * nf, j0, j1, nf);
+                }
+                return res;
+            }
+
+            for (int i = i0; i < i1; ++i)
+            {
+                for (int j = j0; j < j1; ++j)
+                {
+                    for (int k = 0; k < nf; ++k)
+                    {
+                        res(i - i0, j - j0, k) = A(oi + i / 2, oj + j / 2, k);
+                    }
+                }
+            }
+            return res;
+        }
+        case Source::Kind::fine:
+        {
+            const auto& ops = operators_for(std::get<3>(source.parts[0]));
+
+            if (ops.custom_restriction)
+            {
+                return restrict_custom(source, i0, i1, j0, j1);
+            }
+            if (source.stagger_i || source.stagger_j)
+            {
+                return locate_staggered(source, i0, i1, j0, j1);
+            }
+            if (ops.restriction == RestrictionScheme::volume_weighted)
+            {
+                return restrict_volume_weighted(source, i0, i1, j0, j1);
+            }
+            auto nf = num_fields(source.parts[0]);
+            auto res = allocate(i1 - i0, j1 - j0, nf);
+            auto rows = make_view(res).contiguous();
+
+            for (int n = 0; n < 4; ++n)
+            {
+                rows = rows && (! source.data[n] || has_contiguous_rows(*source.data[n]));
+            }
+
+            if (rows)
+            {
+                auto out = &res(0, 0, 0);
+
+                for (int i = i0; i < i1; ++i)
+                {
+                    for (int J = 0; J < 2; ++J)
+                    {
+                        auto b0 = std::max(j0, J * nj / 2);
+                        auto b1 = std::min(j1, J * nj / 2 + nj / 2);
+
+                        if (b0 < b1)
+                        {
+                            auto I = (2 * i) / ni;
+                            auto n = I * 2 + J;
+                            auto r = 2 * i - I * ni - source.origin_i[n];
+                            auto s = 2 * b0 - J * nj - source.origin_j[n];
+                            const auto& C = *source.data[n];
+                            kernels.restrict_row(&C(r, s, 0), &C(r + 1, s, 0), out + ((i - i0) * (j1 - j0) + b0 - j0) * nf, b1 - b0, nf);
+                        }
+                    }
+                }
+                return res;
+            }
+
+            for (int i = i0; i < i1; ++i)
+            {
+                for (int j = j0; j < j1; ++j)
+                {
+                    auto I = (2 * i) / ni;
+                    auto J = (2 * j) / nj;
+                    auto n = I * 2 + J;
+                    auto r = 2 * i - I * ni - source.origin_i[n];
+                    auto s = 2 * j - J * nj - source.origin_j[n];
+                    const auto& C = *source.data[n];
+
+                    for (int k = 0; k < nf; ++k)
+                    {
+                        res(i - i0, j - j0, k) = (C(r + 0, s + 0, k) + C(r + 0, s + 1, k) + C(r + 1, s + 0, k) + C(r + 1, s + 1, k)) * 0.25;
+                    }
+                }
+            }
+            return res;
+        }
+    }
+    throw;
+}
+
+const Database::Operators& Database::operators_for(Field which) const
+{
+    static const Operators defaults;
+    auto it = operators.find(which);
+    return it == operators.end() ? defaults : it->second;
+}
+
+template<typename Limiter>
+nd::array<double, 3> Database::prolong_linear(const Source& source, int i0, int i1, int j0, int j1, const Array* target, PatchBoundary edge) const
+{
+    // ------------------------------------------------------------------------
+    // Each fine cell sits a quarter of a coarse cell width to the left or
+    // right of its parent's center, in each direction. The coordinates ci, cj
+    // are coarse patch coordinates, and (x, y) is the same cell in A, which
+    // may be a partial array received from a remote rank.
+    //
+    // The coarse patch's edge facing the target patch is the coarse/fine
+    // interface. The coarse value across it is the average of the 2x2
+    // target cells adjacent to the interface; (ti, tj) is the first of them.
+    // ------------------------------------------------------------------------
+    const auto& A = *source.data[0];
+    auto oi = source.quadrant_i * ni / 2;
+    auto oj = source.quadrant_j * nj / 2;
+    auto nf = A.shape(2);
+    auto res = allocate(i1 - i0, j1 - j0, nf);
+
+    auto across = [&] (int ci, int cj, int k)
+    {
+        const auto& T = *target;
+        auto ti = 0, tj = 0;
+
+        switch (edge)
+        {
+            case PatchBoundary::il: ti = 0;      tj = 2 * (cj - oj); break;
+            case PatchBoundary::ir: ti = ni - 2; tj = 2 * (cj - oj); break;
+            case PatchBoundary::jl: tj = 0;      ti = 2 * (ci - oi); break;
+            case PatchBoundary::jr: tj = nj - 2; ti = 2 * (ci - oi); break;
+            default: break;
+        }
+        return (T(ti + 0, tj + 0, k) + T(ti + 0, tj + 1, k) + T(ti + 1, tj + 0, k) + T(ti + 1, tj + 1, k)) * 0.25;
+    };
+
+    for (int i = i0; i < i1; ++i)
+    {
+        for (int j = j0; j < j1; ++j)
+        {
+            auto ci = oi + i / 2;
+            auto cj = oj + j / 2;
+            auto x = ci - source.origin_i[0];
+            auto y = cj - source.origin_j[0];
+            auto wi = i % 2 == 0 ? -0.25 : 0.25;
+            auto wj = j % 2 == 0 ? -0.25 : 0.25;
+            auto il = target && edge == PatchBoundary::ir && ci == 0;
+            auto ir = target && edge == PatchBoundary::il && ci == ni - 1;
+            auto jl = target && edge == PatchBoundary::jr && cj == 0;
+            auto jr = target && edge == PatchBoundary::jl && cj == nj - 1;
+
+            for (int k = 0; k < nf; ++k)
+            {
+                auto u = A(x, y, k);
+                auto si = 0.0;
+                auto sj = 0.0;
+
+                if (ci > 0 && ci < ni - 1) si = Limiter::slope(u - A(x - 1, y, k), A(x + 1, y, k) - u);
+                else if (il) si = Limiter::slope(u - across(ci, cj, k), A(x + 1, y, k) - u);
+                else if (ir) si = Limiter::slope(u - A(x - 1, y, k), across(ci, cj, k) - u);
+
+                if (cj > 0 && cj < nj - 1) sj = Limiter::slope(u - A(x, y - 1, k), A(x, y + 1, k) - u);
+                else if (jl) sj = Limiter::slope(u - across(ci, cj, k), A(x, y + 1, k) - u);
+                else if (jr) sj = Limiter::slope(u - A(x, y - 1, k), across(ci, cj, k) - u);
+
+                res(i - i0, j - j0, k) = u + si * wi + sj * wj;
+            }
+        }
+    }
+    return res;
+}
+
+nd::array<double, 3> Database::locate_staggered(const Source& source, int i0, int i1, int j0, int j1) const
+{
+    // ------------------------------------------------------------------------
+    // Each result value is the average of four source values, (a0, b0),
+    // (a0, b1), (a1, b0), (a1, b1), some of which coincide. A fine vertex
+    // between two coarse ones is their average, while coarse vertices are
+    // sampled from the coincident fine vertex and coarse faces averaged from
+    // the two fine faces covering them. The pairwise sums make the average
+    // of coincident values exact. Fine vertices on the boundary between two
+    // children are read from the child in the direction of increasing index.
+    // ------------------------------------------------------------------------
+    auto si = source.stagger_i;
+    auto sj = source.stagger_j;
+    auto nf = num_fields(source.parts[0]);
+    auto res = allocate(i1 - i0, j1 - j0, nf);
+
+    if (source.kind == Source::Kind::coarse)
+    {
+        const auto& A = *source.data[0];
+        auto oi = source.quadrant_i * ni / 2 - source.origin_i[0];
+        auto oj = source.quadrant_j * nj / 2 - source.origin_j[0];
+
+        for (int i = i0; i < i1; ++i)
+        {
+            for (int j = j0; j < j1; ++j)
+            {
+                auto a0 = oi + i / 2;
+                auto a1 = oi + (i + si) / 2;
+                auto b0 = oj + j / 2;
+                auto b1 = oj + (j + sj) / 2;
+
+                for (int k = 0; k < nf; ++k)
+                {
+                    res(i - i0, j - j0, k) = ((A(a0, b0, k) + A(a0, b1, k)) + (A(a1, b0, k) + A(a1, b1, k))) * 0.25;
+                }
+            }
+        }
+        return res;
+    }
+
+    auto sample = [&] (int a, int b, int k)
+    {
+        auto I = std::min(a / ni, 1);
+        auto J = std::min(b / nj, 1);
+        auto n = I * 2 + J;
+        return (*source.data[n])(a - I * ni - source.origin_i[n], b - J * nj - source.origin_j[n], k);
+    };
+
+    for (int i = i0; i < i1; ++i)
+    {
+        for (int j = j0; j < j1; ++j)
+        {
+            auto a0 = 2 * i;
+            auto a1 = 2 * i + 1 - si;
+            auto b0 = 2 * j;
+            auto b1 = 2 * j + 1 - sj;
+
+            for (int k = 0; k < nf; ++k)
+            {
+                res(i - i0, j - j0, k) = ((sample(a0, b0, k) + sample(a0, b1, k)) + (sample(a1, b0, k) + sample(a1, b1, k))) * 0.25;
+            }
+        }
+    }
+    return res;
+}
+
+nd::array<double, 3> Database::restrict_volume_weighted(const Source& source, int i0, int i1, int j0, int j1) const
+{
+    auto volumes = std::array<const Array*, 4>{{nullptr, nullptr, nullptr, nullptr}};
+
+    for (int n = 0; n < 4; ++n)
+    {
+        if (source.ranks[n] != -1)
+        {
+            throw std::logic_error("volume-weighted restriction requires locally stored children");
+        }
+        auto index = source.parts[n];
+        std::get<3>(index) = Field::cell_volume;
+        volumes[n] = &patches.at(index);
+    }
+
+    auto nf = num_fields(source.parts[0]);
+    auto res = allocate(i1 - i0, j1 - j0, nf);
+
+    for (int i = i0; i < i1; ++i)
+    {
+        for (int j = j0; j < j1; ++j)
+        {
+            auto I = (2 * i) / ni;
+            auto J = (2 * j) / nj;
+            auto n = I * 2 + J;
+            auto r = 2 * i - I * ni;
+            auto s = 2 * j - J * nj;
+            const auto& C = *source.data[n];
+            const auto& V = *volumes[n];
+            auto v = V(r + 0, s + 0, 0) + V(r + 0, s + 1, 0) + V(r + 1, s + 0, 0) + V(r + 1, s + 1, 0);
+
+            for (int k = 0; k < nf; ++k)
+            {
+                res(i - i0, j - j0, k) = (
+                    C(r + 0, s + 0, k) * V(r + 0, s + 0, 0) +
+                    C(r + 0, s + 1, k) * V(r + 0, s + 1, 0) +
+                    C(r + 1, s + 0, k) * V(r + 1, s + 0, 0) +
+                    C(r + 1, s + 1, k) * V(r + 1, s + 1, 0)) / v;
+            }
+        }
+    }
+    return res;
+}
+
+nd::array<double, 3> Database::prolong_custom(const Source& source, int i0, int i1, int j0, int j1) const
+{
+    if (source.ranks[0] != -1)
+    {
+        throw std::logic_error("user-defined prolongation requires a locally stored coarse patch");
+    }
+    auto _ = nd::axis::all();
+    const auto& A = *source.data[0];
+    auto field_layout = layout(source.parts[0]);
+    auto fine = to_stored(operators_for(std::get<3>(source.parts[0])).custom_prolongation(from_stored(A, field_layout), source.quadrant_i, source.quadrant_j), field_layout);
+
+    if (fine.shape() != std::array<int, 3>{ni + source.stagger_i, nj + source.stagger_j, A.shape(2)})
+    {
+        throw std::invalid_argument("user-defined prolongation returned the wrong shape");
+    }
+    return fine.select(_|i0|i1, _|j0|j1, _);
+}
+
+nd::array<double, 3> Database::restrict_custom(const Source& source, int i0, int i1, int j0, int j1) const
+{
+    if (source.is_remote())
+    {
+        throw std::logic_error("user-defined restriction requires locally stored children");
+    }
+    auto _ = nd::axis::all();
+    auto si = source.stagger_i;
+    auto sj = source.stagger_j;
+    auto nf = num_fields(source.parts[0]);
+    auto fine = nd::array<double, 3>(ni * 2 + si, nj * 2 + sj, nf);
+
+    fine.select(_|0 |ni*1+si, _|0 |nj*1+sj, _) = *source.data[0];
+    fine.select(_|0 |ni*1+si, _|nj|nj*2+sj, _) = *source.data[1];
+    fine.select(_|ni|ni*2+si, _|0 |nj*1+sj, _) = *source.data[2];
+    fine.select(_|ni|ni*2+si, _|nj|nj*2+sj, _) = *source.data[3];
+
+    auto field_layout = layout(source.parts[0]);
+    auto coarse = to_stored(operators_for(std::get<3>(source.parts[0])).custom_restriction(from_stored(fine, field_layout)), field_layout);
+
+    if (coarse.shape() != std::array<int, 3>{ni + si, nj + sj, nf})
+    {
+        throw std::invalid_argument("user-defined restriction returned the wrong shape");
+    }
+    return coarse.select(_|i0|i1, _|j0|j1, _);
+}
+
+nd::array<double, 3> Database::quadrant(const nd::array<double, 3>& A, int I, int J) const
+{
+    auto _ = nd::axis::all();
+
+    if (I == 0 && J == 0) return A.select(_|0 |ni/2, _|0 |nj/2, _);
+    if (I == 0 && J == 1) return A.select(_|0 |ni/2, _|nj/2|nj, _);
+    if (I == 1 && J == 0) return A.select(_|ni/2|ni, _|0 |nj/2, _);
+    if (I == 1 && J == 1) return A.select(_|ni/2|ni, _|nj/2|nj, _);
+
+    throw std::invalid_argument("quadrant: I and J must be 0 or 1");
+}
 
 nd::array<double, 3> Database::tile(std::array<Index, 4> indexes) const
 {
-    auto _ = nd::axis::all();
-    nd::array<double, 3> res(ni * 2, nj * 2, num_fields(indexes[0]));
+    auto _ = nd::axis::all();
+    auto res = allocate(ni * 2, nj * 2, num_fields(indexes[0]));
+
+    res.select(_|0 |ni*1, _|0 |nj*1, _) = patches.at(indexes[0]);
+    res.select(_|0 |ni*1, _|nj|nj*2, _) = patches.at(indexes[1]);
+    res.select(_|ni|ni*2, _|0 |nj*1, _) = patches.at(indexes[2]);
+    res.select(_|ni|ni*2, _|nj|nj*2, _) = patches.at(indexes[3]);
+
+    return res;
+}
+
+nd::array<double, 3> Database::prolongation(const nd::array<double, 3>& A) const
+{
+    auto _ = nd::axis::all();
+    auto res = allocate(ni, nj, A.shape(2));
+
+    res.select(_|0|ni|2, _|0|nj|2, _) = A;
+    res.select(_|0|ni|2, _|1|nj|2, _) = A;
+    res.select(_|1|ni|2, _|0|nj|2, _) = A;
+    res.select(_|1|ni|2, _|1|nj|2, _) = A;
+
+    return res;
+}
+
+nd::array<double, 3> Database::restriction(const nd::array<double, 3>& A) const
+{
+    auto _ = nd::axis::all();
+    auto mi = A.shape(0);
+    auto mj = A.shape(1);
+
+    auto B = std::array<nd::array<double, 3>, 4>
+    {
+        A.select(_|0|mi|2, _|0|mj|2, _),
+        A.select(_|0|mi|2, _|1|mj|2, _),
+        A.select(_|1|mi|2, _|0|mj|2, _),
+        A.select(_|1|mi|2, _|1|mj|2, _),
+    };
+    return (B[0] + B[1] + B[2] + B[3]) * 0.25;
+}
+
+std::shared_ptr<const Database::SummaryCache::Entry> Database::summarize(Index index) const
+{
+    // ------------------------------------------------------------------------
+    // Return the summary of a stored or frozen patch, from the cache if it is
+    // current. The mipmaps are only built for the fields which keep
+    // summaries; for the others the reductions are computed each time.
+    // ------------------------------------------------------------------------
+    if (! patches.count(index) && ! frozen.count(index))
+    {
+        throw std::out_of_range("no patch at index " + to_string(index));
+    }
+    auto version = versions.at(index);
+    auto cached = false;
+
+    {
+        std::lock_guard<std::mutex> lock(summary_cache.mutex);
+        cached = summary_cache.fields.count(std::get<3>(index));
+        auto it = summary_cache.entries.find(index);
+
+        if (cached && it != summary_cache.entries.end() && it->second->version == version)
+        {
+            return it->second;
+        }
+    }
+
+    auto entry = std::make_shared<SummaryCache::Entry>();
+    auto data = patches.count(index) ? patches.at(index) : decompress(frozen.at(index));
+    auto view = make_view(data);
+    auto nf = data.shape(2);
+
+    entry->version = version;
+    entry->summary = empty_summary(nf);
+    entry->summary.count = std::size_t(data.shape(0)) * data.shape(1);
+
+    for (int i = 0; i < view.shape(0); ++i)
+    {
+        for (int j = 0; j < view.shape(1); ++j)
+        {
+            for (int k = 0; k < nf; ++k)
+            {
+                auto x = view(i, j, k);
+                entry->summary.min[k] = std::min(entry->summary.min[k], x);
+                entry->summary.max[k] = std::max(entry->summary.max[k], x);
+                entry->summary.sum[k] += x;
+            }
+        }
+    }
+
+    if (cached && location(index) == MeshLocation::cell)
+    {
+        for (int factor = 2; ni % factor == 0 && nj % factor == 0; factor *= 2)
+        {
+            entry->mipmaps.push_back(average_cells(entry->mipmaps.empty() ? data : entry->mipmaps.back()));
+        }
+    }
+
+    if (cached)
+    {
+        std::lock_guard<std::mutex> lock(summary_cache.mutex);
+        summary_cache.entries[index] = entry;
+    }
+    return entry;
+}
+
+Database::Array Database::downsample(Index index, int factor, int deepest) const
+{
+    // ------------------------------------------------------------------------
+    // Return the block at the given index averaged by the given factor, in
+    // the stored layout. A block which is not stored is tiled from its
+    // children, reduced by twice the factor if that still divides the block
+    // size, or else by the same factor and averaged once more. The mipmaps
+    // are only used (and summarize only called) if the field keeps
+    // summaries.
+    // ------------------------------------------------------------------------
+    if (patches.count(index) || frozen.count(index))
+    {
+        if (factor == 1)
+        {
+            return patches.count(index) ? patches.at(index) : decompress(frozen.at(index));
+        }
+        auto cached = false;
+        {
+            std::lock_guard<std::mutex> lock(summary_cache.mutex);
+            cached = summary_cache.fields.count(std::get<3>(index));
+        }
+        auto entry = cached ? summarize(index) : nullptr;
+
+        if (entry && ! entry->mipmaps.empty())
+        {
+            auto n = 0;
+
+            while ((2 << n) < factor)
+            {
+                ++n;
+            }
+            return entry->mipmaps[n];
+        }
+        auto res = average_cells(patches.count(index) ? patches.at(index) : decompress(frozen.at(index)));
+
+        for (int f = 2; f < factor; f *= 2)
+        {
+            res.become(average_cells(res));
+        }
+        return res;
+    }
+
+    if (std::get<2>(index) >= deepest)
+    {
+        throw std::out_of_range("assemble: block " + to_string(index) + " is neither stored nor covered by finer patches");
+    }
+    auto _ = nd::axis::all();
+    auto finer = ni % (2 * factor) == 0 && nj % (2 * factor) == 0 ? 2 * factor : factor;
+    auto mi = ni / finer;
+    auto mj = nj / finer;
+    auto children = refine(index);
+    auto res = nd::array<double, 3>(2 * mi, 2 * mj, num_fields(index));
+
+    res.select(_|0 |mi*1, _|0 |mj*1, _) = downsample(children[0], finer, deepest);
+    res.select(_|0 |mi*1, _|mj|mj*2, _) = downsample(children[1], finer, deepest);
+    res.select(_|mi|mi*2, _|0 |mj*1, _) = downsample(children[2], finer, deepest);
+    res.select(_|mi|mi*2, _|mj|mj*2, _) = downsample(children[3], finer, deepest);
+
+    return finer == factor ? average_cells(res) : res;
+}
+
+std::array<int, 2> Database::window_shape(int i0, int i1, int j0, int j1, int stride) const
+{
+    if (i0 < 0 || j0 < 0 || i1 <= i0 || j1 <= j0)
+    {
+        throw std::invalid_argument("assemble: the window must be non-empty, with non-negative lower bounds");
+    }
+    if (stride < 1)
+    {
+        throw std::invalid_argument("assemble: the stride must be positive");
+    }
+    return {(i1 - i0 + stride - 1) / stride, (j1 - j0 + stride - 1) / stride};
+}
+
+namespace {
+
+    struct WindowRun
+    {
+        int block;
+        int local;
+        int start;
+        int count;
+    };
+
+    // ------------------------------------------------------------------------
+    // Split the output range [p0, p1) along one axis of a window beginning at
+    // x0, and ending (exclusively) at x1, into runs of elements read from the
+    // same block. A shared element at the high edge of the window, which has
+    // no block beyond it in the window, is read from the block below it.
+    // ------------------------------------------------------------------------
+    std::vector<WindowRun> window_runs(int x0, int x1, int stride, int n, int stagger, int p0, int p1)
+    {
+        auto runs = std::vector<WindowRun>();
+        auto p = p0;
+
+        while (p < p1)
+        {
+            auto x = x0 + p * stride;
+
+            if (stagger && x == x1 - 1 && x % n == 0 && x > 0)
+            {
+                runs.push_back({x / n - 1, n, p, 1});
+                ++p;
+                continue;
+            }
+            auto block = x / n;
+            auto end = std::min(p1, p + ((block + 1) * n - x + stride - 1) / stride);
+            runs.push_back({block, x % n, p, end - p});
+            p = end;
+        }
+        return runs;
+    }
+}
+
+void Database::assemble_pieces(int i0, int i1, int j0, int j1, int level, Field field, int stride, std::array<int, 4> range, const std::function<void(int, int, View)>& emit) const
+{
+    // ------------------------------------------------------------------------
+    // Emit views of the parts of each patch which make up the elements
+    // [range[0], range[1]) x [range[2], range[3]) of a (strided) window, and
+    // their offsets in it. The views are in the stored layout, and sample
+    // every stride-th element through their strides, so nothing is copied.
+    // ------------------------------------------------------------------------
+    auto where = header.at(field).location;
+    auto si = where == MeshLocation::vert || where == MeshLocation::face_i;
+    auto sj = where == MeshLocation::vert || where == MeshLocation::face_j;
+
+    for (const auto& a : window_runs(i0, i1, stride, ni, si, range[0], range[1]))
+    {
+        for (const auto& b : window_runs(j0, j1, stride, nj, sj, range[2], range[3]))
+        {
+            auto patch = make_view(patches.at(std::make_tuple(a.block, b.block, level, field)));
+            auto strides = patch.strides();
+            emit(a.start, b.start, View(&patch(a.local, b.local, 0), {a.count, b.count, patch.shape(2)}, {strides[0] * stride, strides[1] * stride, strides[2]}));
+        }
+    }
+}
+
+std::vector<Database::Index> Database::indexes(Field which) const
+{
+    auto res = std::vector<Index>();
+
+    for (const auto& patch : patches)
+    {
+        if (std::get<3>(patch.first) == which)
+        {
+            res.push_back(patch.first);
+        }
+    }
+    return res;
+}
+
+Database::Array Database::allocate(int ni, int nj, int nf) const
+{
+    if (array_pool)
+    {
+        return array_pool->acquire({ni, nj, nf});
+    }
+    PATCHES_PROFILE_ALLOCATION();
+    return Array(ni, nj, nf);
+}
+
+void Database::recycle(const Source& source, Array array) const
+{
+    // ------------------------------------------------------------------------
+    // Only the arrays which locate computes from coarse or fine data are
+    // temporaries owned here; same-level data is a view of the neighbor, and
+    // user-defined operators may return views of their own arrays.
+    // ------------------------------------------------------------------------
+    if (! array_pool)
+    {
+        return;
+    }
+    const auto& ops = operators_for(std::get<3>(source.parts[0]));
+
+    if ((source.kind == Source::Kind::coarse && ! ops.custom_prolongation) ||
+        (source.kind == Source::Kind::fine && ! ops.custom_restriction))
+    {
+        array_pool->release(array);
+    }
+}
+
+void Database::parallel_for(std::size_t count, std::function<void(std::size_t)> fn) const
+{
+    if (thread_pool)
+    {
+        thread_pool->run(count, fn);
+    }
+    else
+    {
+        for (std::size_t n = 0; n < count; ++n)
+        {
+            fn(n);
+        }
+    }
+}
+
+
+
+
+// ============================================================================
+ArrayPool::ArrayPool(std::size_t max_per_shape) : max_per_shape(max_per_shape)
+{
+}
+
+nd::array<double, 3> ArrayPool::acquire(std::array<int, 3> shape)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = cache.find(shape);
+
+        if (it != cache.end() && ! it->second.empty())
+        {
+            auto array = it->second.back();
+            it->second.pop_back();
+            return array;
+        }
+        ++num_allocations;
+    }
+    PATCHES_PROFILE_ALLOCATION();
+    return nd::array<double, 3>(shape);
+}
+
+void ArrayPool::release(nd::array<double, 3> array)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    auto& arrays = cache[array.shape()];
+
+    if (arrays.size() < max_per_shape)
+    {
+        arrays.push_back(array);
+    }
+}
+
+void ArrayPool::clear()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    cache.clear();
+}
+
+std::size_t ArrayPool::size() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    auto count = std::size_t(0);
+
+    for (const auto& arrays : cache)
+    {
+        count += arrays.second.size();
+    }
+    return count;
+}
+
+std::size_t ArrayPool::allocations() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return num_allocations;
+}
+
+
+
+
+// ============================================================================
+void patches2d::run_guard_program(const Database::GuardProgram& program, const double* patches, const double* staging, double* padded, std::shared_ptr<ThreadPool> pool)
+{
+    // ------------------------------------------------------------------------
+    // Find where the tasks of each target begin, then run the targets
+    // independently, each with its tasks in order. The prolong and restrict
+    // tasks go through the row kernels, as fetch does.
+    // ------------------------------------------------------------------------
+    using Kind = Database::GuardProgram::Task::Kind;
+    auto nf = program.shape[2];
+    auto interior = std::size_t(program.shape[0]) * program.shape[1] * nf;
+    auto outer = std::size_t(program.padded[0]) * program.padded[1] * nf;
+    auto first = std::vector<std::size_t>(program.patches.size() + 1, program.tasks.size());
+
+    for (std::size_t n = program.tasks.size(); n > 0; --n)
+    {
+        first[program.tasks[n - 1].target] = n - 1;
+    }
+    for (std::size_t t = program.patches.size(); t > 0; --t)
+    {
+        first[t - 1] = std::min(first[t - 1], first[t]);
+    }
+
+    auto run_target = [&] (std::size_t t)
+    {
+        for (auto n = first[t]; n < first[t + 1]; ++n)
+        {
+            const auto& task = program.tasks[n];
+            auto src = task.source >= 0 ? patches + task.source * interior : nullptr;
+            auto dst = padded + task.target * outer;
+            auto mi = task.i1 - task.i0;
+            auto mj = task.j1 - task.j0;
+            auto row_size = program.shape[1] * nf;
+
+            for (int a = 0; a < mi; ++a)
+            {
+                auto out = dst + (std::size_t(task.di + a) * program.padded[1] + task.dj) * nf;
+
+                switch (task.kind)
+                {
+                    case Kind::copy:
+                    {
+                        auto in = src + (std::size_t(task.i0 + a) * program.shape[1] + task.j0) * nf;
+                        std::copy(in, in + mj * nf, out);
+                        break;
+                    }
+                    case Kind::prolong:
+                    {
+                        auto in = src + (std::size_t(task.i0 + a) / 2 * program.shape[1] + task.j0 / 2) * nf;
+                        prolong_row(in, out, task.j0, task.j1, nf);
+                        break;
+                    }
+                    case Kind::restrict:
+                    {
+                        auto r0 = src + (std::size_t(2 * (task.i0 + a)) * program.shape[1] + 2 * task.j0) * nf;
+                        restrict_row(r0, r0 + row_size, out, mj, nf);
+                        break;
+                    }
+                    case Kind::stage:
+                    {
+                        auto in = staging + task.offset + std::size_t(a) * mj * nf;
+                        std::copy(in, in + mj * nf, out);
+                        break;
+                    }
+                }
+            }
+        }
+    };
+
+    if (pool)
+    {
+        pool->run(program.patches.size(), run_target);
+    }
+    else
+    {
+        for (std::size_t t = 0; t < program.patches.size(); ++t)
+        {
+            run_target(t);
+        }
+    }
+}
+
+
+
+
+// ============================================================================
+// The level scheduler works with block indexes through the public interface
+// of the database. As in Database::coarsen, the parent of a block is found
+// by floor division, so that blocks off the low edges of the domain have no
+// parent.
+// ============================================================================
+namespace {
+
+    const std::array<PatchBoundary, 8> all_boundaries = {{
+        PatchBoundary::il,
+        PatchBoundary::ir,
+        PatchBoundary::jl,
+        PatchBoundary::jr,
+        PatchBoundary::il_jl,
+        PatchBoundary::il_jr,
+        PatchBoundary::ir_jl,
+        PatchBoundary::ir_jr,
+    }};
+
+    Database::Index coarser_neighbor(Database::Index index, PatchBoundary edge)
+    {
+        auto di = 0;
+        auto dj = 0;
+
+        switch (edge)
+        {
+            case PatchBoundary::il:    di = -1; break;
+            case PatchBoundary::ir:    di = +1; break;
+            case PatchBoundary::jl:    dj = -1; break;
+            case PatchBoundary::jr:    dj = +1; break;
+            case PatchBoundary::il_jl: di = -1; dj = -1; break;
+            case PatchBoundary::il_jr: di = -1; dj = +1; break;
+            case PatchBoundary::ir_jl: di = +1; dj = -1; break;
+            case PatchBoundary::ir_jr: di = +1; dj = +1; break;
+        }
+        return std::make_tuple(
+            (std::get<0>(index) + di) >> 1,
+            (std::get<1>(index) + dj) >> 1,
+            std::get<2>(index) - 1,
+            std::get<3>(index));
+    }
+
+    Database::Index same_level_neighbor(Database::Index index, PatchBoundary edge)
+    {
+        switch (edge)
+        {
+            case PatchBoundary::il: std::get<0>(index) -= 1; break;
+            case PatchBoundary::ir: std::get<0>(index) += 1; break;
+            case PatchBoundary::jl: std::get<1>(index) -= 1; break;
+            case PatchBoundary::jr: std::get<1>(index) += 1; break;
+            default: throw std::logic_error("same_level_neighbor: edges only");
+        }
+        return index;
+    }
+}
+
+LevelScheduler::LevelScheduler(Database& database, Field which, Step step)
+: database(database)
+, which(which)
+, step(step)
+{
+}
+
+void LevelScheduler::advance(double dt)
+{
+    levels.clear();
+    present.clear();
+    registers.clear();
+
+    for (const auto& patch : database)
+    {
+        if (std::get<3>(patch.first) == which)
+        {
+            levels[std::get<2>(patch.first)].push_back(patch.first);
+            present.insert(patch.first);
+        }
+    }
+    if (! levels.empty())
+    {
+        advance_level(levels.begin()->first, current_time, dt);
+    }
+    current_time += dt;
+}
+
+std::size_t LevelScheduler::num_steps(int level) const
+{
+    return step_counts.count(level) ? step_counts.at(level) : 0;
+}
+
+void LevelScheduler::advance_level(int level, double time, double dt)
+{
+    // ------------------------------------------------------------------------
+    // Keep the data of the patches at this level which border the next finer
+    // one from before and after this step. While the finer level takes its
+    // two steps, those patches hold the data interpolated to the time each
+    // fine step begins: commit(before, theta) on top of the data after the
+    // step gives before * (1 - theta) + after * theta. Levels between the
+    // coarsest and finest may be empty, and are stepped over.
+    // ------------------------------------------------------------------------
+    auto finer = level < levels.rbegin()->first;
+    auto coarse = finer ? bordering(level + 1) : std::vector<Index>();
+    auto before = std::vector<Database::Array>();
+    auto after = std::vector<Database::Array>();
+
+    for (const auto& index : coarse)
+    {
+        before.push_back(database.at(index).copy());
+    }
+
+    if (levels.count(level))
+    {
+        step(level, time, dt, levels.at(level));
+        ++step_counts[level];
+    }
+
+    if (! finer)
+    {
+        return;
+    }
+
+    for (const auto& index : coarse)
+    {
+        after.push_back(database.at(index).copy());
+    }
+
+    for (int n = 0; n < 2; ++n)
+    {
+        for (std::size_t m = 0; m < coarse.size(); ++m)
+        {
+            database.commit_stored(coarse[m], Database::make_view(after[m]));
+            database.commit_stored(coarse[m], Database::make_view(before[m]), 0.5 * n);
+        }
+        advance_level(level + 1, time + 0.5 * n * dt, 0.5 * dt);
+        record_fluxes(level + 1);
+    }
+
+    for (std::size_t m = 0; m < coarse.size(); ++m)
+    {
+        database.commit_stored(coarse[m], Database::make_view(after[m]));
+    }
+    reflux(level + 1);
+}
+
+void LevelScheduler::record_fluxes(int level)
+{
+    // ------------------------------------------------------------------------
+    // Add the fluxes through each face of a patch at this level which borders
+    // a coarser patch to its register: one row of the flux_i or flux_j patch,
+    // summed over both fine steps.
+    // ------------------------------------------------------------------------
+    if (! has_flux_registers() || ! levels.count(level))
+    {
+        return;
+    }
+    auto _ = nd::axis::all();
+
+    for (const auto& index : levels.at(level))
+    {
+        for (auto edge : {PatchBoundary::il, PatchBoundary::ir, PatchBoundary::jl, PatchBoundary::jr})
+        {
+            if (present.count(same_level_neighbor(index, edge)) || ! present.count(coarser_neighbor(index, edge)))
+            {
+                continue;
+            }
+            auto face = nd::array<double, 3>();
+
+            switch (edge)
+            {
+                case PatchBoundary::il: face = database.at(index, Field::flux_i).select(_|0|1, _, _); break;
+                case PatchBoundary::jl: face = database.at(index, Field::flux_j).select(_, _|0|1, _); break;
+                case PatchBoundary::ir:
+                {
+                    const auto& flux = database.at(index, Field::flux_i);
+                    face = flux.select(_|flux.shape(0) - 1|flux.shape(0), _, _);
+                    break;
+                }
+                case PatchBoundary::jr:
+                {
+                    const auto& flux = database.at(index, Field::flux_j);
+                    face = flux.select(_, _|flux.shape(1) - 1|flux.shape(1), _);
+                    break;
+                }
+                default: break;
+            }
+            auto key = std::make_pair(index, edge);
+            auto reg = registers.find(key);
+
+            if (reg == registers.end())
+            {
+                registers.emplace(key, face.copy());
+                continue;
+            }
+            for (int i = 0; i < face.shape(0); ++i)
+            {
+                for (int j = 0; j < face.shape(1); ++j)
+                {
+                    for (int q = 0; q < face.shape(2); ++q)
+                    {
+                        reg->second(i, j, q) += face(i, j, q);
+                    }
+                }
+            }
+        }
+    }
+}
+
+void LevelScheduler::reflux(int level)
+{
+    // ------------------------------------------------------------------------
+    // Each fine register covers half of a coarse patch's face, starting at
+    // offset along it. The coarse cell beside that face is to its left across
+    // a fine il or jl face, in which case the coarse step removed the coarse
+    // flux from it (sign = +1 restores what the fine fluxes removed
+    // instead), and to its right otherwise. The corrections to each coarse
+    // patch are gathered and committed once.
+    // ------------------------------------------------------------------------
+    auto corrected = std::map<Index, Database::Array>();
+
+    for (auto it = registers.begin(); it != registers.end();)
+    {
+        auto index = it->first.first;
+        auto edge = it->first.second;
+
+        if (std::get<2>(index) != level)
+        {
+            ++it;
+            continue;
+        }
+        auto target = coarser_neighbor(index, edge);
+        auto along_i = edge == PatchBoundary::jl || edge == PatchBoundary::jr;
+        const auto& reg = it->second;
+        const auto& flux = database.at(target, along_i ? Field::flux_j : Field::flux_i);
+        const auto& volume = database.at(target, Field::cell_volume);
+
+        if (! corrected.count(target))
+        {
+            corrected.emplace(target, database.at(target).copy());
+        }
+        auto& u = corrected.at(target);
+        auto n_normal = along_i ? u.shape(1) : u.shape(0);
+        auto n_along = along_i ? u.shape(0) : u.shape(1);
+        auto left = edge == PatchBoundary::il || edge == PatchBoundary::jl;
+        auto sign = left ? 1.0 : -1.0;
+        auto cell = left ? n_normal - 1 : 0;
+        auto face = left ? n_normal : 0;
+        auto offset = ((along_i ? std::get<0>(index) : std::get<1>(index)) & 1) * n_along / 2;
+
+        auto element = [along_i] (const nd::array<double, 3>& a, int normal, int along, int q)
+        {
+            return along_i ? a(along, normal, q) : a(normal, along, q);
+        };
+
+        for (int k = 0; k < n_along / 2; ++k)
+        {
+            auto a = along_i ? offset + k : cell;
+            auto b = along_i ? cell : offset + k;
+
+            for (int q = 0; q < u.shape(2); ++q)
+            {
+                auto fine = element(reg, 0, 2 * k, q) + element(reg, 0, 2 * k + 1, q);
+                auto coarse = element(flux, face, offset + k, q);
+                u(a, b, q) += sign * (coarse - fine) / volume(a, b, 0);
+            }
+        }
+        it = registers.erase(it);
+    }
+
+    for (const auto& patch : corrected)
+    {
+        database.commit_stored(patch.first, Database::make_view(patch.second));
+    }
+}
+
+std::vector<Database::Index> LevelScheduler::bordering(int level) const
+{
+    auto res = std::set<Index>();
+
+    if (levels.count(level))
+    {
+        for (const auto& index : levels.at(level))
+        {
+            for (auto edge : all_boundaries)
+            {
+                auto coarse = coarser_neighbor(index, edge);
+
+                if (present.count(coarse))
+                {
+                    res.insert(coarse);
+                }
+            }
+        }
+    }
+    return std::vector<Index>(res.begin(), res.end());
+}
+
+bool LevelScheduler::has_flux_registers() const
+{
+    return database.count(Field::flux_i) && database.count(Field::flux_j);
+}
+
+
+
+
+// ============================================================================
+// Space-filling curve keys. A block at level l is the square of cells
+// [i, i + 1) x [j, j + 1) scaled by 2^(20 - l) at level 20, so its position
+// along a curve of order 8 + l, shifted up by 2 (20 - l) bits, is the
+// position of its first cell at level 20. The Hilbert position is computed
+// from the most significant bit down, so that the top bits of a cell's
+// position are those of the blocks containing it.
+// ============================================================================
+namespace {
+
+    const int max_curve_level = 20;
+    const int root_curve_bits = 8;
+
+    void check_curve_index(int i, int j, int level)
+    {
+        auto bits = root_curve_bits + level;
+
+        if (level < 0 || level > max_curve_level || i < 0 || j < 0 || i >> bits || j >> bits)
+        {
+            throw std::invalid_argument("block " + std::to_string(level) + "." + std::to_string(i) + "-" + std::to_string(j)
+                + " is out of range for a space-filling curve");
+        }
+    }
+
+    std::uint64_t spread_bits(std::uint64_t x)
+    {
+        x = (x | (x << 16)) & 0x0000FFFF0000FFFFull;
+        x = (x | (x <<  8)) & 0x00FF00FF00FF00FFull;
+        x = (x | (x <<  4)) & 0x0F0F0F0F0F0F0F0Full;
+        x = (x | (x <<  2)) & 0x3333333333333333ull;
+        x = (x | (x <<  1)) & 0x5555555555555555ull;
+        return x;
+    }
+
+    std::uint64_t curve_key(std::uint64_t position, int level)
+    {
+        return (position << 2 * (max_curve_level - level)) << 8 | std::uint64_t(level);
+    }
+
+    using Block = std::tuple<int, int, int>;
+
+    Block block_of(Database::Index index)
+    {
+        return Block(std::get<0>(index), std::get<1>(index), std::get<2>(index));
+    }
+
+    /**
+     * Sum the costs of the patches in each block, and return the blocks
+     * ordered as the database would visit them.
+     */
+    std::vector<std::pair<Block, double>> ordered_blocks(const std::map<Database::Index, double>& costs, Ordering ordering)
+    {
+        auto blocks = std::map<Block, double>();
+
+        for (const auto& cost : costs)
+        {
+            if (cost.second < 0.0)
+            {
+                throw std::invalid_argument("the cost of patch " + to_string(cost.first) + " is negative");
+            }
+            blocks[block_of(cost.first)] += cost.second;
+        }
+        auto res = std::vector<std::pair<Block, double>>(blocks.begin(), blocks.end());
+
+        if (ordering != Ordering::index)
+        {
+            auto key = ordering == Ordering::morton ? morton_key : hilbert_key;
+            auto keys = std::map<Block, std::uint64_t>();
+
+            for (const auto& block : res)
+            {
+                keys[block.first] = key(std::get<0>(block.first), std::get<1>(block.first), std::get<2>(block.first));
+            }
+            std::sort(res.begin(), res.end(), [&keys] (const auto& a, const auto& b)
+            {
+                return keys.at(a.first) < keys.at(b.first);
+            });
+        }
+        return res;
+    }
+
+    std::map<Database::Index, int> parts_of_patches(const std::map<Database::Index, double>& costs, const std::map<Block, int>& parts)
+    {
+        auto res = std::map<Database::Index, int>();
+
+        for (const auto& cost : costs)
+        {
+            res[cost.first] = parts.at(block_of(cost.first));
+        }
+        return res;
+    }
+}
+
+std::uint64_t patches2d::morton_key(int i, int j, int level)
+{
+    check_curve_index(i, j, level);
+    return curve_key(spread_bits(std::uint64_t(i)) << 1 | spread_bits(std::uint64_t(j)), level);
+}
+
+std::uint64_t patches2d::hilbert_key(int i, int j, int level)
+{
+    check_curve_index(i, j, level);
+
+    auto bits = root_curve_bits + level;
+    auto mask = (std::uint64_t(1) << bits) - 1;
+    auto x = std::uint64_t(i);
+    auto y = std::uint64_t(j);
+    auto d = std::uint64_t(0);
+
+    for (int b = bits - 1; b >= 0; --b)
+    {
+        auto rx = (x >> b) & 1;
+        auto ry = (y >> b) & 1;
+        d |= ((3 * rx) ^ ry) << (2 * b);
+
+        if (ry == 0)
+        {
+            if (rx == 1)
+            {
+                x = mask - x;
+                y = mask - y;
+            }
+            std::swap(x, y);
+        }
+    }
+    return curve_key(d, level);
+}
+
+const int PatchKey::max_level;
+const int PatchKey::max_coordinate;
+const int PatchKey::field_bits;
+const int PatchKey::level_shift;
+const std::uint64_t PatchKey::field_mask;
+const std::uint64_t PatchKey::j_mask;
+const std::uint64_t PatchKey::i_mask;
+const std::uint64_t PatchKey::position_mask;
+
+PatchKey::PatchKey(int i, int j, int level, Field field)
+{
+    if (level < 0 || level > max_level || i < 0 || j < 0 || i > max_coordinate || j > max_coordinate)
+    {
+        throw std::invalid_argument("block " + std::to_string(level) + "." + std::to_string(i) + "-" + std::to_string(j)
+            + " is out of range for a patch key");
+    }
+    auto position = spread_bits(std::uint64_t(i)) << 1 | spread_bits(std::uint64_t(j));
+    packed = std::uint64_t(level) << level_shift | position << field_bits | std::uint64_t(field);
+}
+
+PatchKey::PatchKey(Database::Index index)
+: PatchKey(std::get<0>(index), std::get<1>(index), std::get<2>(index), std::get<3>(index))
+{
+}
+
+std::map<Database::Index, int> patches2d::partition(const std::map<Database::Index, double>& costs, int num_parts, Ordering ordering)
+{
+    if (num_parts < 1)
+    {
+        throw std::invalid_argument("partition: the number of parts must be positive");
+    }
+    auto blocks = ordered_blocks(costs, ordering);
+    auto total = 0.0;
+
+    for (const auto& block : blocks)
+    {
+        total += block.second;
+    }
+
+    if (total == 0.0)
+    {
+        for (auto& block : blocks)
+        {
+            block.second = 1.0;
+        }
+        total = double(blocks.size());
+    }
+
+    // ------------------------------------------------------------------------
+    // Each block goes to the part in which the midpoint of its cost interval
+    // along the curve falls, so a block straddling a boundary goes to
+    // whichever side holds more of it.
+    // ------------------------------------------------------------------------
+    auto parts = std::map<Block, int>();
+    auto start = 0.0;
+
+    for (const auto& block : blocks)
+    {
+        auto mid = start + 0.5 * block.second;
+        parts[block.first] = std::min(num_parts - 1, int(mid / total * num_parts));
+        start += block.second;
+    }
+    return parts_of_patches(costs, parts);
+}
+
+std::map<Database::Index, int> patches2d::repartition(const std::map<Database::Index, double>& costs, const std::map<Database::Index, int>& previous, int num_parts, double tolerance, Ordering ordering)
+{
+    if (num_parts < 1)
+    {
+        throw std::invalid_argument("repartition: the number of parts must be positive");
+    }
+    auto before = std::map<Block, int>();
+
+    for (const auto& owner : previous)
+    {
+        before[block_of(owner.first)] = owner.second;
+    }
+
+    // ------------------------------------------------------------------------
+    // Inherit the parts: a refined block's children follow the parent, and a
+    // coarsened block follows its first child in the previous partition.
+    // ------------------------------------------------------------------------
+    auto blocks = ordered_blocks(costs, ordering);
+    auto parts = std::map<Block, int>();
+    auto load = std::vector<double>(num_parts, 0.0);
+    auto total = 0.0;
+    auto last = -1;
+
+    for (const auto& block : blocks)
+    {
+        auto i = std::get<0>(block.first);
+        auto j = std::get<1>(block.first);
+        auto l = std::get<2>(block.first);
+        auto found = before.find(block.first);
+
+        if (found == before.end())
+        {
+            found = before.find(Block(i >> 1, j >> 1, l - 1));
+        }
+        for (int n = 0; n < 4 && found == before.end(); ++n)
+        {
+            found = before.find(Block(i * 2 + n / 2, j * 2 + n % 2, l + 1));
+        }
+        auto part = found != before.end() ? found->second : last;
+
+        if (part >= num_parts)
+        {
+            return partition(costs, num_parts, ordering);
+        }
+        parts[block.first] = part;
+        last = part;
+    }
+
+    // ------------------------------------------------------------------------
+    // Blocks before any inherited one take the part of the first block that
+    // has one.
+    // ------------------------------------------------------------------------
+    auto first = 0;
+
+    for (const auto& block : blocks)
+    {
+        if (parts.at(block.first) != -1)
+        {
+            first = parts.at(block.first);
+            break;
+        }
+    }
+
+    for (const auto& block : blocks)
+    {
+        auto& part = parts.at(block.first);
+
+        if (part == -1)
+        {
+            part = first;
+        }
+        load[part] += block.second;
+        total += block.second;
+    }
+
+    if (*std::max_element(load.begin(), load.end()) > (1.0 + tolerance) * total / num_parts)
+    {
+        return partition(costs, num_parts, ordering);
+    }
+    return parts_of_patches(costs, parts);
+}
+
+
+
+
+// ============================================================================
+static thread_local bool is_pool_worker = false;
+static thread_local int pool_run_depth = 0;
+
+ThreadPool::ThreadPool(int num_workers)
+{
+    for (int n = 0; n < num_workers; ++n)
+    {
+        workers.emplace_back([this]
+        {
+            is_pool_worker = true;
+            std::size_t seen = 0;
+
+            while (true)
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [&] { return stop || generation != seen; });
+
+                if (stop)
+                {
+                    return;
+                }
+                seen = generation;
+                ++busy;
+                lock.unlock();
+                work();
+                lock.lock();
+                --busy;
+                done.notify_all();
+            }
+        });
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+    }
+    wake.notify_all();
+
+    for (auto& worker : workers)
+    {
+        worker.join();
+    }
+}
+
+void ThreadPool::run(std::size_t count, std::function<void(std::size_t)> fn)
+{
+    if (workers.empty() || count <= 1 || is_pool_worker || pool_run_depth > 0)
+    {
+        for (std::size_t n = 0; n < count; ++n)
+        {
+            fn(n);
+        }
+        return;
+    }
+
+    // ------------------------------------------------------------------------
+    // The calling thread takes jobs too, so mark it as inside the pool until
+    // this call returns; a job on this thread that calls run again then goes
+    // serial instead of re-locking run_mutex.
+    // ------------------------------------------------------------------------
+    struct DepthGuard
+    {
+        DepthGuard() { ++pool_run_depth; }
+        ~DepthGuard() { --pool_run_depth; }
+    };
+    std::lock_guard<std::mutex> run_lock(run_mutex);
+    DepthGuard depth;
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [&] { return busy == 0; });
+
+    job = fn;
+    job_count = count;
+    next = 0;
+    finished = 0;
+    error = nullptr;
+    ++generation;
+
+    lock.unlock();
+    wake.notify_all();
+    work();
+    lock.lock();
+    done.wait(lock, [&] { return busy == 0 && finished == job_count; });
+    job = nullptr;
+
+    if (error)
+    {
+        std::rethrow_exception(error);
+    }
+}
+
+void ThreadPool::work()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+
+    while (next < job_count)
+    {
+        auto n = next++;
+        lock.unlock();
+
+        try
+        {
+            job(n);
+        }
+        catch (...)
+        {
+            lock.lock();
+            error = error ? error : std::current_exception();
+            lock.unlock();
+        }
+        lock.lock();
+        ++finished;
+    }
+    done.notify_all();
+}
+
+
+
+
+// ============================================================================
+// The encoded form of an array is a fixed-size header (scheme, shape, and
+// tolerance), followed by the payload:
+//
+// none:     the raw doubles.
+// lossless: the bit pattern of each value, XOR'ed with that of the same
+//           component in the previous cell, split into eight planes by byte
+//           significance, then run-length encoded.
+// lossy:    each value rounded to a multiple of the tolerance, the
+//           difference from the same component in the previous cell
+//           zigzag-encoded as a variable-length integer, then run-length
+//           encoded.
+//
+// The run-length code is a series of packets: a control byte c < 128 is
+// followed by c + 1 literal bytes, and c >= 128 by one byte to be repeated
+// c - 126 times.
+// ============================================================================
+namespace {
+
+    struct CodecHeader
+    {
+        std::uint8_t compression;
+        std::int32_t shape[3];
+        double tolerance;
+    };
+
+    void run_length_encode(const std::string& input, std::string& output)
+    {
+        auto n = std::size_t(0);
+
+        while (n < input.size())
+        {
+            auto run = std::size_t(1);
+
+            while (n + run < input.size() && run < 129 && input[n + run] == input[n])
+            {
+                ++run;
+            }
+            if (run >= 3)
+            {
+                output.push_back(char(run + 126));
+                output.push_back(input[n]);
+                n += run;
+                continue;
+            }
+            auto start = n;
+
+            while (n < input.size() && n - start < 128)
+            {
+                if (n + 2 < input.size() && input[n] == input[n + 1] && input[n] == input[n + 2])
+                {
+                    break;
+                }
+                ++n;
+            }
+            output.push_back(char(n - start - 1));
+            output.append(input, start, n - start);
+        }
+    }
+
+    std::string run_length_decode(const char* ptr, const char* end)
+    {
+        auto output = std::string();
+
+        while (ptr < end)
+        {
+            auto c = std::uint8_t(*ptr++);
+
+            if (c < 128)
+            {
+                if (end - ptr < c + 1)
+                {
+                    throw std::runtime_error("corrupt compressed array");
+                }
+                output.append(ptr, c + 1);
+                ptr += c + 1;
+            }
+            else
+            {
+                if (ptr == end)
+                {
+                    throw std::runtime_error("corrupt compressed array");
+                }
+                output.append(c - 126, *ptr++);
+            }
+        }
+        return output;
+    }
+
+    std::uint64_t bits_of(double x)
+    {
+        auto b = std::uint64_t();
+        std::memcpy(&b, &x, sizeof(double));
+        return b;
+    }
+
+    double from_bits(std::uint64_t b)
+    {
+        auto x = double();
+        std::memcpy(&x, &b, sizeof(double));
+        return x;
+    }
+}
+
+std::string patches2d::compress(const nd::array<double, 3>& data, Compression compression, double tolerance)
+{
+    auto shape = data.shape();
+    auto nf = std::size_t(shape[2]);
+    auto count = std::size_t(data.size());
+    auto values = std::vector<double>(count);
+    auto m = std::size_t(0);
+
+    for (int i = 0; i < shape[0]; ++i)
+    {
+        for (int j = 0; j < shape[1]; ++j)
+        {
+            for (int k = 0; k < shape[2]; ++k)
+            {
+                values[m++] = data(i, j, k);
+            }
+        }
+    }
+
+    auto header = CodecHeader();
+    header.compression = std::uint8_t(compression);
+    header.shape[0] = shape[0];
+    header.shape[1] = shape[1];
+    header.shape[2] = shape[2];
+    header.tolerance = tolerance;
+
+    auto res = std::string(reinterpret_cast<const char*>(&header), sizeof(CodecHeader));
+
+    switch (compression)
+    {
+        case Compression::none:
+        {
+            res.append(reinterpret_cast<const char*>(values.data()), count * sizeof(double));
+            return res;
+        }
+        case Compression::lossless:
+        {
+            auto planes = std::string(count * sizeof(double), '\0');
+
+            for (std::size_t n = 0; n < count; ++n)
+            {
+                auto b = bits_of(values[n]) ^ (n >= nf ? bits_of(values[n - nf]) : 0);
+
+                for (std::size_t p = 0; p < sizeof(double); ++p)
+                {
+                    planes[p * count + n] = char(b >> (8 * (sizeof(double) - 1 - p)));
+                }
+            }
+            run_length_encode(planes, res);
+            return res;
+        }
+        case Compression::lossy:
+        {
+            if (! (tolerance > 0.0))
+            {
+                throw std::invalid_argument("lossy compression requires a positive tolerance");
+            }
+            auto quanta = std::vector<std::int64_t>(count);
+            auto varints = std::string();
+
+            for (std::size_t n = 0; n < count; ++n)
+            {
+                auto q = std::round(values[n] / tolerance);
+
+                if (! (std::fabs(q) < 4e18))
+                {
+                    throw std::invalid_argument("value out of range for lossy compression");
+                }
+                quanta[n] = std::int64_t(q);
+
+                auto d = std::uint64_t(quanta[n]) - std::uint64_t(n >= nf ? quanta[n - nf] : 0);
+                auto z = (d << 1) ^ (std::int64_t(d) < 0 ? ~std::uint64_t(0) : 0);
+
+                while (z >= 0x80)
+                {
+                    varints.push_back(char(z | 0x80));
+                    z >>= 7;
+                }
+                varints.push_back(char(z));
+            }
+            run_length_encode(varints, res);
+            return res;
+        }
+    }
+    throw std::invalid_argument("unknown compression");
+}
+
+nd::array<double, 3> patches2d::decompress(const std::string& bytes)
+{
+    auto header = CodecHeader();
+
+    if (bytes.size() < sizeof(CodecHeader))
+    {
+        throw std::runtime_error("corrupt compressed array");
+    }
+    std::memcpy(&header, bytes.data(), sizeof(CodecHeader));
+
+    if (header.shape[0] < 0 || header.shape[1] < 0 || header.shape[2] < 0)
+    {
+        throw std::runtime_error("corrupt compressed array");
+    }
+
+    auto res = nd::array<double, 3>(header.shape[0], header.shape[1], header.shape[2]);
+    auto nf = std::size_t(header.shape[2]);
+    auto count = std::size_t(res.size());
+    auto values = std::vector<double>(count);
+    auto ptr = bytes.data() + sizeof(CodecHeader);
+    auto end = bytes.data() + bytes.size();
+
+    switch (Compression(header.compression))
+    {
+        case Compression::none:
+        {
+            if (std::size_t(end - ptr) != count * sizeof(double))
+            {
+                throw std::runtime_error("corrupt compressed array");
+            }
+            std::copy(ptr, end, reinterpret_cast<char*>(values.data()));
+            break;
+        }
+        case Compression::lossless:
+        {
+            auto planes = run_length_decode(ptr, end);
+
+            if (planes.size() != count * sizeof(double))
+            {
+                throw std::runtime_error("corrupt compressed array");
+            }
+
+            for (std::size_t n = 0; n < count; ++n)
+            {
+                auto b = std::uint64_t(0);
+
+                for (std::size_t p = 0; p < sizeof(double); ++p)
+                {
+                    b = (b << 8) | std::uint8_t(planes[p * count + n]);
+                }
+                values[n] = from_bits(b ^ (n >= nf ? bits_of(values[n - nf]) : 0));
+            }
+            break;
+        }
+        case Compression::lossy:
+        {
+            auto varints = run_length_decode(ptr, end);
+            auto quanta = std::vector<std::int64_t>(count);
+            auto m = std::size_t(0);
+
+            for (std::size_t n = 0; n < count; ++n)
+            {
+                auto z = std::uint64_t(0);
+
+                for (int shift = 0; ; shift += 7)
+                {
+                    if (m == varints.size() || shift > 63)
+                    {
+                        throw std::runtime_error("corrupt compressed array");
+                    }
+                    auto c = std::uint8_t(varints[m++]);
+                    z |= std::uint64_t(c & 0x7f) << shift;
+
+                    if (c < 0x80)
+                    {
+                        break;
+                    }
+                }
+                auto d = (z >> 1) ^ (~(z & 1) + 1);
+                quanta[n] = std::int64_t(d + std::uint64_t(n >= nf ? quanta[n - nf] : 0));
+                values[n] = double(quanta[n]) * header.tolerance;
+            }
+            break;
+        }
+        default: throw std::runtime_error("corrupt compressed array");
+    }
+
+    auto m = std::size_t(0);
+
+    for (int i = 0; i < header.shape[0]; ++i)
+    {
+        for (int j = 0; j < header.shape[1]; ++j)
+        {
+            for (int k = 0; k < header.shape[2]; ++k)
+            {
+                res(i, j, k) = values[m++];
+            }
+        }
+    }
+    return res;
+}
+
+
+
+
+// ============================================================================
+void Serializer::write_rows(std::string path, std::array<int, 3> shape, RowFill fill) const
+{
+    auto rows = nd::array<double, 3>(shape[0], shape[1], shape[2]);
+    fill(0, shape[0], rows);
+    write_array(path, rows);
+}
 
-    res.select(_|0 |ni*1, _|0 |nj*1, _) = patches.at(indexes[0]);
-    res.select(_|0 |ni*1, _|nj|nj*2, _) = patches.at(indexes[1]);
-    res.select(_|ni|ni*2, _|0 |nj*1, _) = patches.at(indexes[2]);
-    res.select(_|ni|ni*2, _|nj|nj*2, _) = patches.at(indexes[3]);
+void Serializer::write_planes(std::string path, std::array<int, 3> shape, PlaneFill fill) const
+{
+    auto res = nd::array<double, 3>(shape[0], shape[1], shape[2]);
+
+    for (int n = 0; n < shape[0]; ++n)
+    {
+        auto plane = nd::array<double, 3>(1, shape[1], shape[2]);
+        fill(n, 0, shape[1], plane);
+
+        for (int i = 0; i < shape[1]; ++i)
+        {
+            for (int j = 0; j < shape[2]; ++j)
+            {
+                res(n, i, j) = plane(0, i, j);
+            }
+        }
+    }
+    write_array(path, res);
+}
+
+std::vector<Database::Index> Serializer::read_index() const
+{
+    auto res = std::vector<Database::Index>();
 
+    for (auto patch : list_patches())
+    {
+        for (auto field : list_fields(patch))
+        {
+            res.push_back(parse_index(patch + "/" + field));
+        }
+    }
     return res;
 }
 
-nd::array<double, 3> Database::prolongation(const nd::array<double, 3>& A) const
+
+
+
+// ============================================================================
+// The binary checkpoint layout is:
+//
+//     "PATCHES1"                       8-byte magic
+//     array data                       each array 64-byte aligned, as raw
+//                                      doubles or as encoded by compress
+//     index table                      see flush
+//     index offset, "PATCHIX2"         8-byte offset and 8-byte magic
+//
+// Files written before field layouts were added end in "PATCHIDX" instead,
+// and their index table has no layouts; all of their fields are aos.
+// Strings in the index table are a 32-bit length followed by the characters.
+// ============================================================================
+namespace {
+
+    const char* binary_magic = "PATCHES1";
+    const char* binary_index_magic = "PATCHIX2";
+    const char* binary_index_magic_v1 = "PATCHIDX";
+    const std::uint64_t binary_alignment = 64;
+
+    template<typename T>
+    void put(std::string& buffer, T value)
+    {
+        buffer.append(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+
+    void put(std::string& buffer, const std::string& value)
+    {
+        put(buffer, std::uint32_t(value.size()));
+        buffer.append(value);
+    }
+
+    struct Reader
+    {
+        template<typename T>
+        T get()
+        {
+            auto value = T();
+            check(sizeof(T));
+            std::memcpy(&value, ptr, sizeof(T));
+            ptr += sizeof(T);
+            return value;
+        }
+        std::string get_string()
+        {
+            auto size = get<std::uint32_t>();
+            check(size);
+            auto value = std::string(ptr, size);
+            ptr += size;
+            return value;
+        }
+        void check(std::size_t size) const
+        {
+            if (ptr + size > end)
+            {
+                throw std::runtime_error("corrupt binary checkpoint index");
+            }
+        }
+        const char* ptr;
+        const char* end;
+    };
+}
+
+BinarySerializer::BinarySerializer(std::string filename, Mode mode)
+: mode(mode)
+, filename(filename)
 {
-    auto _ = nd::axis::all();
-    nd::array<double, 3> res(ni, nj, A.shape(2));
+    if (mode == Mode::write)
+    {
+        out.reset(new std::ofstream(filename, std::ios::binary | std::ios::trunc));
 
-    res.select(_|0|ni|2, _|0|nj|2, _) = A;
-    res.select(_|0|ni|2, _|1|nj|2, _) = A;
-    res.select(_|1|ni|2, _|0|nj|2, _) = A;
-    res.select(_|1|ni|2, _|1|nj|2, _) = A;
+        if (! *out)
+        {
+            throw std::runtime_error("could not open " + filename + " for writing");
+        }
+        out->write(binary_magic, 8);
+        position = 8;
+        return;
+    }
+
+#ifdef PATCHES_HAVE_MMAP
+    auto fd = ::open(filename.data(), O_RDONLY);
+    struct stat info;
+
+    if (fd == -1 || ::fstat(fd, &info) != 0)
+    {
+        if (fd != -1) ::close(fd);
+        throw std::runtime_error("could not open " + filename);
+    }
+    length = std::size_t(info.st_size);
+
+    if (length > 0)
+    {
+        auto mapping = ::mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        if (mapping == MAP_FAILED)
+        {
+            ::close(fd);
+            throw std::runtime_error("could not map " + filename);
+        }
+        base = static_cast<const char*>(mapping);
+    }
+    ::close(fd);
+#else
+    auto ifs = std::ifstream(filename, std::ios::binary | std::ios::ate);
+
+    if (! ifs)
+    {
+        throw std::runtime_error("could not open " + filename);
+    }
+    length = std::size_t(ifs.tellg());
+    buffer.resize((length + sizeof(double) - 1) / sizeof(double));
+    ifs.seekg(0);
+    ifs.read(reinterpret_cast<char*>(buffer.data()), length);
+    base = reinterpret_cast<const char*>(buffer.data());
+#endif
+
+    try
+    {
+        if (length < 24 || std::memcmp(base, binary_magic, 8) ||
+            (std::memcmp(base + length - 8, binary_index_magic, 8) && std::memcmp(base + length - 8, binary_index_magic_v1, 8)))
+        {
+            throw std::runtime_error(filename + " is not a binary checkpoint");
+        }
+        auto has_layouts = std::memcmp(base + length - 8, binary_index_magic, 8) == 0;
+
+        auto index_offset = std::uint64_t();
+        std::memcpy(&index_offset, base + length - 16, 8);
+
+        if (index_offset < 8 || index_offset > length - 16)
+        {
+            throw std::runtime_error("corrupt binary checkpoint index");
+        }
+
+        auto reader = Reader{base + index_offset, base + length - 16};
+        block_size[0] = reader.get<std::int32_t>();
+        block_size[1] = reader.get<std::int32_t>();
+
+        for (auto n = reader.get<std::uint32_t>(); n > 0; --n)
+        {
+            auto field = parse_field(reader.get_string());
+            auto num_fields = reader.get<std::int32_t>();
+            auto location = parse_location(reader.get_string());
+            auto layout = has_layouts ? parse_layout(reader.get_string()) : Layout::aos;
+            header.emplace(field, FieldDescriptor(num_fields, location, layout));
+        }
+
+        for (auto n = reader.get<std::uint64_t>(); n > 0; --n)
+        {
+            auto name = reader.get_string();
+            auto entry = Entry();
+            entry.offset = reader.get<std::uint64_t>();
+            entry.shape[0] = reader.get<std::int32_t>();
+            entry.shape[1] = reader.get<std::int32_t>();
+            entry.shape[2] = reader.get<std::int32_t>();
+            entry.bytes = reader.get<std::uint64_t>();
+
+            auto bytes = entry.bytes ? entry.bytes : std::uint64_t(entry.shape[0]) * entry.shape[1] * entry.shape[2] * sizeof(double);
+
+            if (entry.offset % binary_alignment || entry.offset + bytes > index_offset)
+            {
+                throw std::runtime_error("corrupt binary checkpoint index");
+            }
+            entries.emplace(name, entry);
+        }
+    }
+    catch (...)
+    {
+        unmap();
+        throw;
+    }
+}
+
+BinarySerializer::~BinarySerializer()
+{
+    if (out)
+    {
+        try
+        {
+            flush();
+        }
+        catch (...)
+        {
+        }
+        out.reset();
+    }
+
+    unmap();
+}
+
+std::vector<std::string> BinarySerializer::list_fields(std::string patch_index) const
+{
+    require(Mode::read);
+    auto res = std::vector<std::string>();
+    auto prefix = patch_index + "/";
 
+    for (auto it = entries.lower_bound(prefix); it != entries.end() && it->first.compare(0, prefix.size(), prefix) == 0; ++it)
+    {
+        res.push_back(it->first.substr(prefix.size()));
+    }
     return res;
 }
 
-nd::array<double, 3> Database::restriction(const nd::array<double, 3>& A) const
+std::vector<std::string> BinarySerializer::list_patches() const
 {
-    auto _ = nd::axis::all();
-    auto mi = A.shape(0);
-    auto mj = A.shape(1);
+    require(Mode::read);
+    auto res = std::vector<std::string>();
 
-    auto B = std::array<nd::array<double, 3>, 4>
+    for (const auto& entry : entries)
     {
-        A.select(_|0|mi|2, _|0|mj|2, _),
-        A.select(_|0|mi|2, _|1|mj|2, _),
-        A.select(_|1|mi|2, _|0|mj|2, _),
-        A.select(_|1|mi|2, _|1|mj|2, _),
-    };
-    return (B[0] + B[1] + B[2] + B[3]) * 0.25;
+        auto patch = entry.first.substr(0, entry.first.find('/'));
+
+        if (res.empty() || res.back() != patch)
+        {
+            res.push_back(patch);
+        }
+    }
+    return res;
+}
+
+nd::array<double, 3> BinarySerializer::read_array(std::string path) const
+{
+    require(Mode::read);
+    auto it = entries.find(path);
+
+    if (it != entries.end() && it->second.bytes)
+    {
+        return decompress(std::string(base + it->second.offset, it->second.bytes));
+    }
+    auto view = read_view(path);
+    auto res = nd::array<double, 3>(view.shape());
+
+    for (int i = 0; i < view.shape(0); ++i)
+    {
+        for (int j = 0; j < view.shape(1); ++j)
+        {
+            for (int k = 0; k < view.shape(2); ++k)
+            {
+                res(i, j, k) = view(i, j, k);
+            }
+        }
+    }
+    return res;
+}
+
+std::array<int, 2> BinarySerializer::read_block_size() const
+{
+    require(Mode::read);
+    return block_size;
+}
+
+Database::Header BinarySerializer::read_header() const
+{
+    require(Mode::read);
+    return header;
+}
+
+std::vector<Database::Index> BinarySerializer::read_index() const
+{
+    require(Mode::read);
+    auto res = std::vector<Database::Index>();
+
+    for (const auto& entry : entries)
+    {
+        res.push_back(parse_index(entry.first.data(), entry.first.data() + entry.first.size()));
+    }
+    return res;
+}
+
+Database::View BinarySerializer::read_view(std::string path) const
+{
+    require(Mode::read);
+    auto it = entries.find(path);
+
+    if (it == entries.end())
+    {
+        throw std::runtime_error("no array " + path + " in " + filename);
+    }
+    if (it->second.bytes)
+    {
+        return Database::View();
+    }
+    auto shape = it->second.shape;
+    auto data = reinterpret_cast<const double*>(base + it->second.offset);
+    return Database::View(data, shape, {shape[1] * shape[2], shape[2], 1});
+}
+
+void BinarySerializer::write_array(std::string path, const nd::array<double, 3>& patch) const
+{
+    require(Mode::write);
+
+    if (entries.count(path))
+    {
+        throw std::invalid_argument("array " + path + " was already written");
+    }
+    auto padding = (binary_alignment - position % binary_alignment) % binary_alignment;
+    auto shape = patch.shape();
+    auto scheme = compression.empty() ? compression.end() : compression.find(std::get<3>(parse_index(path.data(), path.data() + path.size())));
+
+    out->write(std::string(padding, '\0').data(), padding);
+
+    if (scheme != compression.end())
+    {
+        auto bytes = compress(patch, scheme->second.first, scheme->second.second);
+        out->write(bytes.data(), bytes.size());
+        entries.emplace(path, Entry{position + padding, shape, bytes.size()});
+        position += padding + bytes.size();
+        return;
+    }
+
+    auto data = std::vector<double>(patch.size());
+    auto m = std::size_t(0);
+
+    for (int i = 0; i < shape[0]; ++i)
+    {
+        for (int j = 0; j < shape[1]; ++j)
+        {
+            for (int k = 0; k < shape[2]; ++k)
+            {
+                data[m++] = patch(i, j, k);
+            }
+        }
+    }
+    out->write(reinterpret_cast<const char*>(data.data()), data.size() * sizeof(double));
+    entries.emplace(path, Entry{position + padding, shape, 0});
+    position += padding + data.size() * sizeof(double);
+}
+
+void BinarySerializer::write_rows(std::string path, std::array<int, 3> shape, RowFill fill) const
+{
+    // ------------------------------------------------------------------------
+    // The rows are written uncompressed, in strips of about 4 MB, as they are
+    // filled.
+    // ------------------------------------------------------------------------
+    require(Mode::write);
+
+    if (entries.count(path))
+    {
+        throw std::invalid_argument("array " + path + " was already written");
+    }
+    auto padding = (binary_alignment - position % binary_alignment) % binary_alignment;
+    auto row = std::size_t(shape[1]) * shape[2];
+    auto strip = int(std::max(std::size_t(1), (std::size_t(1) << 19) / std::max(row, std::size_t(1))));
+
+    out->write(std::string(padding, '\0').data(), padding);
+
+    for (int i0 = 0; i0 < shape[0]; i0 += strip)
+    {
+        auto i1 = std::min(i0 + strip, shape[0]);
+        auto rows = nd::array<double, 3>(i1 - i0, shape[1], shape[2]);
+        fill(i0, i1, rows);
+        out->write(reinterpret_cast<const char*>(&rows(0, 0, 0)), rows.size() * sizeof(double));
+    }
+    entries.emplace(path, Entry{position + padding, shape, 0});
+    position += padding + std::size_t(shape[0]) * row * sizeof(double);
+}
+
+void BinarySerializer::write_planes(std::string path, std::array<int, 3> shape, PlaneFill fill) const
+{
+    // ------------------------------------------------------------------------
+    // As for write_rows, but the strips are ranges of rows within one plane.
+    // ------------------------------------------------------------------------
+    require(Mode::write);
+
+    if (entries.count(path))
+    {
+        throw std::invalid_argument("array " + path + " was already written");
+    }
+    auto padding = (binary_alignment - position % binary_alignment) % binary_alignment;
+    auto row = std::size_t(shape[2]);
+    auto strip = int(std::max(std::size_t(1), (std::size_t(1) << 19) / std::max(row, std::size_t(1))));
+
+    out->write(std::string(padding, '\0').data(), padding);
+
+    for (int n = 0; n < shape[0]; ++n)
+    {
+        for (int i0 = 0; i0 < shape[1]; i0 += strip)
+        {
+            auto i1 = std::min(i0 + strip, shape[1]);
+            auto rows = nd::array<double, 3>(1, i1 - i0, shape[2]);
+            fill(n, i0, i1, rows);
+            out->write(reinterpret_cast<const char*>(&rows(0, 0, 0)), rows.size() * sizeof(double));
+        }
+    }
+    entries.emplace(path, Entry{position + padding, shape, 0});
+    position += padding + std::size_t(shape[0]) * shape[1] * row * sizeof(double);
+}
+
+void BinarySerializer::set_compression(Field field, Compression scheme, double tolerance)
+{
+    require(Mode::write);
+
+    if (scheme == Compression::lossy && ! (tolerance > 0.0))
+    {
+        throw std::invalid_argument("lossy compression requires a positive tolerance");
+    }
+    if (scheme == Compression::none)
+    {
+        compression.erase(field);
+    }
+    else
+    {
+        compression[field] = std::make_pair(scheme, tolerance);
+    }
+}
+
+void BinarySerializer::write_header(Database::Header h) const
+{
+    require(Mode::write);
+    header = h;
+}
+
+void BinarySerializer::write_block_size(std::array<int, 2> b) const
+{
+    require(Mode::write);
+    block_size = b;
+}
+
+void BinarySerializer::flush() const
+{
+    // ------------------------------------------------------------------------
+    // Write the index table and close the file. The index holds the block
+    // size, the header (name, number of fields, location, and layout of each
+    // field), and the name, offset, and shape of each array.
+    // ------------------------------------------------------------------------
+    if (! out)
+    {
+        return;
+    }
+    auto table = std::string();
+
+    put(table, std::int32_t(block_size[0]));
+    put(table, std::int32_t(block_size[1]));
+    put(table, std::uint32_t(header.size()));
+
+    for (const auto& field : header)
+    {
+        put(table, to_string(field.first));
+        put(table, std::int32_t(field.second.num_fields));
+        put(table, to_string(field.second.location));
+        put(table, to_string(field.second.layout));
+    }
+    put(table, std::uint64_t(entries.size()));
+
+    for (const auto& entry : entries)
+    {
+        put(table, entry.first);
+        put(table, entry.second.offset);
+        put(table, std::int32_t(entry.second.shape[0]));
+        put(table, std::int32_t(entry.second.shape[1]));
+        put(table, std::int32_t(entry.second.shape[2]));
+        put(table, entry.second.bytes);
+    }
+    put(table, position);
+    table.append(binary_index_magic, 8);
+
+    out->write(table.data(), table.size());
+    out->close();
+
+    if (! *out)
+    {
+        out.reset();
+        throw std::runtime_error("failed writing " + filename);
+    }
+    out.reset();
+}
+
+void BinarySerializer::unmap()
+{
+#ifdef PATCHES_HAVE_MMAP
+    if (base)
+    {
+        ::munmap(const_cast<char*>(base), length);
+    }
+#endif
+    base = nullptr;
+    buffer.clear();
+}
+
+void BinarySerializer::require(Mode required) const
+{
+    if (mode != required)
+    {
+        throw std::logic_error(mode == Mode::read ? "binary serializer is read-only" : "binary serializer is write-only");
+    }
 }
@@ -0,0 +1,281 @@
+#pragma once
+#include "patches.hpp"
+
+
+
+
+// ============================================================================
+namespace patches3d {
+
+
+    class Database;
+
+
+    // ========================================================================
+    using patches2d::Field;
+    using patches2d::MeshLocation;
+    using patches2d::FieldDescriptor;
+    using patches2d::ThreadPool;
+
+
+    // ========================================================================
+    enum class PatchBoundary
+    {
+        il, ir, jl, jr, kl, kr,
+    };
+}
+
+
+
+
+// ============================================================================
+class patches3d::Database
+{
+public:
+
+
+    // ========================================================================
+    using Header = std::map<Field, FieldDescriptor>;
+    using Index = std::tuple<int, int, int, int, Field>; // i, j, k, level, which
+    using Array = nd::array<double, 4>;
+
+
+    /**
+     * A callback to be invoked when a target patch's guard zone region cannot
+     * be calculated from its neighbor patches, as in the 2D database. The
+     * callback must return an array whose shape matches the patch data, but
+     * having the number of guard zones (depth) in the off-bounds axis. For
+     * example, if edge = PatchBoundary::kl and depth = 2, then the callback
+     * must return an array with shape [data.shape(0), data.shape(1), 2,
+     * data.shape(3)]. If a thread pool is set, it may be called concurrently
+     * for different target patches.
+     */
+    using BoundaryValue = std::function<Array(
+
+        Index index,        /**< Index of the target patch */
+
+        PatchBoundary edge, /**< Which face of that patch to return guard zones for */
+
+        int depth,          /**< The number of guard zones needed */
+
+        const Array& patch  /**< The data in the target patch */
+
+        )>;
+
+
+    // ========================================================================
+    /**
+     * Constructor. The block size along each axis must be even. Vertex and
+     * face_i / face_j data may be stored, with one extra element along the
+     * staggered axes; there is no face_k location yet. Every field must
+     * have the aos layout.
+     */
+    Database(int ni, int nj, int nk, Header header);
+
+
+    /**
+     * Set the callback to be invoked when a target patch's guard zone region
+     * cannot be found in neighboring patches.
+     */
+    void set_boundary_value(BoundaryValue);
+
+
+    /**
+     * Set a thread pool to be used by fetch_all and commit_all, with the same
+     * rules as for the 2D database.
+     */
+    void set_thread_pool(std::shared_ptr<ThreadPool> pool);
+
+
+    // ========================================================================
+    /**
+     * Insert a copy of the given data into the database at the given index.
+     * Any existing data at that location is overwritten. An exception is
+     * thrown if the array has the wrong shape.
+     */
+    void insert(Index index, Array data);
+
+
+    /**
+     * Remove the patch at the given index, if it exists. Returns the number
+     * of elements removed (0 or 1).
+     */
+    std::size_t erase(Index index);
+
+
+    /** Remove all patches from the database. */
+    void clear();
+
+
+    /**
+     * Commit an array to the database at the given index, as in the 2D
+     * database: the new data is data * (1 - rk_factor) + existing *
+     * rk_factor. This method should be used for updates to existing data,
+     * and an exception is thrown if no patch exists at the index.
+     */
+    void commit(Index index, const Array& data, double rk_factor=0.0);
+
+
+    // ========================================================================
+    /**
+     * Return a deep copy of the data at the patch index, padded with the
+     * given number of guard zones on each face of the patch. Guard zones are
+     * read from neighbors at the same level, prolonged from a parent one
+     * level coarser (injection), or restricted from the eight children one
+     * level finer (averaging). Only cell data can be fetched for now.
+     */
+    Array fetch(Index index, int ngil, int ngir, int ngjl, int ngjr, int ngkl, int ngkr) const;
+
+
+    /**
+     * Same as above, where the number of guard zones to be fetched is the
+     * same on each of the patch faces.
+     */
+    Array fetch(Index index, int guard) const;
+
+
+    /**
+     * Fetch every patch associated with the given field, with the given
+     * number of guard zones, running on the thread pool if one is set.
+     */
+    std::map<Index, Array> fetch_all(Field which, int guard) const;
+
+
+    /**
+     * Commit each patch in the given container, as in commit, running on the
+     * thread pool if one is set. The indexes must all exist.
+     */
+    void commit_all(std::map<Index, Array> data, double rk_factor=0.0);
+
+
+    // ========================================================================
+    /**
+     * Return a reference to the data at the given index. An exception is
+     * thrown if that patch does not exist.
+     */
+    const Array& at(Index index) const;
+
+
+    /** Return all patches registered for the given field. */
+    std::map<Index, Array> all(Field which) const;
+
+
+    /** Return an iterator to the beginning of the container of patches. */
+    auto begin() const { return patches.begin(); }
+
+
+    /** Return an iterator to the end of the container of patches. */
+    auto end() const { return patches.end(); }
+
+
+    /** Return the number of patches. */
+    std::size_t size() const { return patches.size(); }
+
+
+    /** Return the number of patches associated with the given field. */
+    std::size_t count(Field which) const;
+
+
+    /** Return the total number of cells associated with the given field. */
+    std::size_t num_cells(Field which) const;
+
+
+    /** Print a description of the patch locations. */
+    void print(std::ostream& os) const;
+
+
+private:
+    // ========================================================================
+    struct IndexHash
+    {
+        std::size_t operator()(const Index& index) const;
+    };
+
+    /**
+     * Describes where the guard zone data across one face of a patch can be
+     * read from: a patch at the same level, an octant (I, J, K) of its parent
+     * at the next coarser level, the eight children at the next finer level,
+     * ordered as in refine, or nowhere, in which case the boundary value
+     * callback is needed.
+     */
+    struct Source
+    {
+        enum class Kind { none, same_level, coarse, fine };
+        Kind kind = Kind::none;
+        std::array<const Array*, 8> data = {{nullptr, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr}};
+        int octant_i = 0;
+        int octant_j = 0;
+        int octant_k = 0;
+    };
+
+    /**
+     * One of the guard zone regions of a target patch: the region
+     * [i0, i1) x [j0, j1) x [k0, k1) of the patch across the given face, to
+     * be written at (di, dj, dk) in the padded result.
+     */
+    struct Strip
+    {
+        PatchBoundary edge;
+        int depth;
+        int i0, i1, j0, j1, k0, k1;
+        int di, dj, dk;
+    };
+
+    /**
+     * The guard zone sources for each patch, indexed by PatchBoundary, valid
+     * for as long as the topology version it was built from is current.
+     */
+    struct FillPlan
+    {
+        struct Entry
+        {
+            const Array* patch = nullptr;
+            std::array<Source, 6> edges;
+        };
+        std::size_t version = 0;
+        std::unordered_map<Index, Entry, IndexHash> patches;
+    };
+
+    /** Holds the cached fill plan; see the 2D database. */
+    struct PlanCache
+    {
+        PlanCache() {}
+        PlanCache(const PlanCache&) {}
+        PlanCache& operator=(const PlanCache&) { plan.reset(); return *this; }
+        std::shared_ptr<const FillPlan> plan;
+        std::mutex mutex;
+    };
+
+    // ========================================================================
+    int num_fields(Index index) const;
+    MeshLocation location(Index index) const;
+    std::array<int, 4> expected_shape(Index index) const;
+    std::array<Index, 8> refine(Index index) const;
+    Index coarsen(Index index) const;
+    Index neighbor(Index index, PatchBoundary edge) const;
+    Source resolve(Index index) const;
+    Array locate(const Source& source, const Strip& strip) const;
+    std::array<Strip, 6> strips(int ngil, int ngir, int ngjl, int ngjr, int ngkl, int ngkr) const;
+    std::shared_ptr<const FillPlan> fill_plan() const;
+    std::vector<Index> indexes(Field which) const;
+    void parallel_for(std::size_t count, std::function<void(std::size_t)> fn) const;
+
+    // ========================================================================
+    int ni = 0;
+    int nj = 0;
+    int nk = 0;
+    Header header;
+    std::map<Index, Array> patches;
+    std::size_t topology_version = 0;
+    mutable PlanCache plan_cache;
+    BoundaryValue boundary_value = nullptr;
+    std::shared_ptr<ThreadPool> thread_pool;
+};
+
+
+
+
+// ============================================================================
+namespace patches3d {
+    std::string to_string(Database::Index index);
+}